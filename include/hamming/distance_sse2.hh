@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <vector>
 
@@ -8,8 +9,25 @@
 
 namespace hamming {
 
-int distance_sse2(const std::vector<GeneBlock> &a,
-                  const std::vector<GeneBlock> &b,
+int distance_sse2(DenseRow a, DenseRow b,
                   int max_dist = std::numeric_limits<int>::max());
 
+std::array<int, n_partners>
+distance_sse2_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist = std::numeric_limits<int>::max());
+
+// lower triangular distances matrix of all samples in data, optionally
+// skipping the pairs excluded by pruning, or only calculating the given rows
+void distances_sse2(const DenseData &data, std::uint8_t *result, int max_dist,
+                    const LowerBoundPruning *pruning = nullptr,
+                    RowRange rows = {});
+
+void distances_sse2(const DenseData &data, std::uint16_t *result, int max_dist,
+                    const LowerBoundPruning *pruning = nullptr,
+                    RowRange rows = {});
+
+void distances_sse2(const DenseData &data, std::uint32_t *result, int max_dist,
+                    const LowerBoundPruning *pruning = nullptr,
+                    RowRange rows = {});
+
 }
@@ -1,15 +1,18 @@
 #pragma once
 
 #include "hamming/hamming_impl.hh"
+#include "hamming/hamming_storage.hh"
 #include "hamming/hamming_types.hh"
 #include "hamming/hamming_utils.hh"
 #ifdef HAMMING_WITH_OPENMP
 #include <omp.h>
 #endif
 #include <cmath>
+#include <cstring>
 #include <fmt/core.h>
 #include <fstream>
-#include <sstream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -19,98 +22,177 @@ inline std::size_t uint_sqrt(std::size_t x) {
   return static_cast<std::size_t>(std::round(std::sqrt(x)));
 }
 
+// Header of a binary DataSet file. The header is followed by the lower
+// triangular distances matrix as raw integers of dist_int_bytes bytes,
+// starting at byte distances_offset, and then by any sequence indices as
+// 64-bit unsigned integers, starting at byte sequence_indices_offset. All
+// integers are stored in native byte order, which is little-endian on all
+// supported platforms, so the distances can also be read with e.g.
+// numpy.memmap(filename, dtype=numpy.uint8, mode="r", offset=64)
+struct BinaryHeader {
+  static constexpr std::array<char, 8> expected_magic{'H', 'A', 'M', 'M',
+                                                      'D', 'I', 'S', 'T'};
+  static constexpr std::uint32_t current_version{1};
+  std::array<char, 8> magic{expected_magic};
+  std::uint32_t version{current_version};
+  std::uint32_t dist_int_bytes{0};
+  std::uint64_t nsamples{0};
+  // the maximum distance used when calculating the distances
+  std::int64_t max_distance{0};
+  std::uint64_t distances_offset{0};
+  // zero if duplicate sequences were not removed
+  std::uint64_t n_sequence_indices{0};
+  std::uint64_t sequence_indices_offset{0};
+  std::uint64_t reserved{0};
+
+  BinaryHeader() = default;
+  BinaryHeader(std::size_t dist_int_bytes, std::size_t nsamples,
+               int max_distance, std::size_t n_sequence_indices)
+      : dist_int_bytes{static_cast<std::uint32_t>(dist_int_bytes)},
+        nsamples{nsamples}, max_distance{max_distance},
+        distances_offset{64}, n_sequence_indices{n_sequence_indices} {
+    if (n_sequence_indices > 0) {
+      // the sequence indices are aligned to 8 bytes
+      sequence_indices_offset = 8 * ((distances_end() + 7) / 8);
+    }
+  }
+  std::size_t n_distances() const {
+    return nsamples == 0 ? 0 : nsamples * (nsamples - 1) / 2;
+  }
+  std::size_t distances_end() const {
+    return distances_offset + n_distances() * dist_int_bytes;
+  }
+  std::size_t file_size() const {
+    return n_sequence_indices == 0
+               ? distances_end()
+               : sequence_indices_offset + 8 * n_sequence_indices;
+  }
+};
+static_assert(sizeof(BinaryHeader) == 64);
+
+// Create a file in the binary format with the given header and sequence
+// indices, and return its distances, which are all zero, backed by the file,
+// such that changes to them are saved to the file
+template <typename DistIntType>
+DistancesStorage<DistIntType>
+create_binary_file(const std::string &filename, const BinaryHeader &header,
+                   const std::vector<std::size_t> &sequence_indices) {
+  auto file{std::make_shared<MappedFile>(filename, header.file_size())};
+  std::memcpy(file->data(), &header, sizeof(header));
+  if (!sequence_indices.empty()) {
+    std::copy(sequence_indices.cbegin(), sequence_indices.cend(),
+              reinterpret_cast<std::uint64_t *>(
+                  file->data() + header.sequence_indices_offset));
+  }
+  return DistancesStorage<DistIntType>(std::move(file), header.distances_offset,
+                                       header.n_distances());
+}
+
 template <typename DistIntType> struct DataSet {
   explicit DataSet(std::vector<std::string> &data, bool include_x = false,
                    bool clear_input_data = false,
                    std::vector<std::size_t> &&indices = {},
                    bool use_gpu = false,
-                   int max_distance = std::numeric_limits<int>::max())
-      : nsamples(data.size()), sequence_indices(std::move(indices)) {
+                   int max_distance = std::numeric_limits<int>::max(),
+                   DenseEncoding encoding = DenseEncoding::OneHot)
+      : nsamples(data.size()), sequence_indices(std::move(indices)),
+        max_distance(max_distance) {
     validate_data(data);
     result = distances<DistIntType>(data, include_x, clear_input_data, use_gpu,
-                                    max_distance);
-  }
-
-  explicit DataSet(const std::string &filename) {
-    // Determine correct dataset size
-    std::ifstream stream(filename);
-    std::string line;
-    nsamples = std::count(std::istreambuf_iterator<char>(stream),
-                          std::istreambuf_iterator<char>(), '\n');
-    result.resize(nsamples * (nsamples + 1) / 2);
-
-    // Read the data
-    stream = std::ifstream(filename);
-    std::size_t i{0};
-    std::size_t current{0};
-    while (std::getline(stream, line)) {
-      std::istringstream s(line);
-      std::string d;
-      for (std::size_t j = 0; j < current; ++j) {
-        std::getline(s, d, ',');
-        result[i++] = std::stoi(d);
-      }
-      ++current;
+                                    max_distance, encoding);
+  }
+
+  // if distances_filename is not empty, the distances are not stored in
+  // memory, but in this file in the binary format of dump_binary(), which is
+  // memory-mapped such that the matrix can be larger than the available RAM
+  explicit DataSet(Sequences &data, bool include_x = false,
+                   std::vector<std::size_t> &&indices = {},
+                   bool use_gpu = false,
+                   int max_distance = std::numeric_limits<int>::max(),
+                   const std::string &distances_filename = {},
+                   DenseEncoding encoding = DenseEncoding::OneHot)
+      : nsamples(data.size()), sequence_indices(std::move(indices)),
+        max_distance(max_distance) {
+    validate_data(data);
+    if (distances_filename.empty()) {
+      result = distances<DistIntType>(data, include_x, use_gpu, max_distance,
+                                      encoding);
+      return;
     }
+    result = create_binary_file<DistIntType>(
+        distances_filename,
+        BinaryHeader(sizeof(DistIntType), nsamples, max_distance,
+                     sequence_indices.size()),
+        sequence_indices);
+    distances(data, result.data(), include_x, use_gpu, max_distance, encoding);
+    result.flush();
   }
 
+  explicit DataSet(const std::string &filename)
+      : DataSet(read_lower_triangular<DistIntType>(filename, true)) {}
+
   explicit DataSet(std::vector<DistIntType> &&distances)
       : result{std::move(distances)} {
     // infer n from number of lower triangular matrix elements = n(n-1)/2
     nsamples = (uint_sqrt(8 * result.size() + 1) + 1) / 2;
   }
 
+  DataSet(std::size_t nsamples, DistancesStorage<DistIntType> &&distances,
+          std::vector<std::size_t> &&indices = {},
+          int max_distance = std::numeric_limits<int>::max())
+      : nsamples(nsamples), result(std::move(distances)),
+        sequence_indices(std::move(indices)), max_distance(max_distance) {}
+
   void dump(const std::string &filename) {
-    std::ofstream stream(filename);
-    for (std::size_t i = 0; i < nsamples; ++i) {
-      for (std::size_t j = 0; j < nsamples; ++j) {
-        stream << (*this)[{i, j}];
-        if (j != nsamples - 1)
-          stream << ", ";
-      }
-      stream << std::endl;
-    }
+    write_full_matrix(filename, result, nsamples);
   }
 
   void dump_lower_triangular(const std::string &filename) {
     write_lower_triangular(filename, result);
   }
 
-  void dump_sparse(const std::string &filename, int threshold) {
-    std::ofstream stream(filename);
-#ifdef HAMMING_WITH_OPENMP
-    constexpr std::size_t samples_per_thread{200};
-#pragma omp parallel for schedule(static, 1) default(none)                     \
-    shared(result, stream, nsamples, samples_per_thread, threshold)
-    for (std::size_t i_start = 1; i_start < nsamples;
-         i_start += samples_per_thread) {
-      std::size_t i_end{std::min(i_start + samples_per_thread, nsamples)};
-      std::size_t offset{i_start * (i_start - 1) / 2};
-      auto *d = result.data() + offset;
-      std::string thread_local_lines;
-      for (std::size_t i = i_start; i < i_end; ++i) {
-        for (std::size_t j = 0; j < i; ++j) {
-          if (*d <= threshold) {
-            thread_local_lines.append(
-                fmt::format("{} {} {}\n", i, j, static_cast<int>(*d)));
-          }
-          ++d;
-        }
-      }
-#pragma omp critical
-      stream << thread_local_lines;
+  // write the distances and sequence indices in the binary format described
+  // by BinaryHeader, which can be loaded without parsing using from_binary()
+  void dump_binary(const std::string &filename) const {
+    BinaryHeader header(sizeof(DistIntType), nsamples, max_distance,
+                        sequence_indices.size());
+    std::ofstream stream(filename, std::ios::binary);
+    stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    stream.write(reinterpret_cast<const char *>(result.data()),
+                 static_cast<std::streamsize>(header.distances_end() -
+                                              header.distances_offset));
+    if (!sequence_indices.empty()) {
+      std::array<char, 8> padding{};
+      stream.write(padding.data(), static_cast<std::streamsize>(
+                                       header.sequence_indices_offset -
+                                       header.distances_end()));
+      std::vector<std::uint64_t> indices(sequence_indices.begin(),
+                                         sequence_indices.end());
+      stream.write(reinterpret_cast<const char *>(indices.data()),
+                   static_cast<std::streamsize>(indices.size() *
+                                                sizeof(std::uint64_t)));
     }
-#else
-    auto *d = result.data();
-    for (std::size_t i = 1; i < nsamples; ++i) {
-      for (std::size_t j = 0; j < i; ++j) {
-        if (*d <= threshold) {
-          stream << fmt::format("{} {} {}\n", i, j, static_cast<int>(*d));
-        }
-        ++d;
-      }
+    if (!stream) {
+      throw std::runtime_error("Error: Failed to write file '" + filename +
+                               "'");
     }
-#endif
+  }
+
+  void dump_sparse(const std::string &filename, int threshold) {
+    write_sparse(filename, result, threshold);
+  }
+
+  // Dump the distances not above threshold in the same order as
+  // dump_sparse(), but as binary records of (int32 i, int32 j, DistIntType d)
+  void dump_sparse_binary(const std::string &filename, int threshold) {
+    write_sparse_binary(filename, result, nsamples, threshold, false);
+  }
+
+  // Dump the distances not above threshold in the same order as
+  // dump_sparse(), but as a numpy .npz file which can be loaded as a lower
+  // triangular coo matrix with scipy.sparse.load_npz
+  void dump_sparse_npz(const std::string &filename, int threshold) {
+    write_sparse_binary(filename, result, nsamples, threshold, true);
   }
 
   void dump_sequence_indices(const std::string &filename) {
@@ -138,31 +220,83 @@ template <typename DistIntType> struct DataSet {
   }
 
   std::size_t nsamples;
-  std::vector<DistIntType> result;
+  DistancesStorage<DistIntType> result;
   std::vector<std::size_t> sequence_indices{};
+  int max_distance{std::numeric_limits<int>::max()};
 };
 
 DataSet<DefaultDistIntType>
 from_stringlist(std::vector<std::string> &data, bool include_x = false,
                 bool use_gpu = false,
-                int max_distance = std::numeric_limits<int>::max());
+                int max_distance = std::numeric_limits<int>::max(),
+                DenseEncoding encoding = DenseEncoding::OneHot);
 
 DataSet<DefaultDistIntType> from_csv(const std::string &filename);
 
 template <typename DistIntType>
 DataSet<DistIntType> from_lower_triangular(const std::string &filename) {
-  std::vector<DistIntType> distances;
-  std::ifstream stream(filename);
-  std::string line;
-  while (std::getline(stream, line)) {
-    std::istringstream s(line);
-    std::string d;
-    while (s.good()) {
-      std::getline(s, d, ',');
-      distances.push_back(safe_int_cast<DistIntType>(std::stoi(d)));
-    }
+  return DataSet(read_lower_triangular<DistIntType>(filename));
+}
+
+// Load a DataSet written by dump_binary(). The distances are not read, but are
+// backed by a private memory mapping of the file, so changes are not saved.
+template <typename DistIntType>
+DataSet<DistIntType> from_binary(const std::string &filename) {
+  auto file{std::make_shared<MappedFile>(filename, MapMode::CopyOnWrite)};
+  auto invalid_file = [&filename](const std::string &reason) {
+    return std::runtime_error("Error: Invalid binary file '" + filename +
+                              "': " + reason);
+  };
+  BinaryHeader header;
+  if (file->size() < sizeof(header)) {
+    throw invalid_file("too small");
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (header.magic != BinaryHeader::expected_magic) {
+    throw invalid_file("not a hammingdist binary file");
   }
-  return DataSet(std::move(distances));
+  if (header.version != BinaryHeader::current_version) {
+    throw invalid_file("unsupported version " +
+                       std::to_string(header.version));
+  }
+  if (header.dist_int_bytes != sizeof(DistIntType)) {
+    throw invalid_file("distances are " +
+                       std::to_string(header.dist_int_bytes) +
+                       "-byte integers, expected " +
+                       std::to_string(sizeof(DistIntType)));
+  }
+  // the counts are checked against the number of elements that fit in the
+  // file before any offsets are calculated from them, which could overflow
+  std::size_t nsamples{header.nsamples};
+  std::size_t n_indices{header.n_sequence_indices};
+  std::size_t distances_offset{header.distances_offset};
+  std::size_t indices_offset{header.sequence_indices_offset};
+  if (distances_offset % sizeof(DistIntType) != 0 ||
+      distances_offset > file->size()) {
+    throw invalid_file("truncated");
+  }
+  std::size_t max_distances{(file->size() - distances_offset) /
+                            sizeof(DistIntType)};
+  // nsamples * (nsamples - 1) / 2 <= max_distances, without overflow
+  if (nsamples > 1 && nsamples - 1 > 2 * max_distances / nsamples) {
+    throw invalid_file("truncated");
+  }
+  if (n_indices > 0 &&
+      (indices_offset % 8 != 0 || indices_offset > file->size() ||
+       n_indices > (file->size() - indices_offset) / 8)) {
+    throw invalid_file("truncated");
+  }
+  std::vector<std::uint64_t> indices(n_indices);
+  if (n_indices > 0) {
+    std::memcpy(indices.data(), file->data() + header.sequence_indices_offset,
+                n_indices * 8);
+  }
+  return DataSet<DistIntType>(
+      header.nsamples,
+      DistancesStorage<DistIntType>(std::move(file), header.distances_offset,
+                                    header.n_distances()),
+      std::vector<std::size_t>(indices.begin(), indices.end()),
+      static_cast<int>(header.max_distance));
 }
 
 template <typename DistIntType>
@@ -170,17 +304,30 @@ DataSet<DistIntType>
 from_fasta(const std::string &filename, bool include_x = false,
            bool remove_duplicates = false, std::size_t n = 0,
            bool use_gpu = false,
-           int max_distance = std::numeric_limits<int>::max()) {
-  auto [data, sequence_indices] = read_fasta(filename, remove_duplicates, n);
-  return DataSet<DistIntType>(data, include_x, true,
-                              std::move(sequence_indices), use_gpu,
-                              max_distance);
+           int max_distance = std::numeric_limits<int>::max(),
+           const std::string &distances_filename = {},
+           DenseEncoding encoding = DenseEncoding::OneHot) {
+  // the sequences are encoded directly from the file, without first copying
+  // them all into strings
+  FastaFile fasta(filename, n);
+  std::vector<std::size_t> sequence_indices;
+  std::vector<std::size_t> records;
+  if (remove_duplicates) {
+    sequence_indices = fasta.unique_sequence_indices(&records);
+  }
+  Sequences data(fasta, std::move(records));
+  return DataSet<DistIntType>(data, include_x, std::move(sequence_indices),
+                              use_gpu, max_distance, distances_filename,
+                              encoding);
 }
 
+// on the CPU, the distances are calculated and written in blocks of rows that
+// use at most buffer_bytes of memory
 void from_fasta_to_lower_triangular(
     const std::string &input_filename, const std::string &output_filename,
     bool remove_duplicates = false, std::size_t n = 0, bool use_gpu = false,
-    int max_distance = std::numeric_limits<int>::max());
+    int max_distance = std::numeric_limits<int>::max(),
+    std::size_t buffer_bytes = std::size_t{1} << 30);
 
 ReferenceDistIntType distance(const std::string &seq0, const std::string &seq1,
                               bool include_x = false);
@@ -190,6 +337,32 @@ fasta_reference_distances(const std::string &reference_sequence,
                           const std::string &fasta_file,
                           bool include_x = false);
 
+// distances of each sequence in fasta_file from each of the references, as
+// a row-major matrix with one row of distances for each reference
+std::vector<ReferenceDistIntType>
+fasta_reference_distances(const std::vector<std::string> &reference_sequences,
+                          const std::string &fasta_file,
+                          bool include_x = false);
+
+// Write all pairs of samples i > j with distance(i, j) <= threshold to
+// stream, in the same format as DataSet::dump_sparse(), without calculating
+// the full distances matrix
+void threshold_pairs(const Sequences &data, int threshold,
+                     std::ostream &stream);
+
+void threshold_pairs(const std::vector<std::string> &data, int threshold,
+                     std::ostream &stream);
+
+// Write the pairs of sequences in fasta_file with distance <= threshold to
+// output_filename, as threshold_pairs() does. The row and column of each pair
+// are indices of the sequences after any duplicates are removed. Returns the
+// index used in the output for each sequence in fasta_file, as given by
+// fasta_sequence_indices() if remove_duplicates is true.
+std::vector<std::size_t>
+fasta_threshold_pairs(const std::string &fasta_file,
+                      const std::string &output_filename, int threshold,
+                      bool remove_duplicates = false, std::size_t n = 0);
+
 std::vector<std::size_t> fasta_sequence_indices(const std::string &fasta_file,
                                                 std::size_t n = 0);
 
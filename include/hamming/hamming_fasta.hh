@@ -0,0 +1,99 @@
+#pragma once
+
+#include "hamming/hamming_mapped_file.hh"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace hamming {
+
+// The records of a fasta file: the first line and each line that starts with
+// '>' is a header, and the sequence of each record is the concatenation of the
+// lines that follow its header. The file is memory-mapped, the records are
+// located by all threads in parallel, and sequences are only copied from the
+// file when they are requested.
+//
+// A gzip compressed file is decompressed to a TemporaryFile in temp_directory
+// (the system temporary directory if it is empty), which is memory-mapped in
+// the same way, so the decompressed contents do not have to fit in memory
+// unless the directory is a tmpfs. The blocks of a BGZF file are decompressed
+// by all threads in parallel.
+class FastaFile {
+public:
+  // only the first n records are used, or all records if n is zero
+  explicit FastaFile(const std::string &filename, std::size_t n = 0,
+                     const std::string &temp_directory = {});
+  // number of records
+  std::size_t size() const { return sequence_begin_.size(); }
+  // sequence of record i
+  std::string sequence(std::size_t i) const;
+  // sequence of record i: a view of the file if the sequence is a single line,
+  // otherwise a view of buffer, into which the lines are copied
+  std::string_view sequence_view(std::size_t i, std::string &buffer) const;
+  // length of the sequence of record i, without copying it
+  std::size_t sequence_length(std::size_t i) const;
+  // sequences of records [begin, end), copied in parallel
+  std::vector<std::string> sequences(std::size_t begin, std::size_t end) const;
+  // sequences of the given records, copied in parallel
+  std::vector<std::string>
+  sequences(const std::vector<std::size_t> &records) const;
+  // index of the unique sequence of each record, where the unique sequences
+  // are numbered in order of first occurrence. If first_records is not null,
+  // the first record with each unique sequence is appended to it.
+  std::vector<std::size_t> unique_sequence_indices(
+      std::vector<std::size_t> *first_records = nullptr) const;
+
+private:
+  void append_sequence(std::size_t i, std::string &seq) const;
+  MappedFile file_;
+  // the decompressed contents of a compressed file, which are unmapped before
+  // the temporary file is removed
+  std::unique_ptr<TemporaryFile> decompressed_file_{};
+  std::unique_ptr<MappedFile> decompressed_{};
+  const char *data_{nullptr};
+  std::size_t size_{0};
+  // range of bytes in the file that contains the sequence lines of each record
+  std::vector<std::size_t> sequence_begin_{};
+  std::vector<std::size_t> sequence_end_{};
+};
+
+// The sequences of a set of samples, which are either strings in memory, or
+// records of a fasta file that are only read from the file when they are used,
+// so that the sequences can be encoded without all being in memory as strings
+class Sequences {
+public:
+  Sequences(const std::vector<std::string> &data) : data_{&data} {}
+  // if release_data is true, release() clears data
+  Sequences(std::vector<std::string> &data, bool release_data)
+      : data_{&data}, releasable_data_{release_data ? &data : nullptr} {}
+  // the given records of fasta, or all of its records if records is empty
+  explicit Sequences(const FastaFile &fasta,
+                     std::vector<std::size_t> records = {});
+  // number of samples
+  std::size_t size() const {
+    return fasta_ == nullptr ? data_->size() : records_.size();
+  }
+  bool empty() const { return size() == 0; }
+  // number of genes in sample i
+  std::size_t length(std::size_t i) const {
+    return fasta_ == nullptr ? (*data_)[i].size()
+                             : fasta_->sequence_length(records_[i]);
+  }
+  // sequence of sample i, which may be a view of buffer
+  std::string_view get(std::size_t i, std::string &buffer) const {
+    return fasta_ == nullptr ? std::string_view{(*data_)[i]}
+                             : fasta_->sequence_view(records_[i], buffer);
+  }
+  // free the memory used by strings that are no longer needed, if allowed
+  void release();
+
+private:
+  const std::vector<std::string> *data_{nullptr};
+  std::vector<std::string> *releasable_data_{nullptr};
+  const FastaFile *fasta_{nullptr};
+  std::vector<std::size_t> records_{};
+};
+
+} // namespace hamming
@@ -1,12 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <charconv>
 #include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <limits>
+#include <numeric>
 #include <string>
+#include <utility>
 #include <vector>
 #ifdef HAMMING_WITH_OPENMP
 #include <omp.h>
@@ -14,7 +17,10 @@
 #ifdef HAMMING_WITH_CUDA
 #include "hamming/distance_cuda.hh"
 #endif
+#include "hamming/hamming_fasta.hh"
 #include "hamming/hamming_impl_types.hh"
+#include "hamming/hamming_progress.hh"
+#include "hamming/hamming_tiles.hh"
 #include "hamming/hamming_types.hh"
 
 namespace hamming {
@@ -27,49 +33,181 @@ inline bool cuda_gpu_available() {
 #endif
 }
 
-typedef int (*distance_func_ptr)(const std::vector<GeneBlock> &,
-                                 const std::vector<GeneBlock> &, int);
+typedef int (*distance_func_ptr)(DenseRow, DenseRow, int);
 
 distance_func_ptr get_fastest_supported_distance_func();
 
+typedef std::array<int, n_partners> (*distance_1x4_func_ptr)(
+    DenseRow, const std::array<DenseRow, n_partners> &, int);
+
+distance_1x4_func_ptr get_fastest_supported_distance_1x4_func();
+
+typedef int (*distance_sparse_func_ptr)(const SparseData &, const SparseData &,
+                                        int);
+
+distance_sparse_func_ptr get_fastest_supported_distance_sparse_func();
+
+// lower triangular distances matrix of all samples in data, using the fastest
+// supported SIMD implementation, optionally skipping the pairs excluded by
+// pruning
+void distances_cpu(const DenseData &data, std::uint8_t *result, int max_dist,
+                   const LowerBoundPruning *pruning = nullptr);
+
+void distances_cpu(const DenseData &data, std::uint16_t *result, int max_dist,
+                   const LowerBoundPruning *pruning = nullptr);
+
+void distances_cpu(const DenseData &data, std::uint32_t *result, int max_dist,
+                   const LowerBoundPruning *pruning = nullptr);
+
+void distances_cpu(const BitPlaneData &data, std::uint8_t *result,
+                   int max_dist, const LowerBoundPruning *pruning = nullptr);
+
+void distances_cpu(const BitPlaneData &data, std::uint16_t *result,
+                   int max_dist, const LowerBoundPruning *pruning = nullptr);
+
+void distances_cpu(const BitPlaneData &data, std::uint32_t *result,
+                   int max_dist, const LowerBoundPruning *pruning = nullptr);
+
+// write the lower triangular distances matrix of all samples in data to
+// filename, using at most buffer_bytes to store blocks of distances. Each
+// block is calculated with the sparse, mixed or dense kernels as chosen by
+// dense_sample_indices(). data is released once the sequences have been
+// encoded.
+void distances_cpu_to_lower_triangular(Sequences &data,
+                                       const std::string &filename,
+                                       int max_distance,
+                                       std::size_t buffer_bytes);
+
+// lower triangular distances matrix of all samples in data, using posting
+// lists of the samples that differ from the reference at each position. If
+// indices is not empty, only the pairs of these samples, which must be in
+// ascending order, are calculated and stored at their positions in result.
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint8_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices = {});
+
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint16_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices = {});
+
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint32_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices = {});
+
+// lower triangular distances matrix of all samples, where the samples with
+// indices dense_indices are also stored (in this order) in dense, using the
+// sparse, dense or mixed sparse x dense kernel for each pair of samples.
+// reference is the dense encoding of the reference sequence of sparse.
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint8_t *result, int max_dist);
+
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint16_t *result, int max_dist);
+
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint32_t *result, int max_dist);
+
+// indices of the samples that use the dense format: on the CPU, each sample
+// with < 0.5% of values that differ from the reference genome uses the sparse
+// format, and the rest use the dense format
+std::vector<std::size_t>
+dense_sample_indices(const std::vector<SparseData> &sparse,
+                     std::size_t sample_length, bool include_x, bool use_gpu);
+
+// sorted order of the samples, and the pairs of samples whose distance is
+// known to be at least max_dist from their differences to a consensus sequence
+LowerBoundPruning make_lower_bound_pruning(const Sequences &data,
+                                           int max_dist);
+
 std::array<GeneBlock, 256> lookupTable(bool include_x = false);
 
+// lookup table for a dense encoding with one gene per GeneBlock, for which the
+// dense distance kernels count X as a valid char
+std::array<GeneBlock, 256> lookupTableWide();
+
+std::array<std::uint8_t, 256> bitPlaneLookupTable();
+
 template <typename DistIntType>
 DistIntType
 safe_int_cast(int x,
               DistIntType max_x = std::numeric_limits<DistIntType>::max()) {
-  if (x > max_x) {
+  if (std::cmp_greater(x, max_x)) {
     return max_x;
   }
   return static_cast<DistIntType>(x);
 }
 
-void validate_data(const std::vector<std::string> &data);
+void validate_data(const Sequences &data);
 
 int distance_sparse(const SparseData &a, const SparseData &b,
                     int max_dist = std::numeric_limits<int>::max());
 
-int distance_cpp(const std::vector<GeneBlock> &a,
-                 const std::vector<GeneBlock> &b,
+// distance between sparse sample a and dense sample b, given the dense
+// reference sequence of a, and the distance between this reference and b
+int distance_sparse_dense(const SparseData &a, DenseRow b, DenseRow reference,
+                          int reference_distance,
+                          int max_dist = std::numeric_limits<int>::max());
+
+int distance_cpp(DenseRow a, DenseRow b,
+                 int max_dist = std::numeric_limits<int>::max());
+
+std::array<int, n_partners>
+distance_cpp_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
                  int max_dist = std::numeric_limits<int>::max());
 
-std::vector<SparseData> to_sparse_data(const std::vector<std::string> &data,
+int distance_cpp_bitplane(BitPlaneRow a, BitPlaneRow b,
+                          int max_dist = std::numeric_limits<int>::max());
+
+// the most common gene at each position
+std::string get_reference_expression(const Sequences &data,
+                                     bool include_x);
+
+std::vector<SparseData> to_sparse_data(const Sequences &data,
+                                       bool include_x);
+
+std::vector<SparseData> to_sparse_data(const Sequences &data,
+                                       const std::string &reference,
                                        bool include_x);
 
-std::vector<std::vector<GeneBlock>>
-to_dense_data(const std::vector<std::string> &data);
+DenseData to_dense_data(const Sequences &data,
+                        bool include_x = false);
+
+// dense encoding of the samples with the given indices only
+DenseData to_dense_data(const Sequences &data,
+                        const std::vector<std::size_t> &indices,
+                        bool include_x = false);
+
+BitPlaneData to_bitplane_data(const Sequences &data);
+
+BitPlaneData to_bitplane_data(const Sequences &data,
+                              const std::vector<std::size_t> &indices);
 
 std::pair<std::vector<std::string>, std::vector<std::size_t>>
 read_fasta(const std::string &filename, bool remove_duplicates = false,
            std::size_t n = 0);
 
-std::vector<GeneBlock> from_string(const std::string &str);
+std::vector<GeneBlock> from_string(const std::string &str,
+                                   bool include_x = false);
 
+std::vector<BitPlaneWord> from_string_bitplane(const std::string &str);
+
+// lower triangular distances matrix of all samples in data, written to
+// result, which has (n-1)n/2 zero elements. data is released once the
+// sequences have been encoded.
 template <typename DistIntType>
-std::vector<DistIntType> distances(std::vector<std::string> &data,
-                                   bool include_x, bool clear_input_data,
-                                   bool use_gpu, int max_distance) {
-  std::vector<DistIntType> result((data.size() - 1) * data.size() / 2, 0);
+void distances(Sequences &data, DistIntType *result, bool include_x,
+               bool use_gpu, int max_distance,
+               DenseEncoding encoding = DenseEncoding::OneHot) {
+  std::size_t n_distances{(data.size() - 1) * data.size() / 2};
   auto max_dist = safe_int_cast<DistIntType>(max_distance);
   auto start_time = std::chrono::high_resolution_clock::now();
   auto print_timing = [&start_time](const std::string &event,
@@ -92,87 +230,129 @@ std::vector<DistIntType> distances(std::vector<std::string> &data,
                              "please set use_gpu=False");
   }
 #endif
-  auto sparse = to_sparse_data(data, include_x);
-  std::size_t nsamples{data.size()};
-  std::size_t sample_length{data[0].size()};
-
+  // the GPU distance kernels have not yet been verified with the include_x
+  // dense encoding
   if (include_x && use_gpu) {
     throw std::runtime_error("use_gpu=True cannot be used if include_x=True, "
                              "please set use_gpu=False");
   }
+  // the calculation is the only stage, with one unit of work per distance
+  auto &progress{Progress::current()};
+  progress.start(n_distances);
+  auto reference = get_reference_expression(data, include_x);
+  auto sparse = to_sparse_data(data, reference, include_x);
+  std::size_t sample_length{data.length(0)};
 
-  // if X is included, we have to use the sparse distance function
-  bool use_sparse = include_x;
-  // otherwise, use heuristic to choose distance function: if < 0.5% of values
-  // differ from reference genome, and we're using the CPU, use sparse distance
-  // function
-  if (!include_x && !use_gpu) {
-    constexpr double sparse_threshold{0.005};
-    std::size_t n_diff{0};
-    for (const auto &s : sparse) {
-      n_diff += s.size() / 2;
-    }
-    double frac_diff{static_cast<double>(n_diff) /
-                     static_cast<double>(nsamples * sample_length)};
-    use_sparse = frac_diff < sparse_threshold;
+  auto dense_indices{
+      dense_sample_indices(sparse, sample_length, include_x, use_gpu)};
+  if (dense_indices.empty()) {
+    std::cout << "# hammingdist :: Using CPU with sparse distance function "
+                 "and inverted index..."
+              << std::endl;
+    data.release();
+    print_timing("pre-processing");
+    // the number of counter increments with the inverted index is the number
+    // of (pair, position) combinations where both samples differ from the
+    // reference, which is never more than the cost of merging the mutation
+    // lists of each pair
+    distances_inverted_index(sparse, sample_length, result, max_dist);
+    progress.throw_if_cancelled();
+    print_timing("distance calculation", true);
+    return;
+  }
+
+  if (dense_indices.size() < sparse.size()) {
+    std::cout << "# hammingdist :: Using CPU with sparse distance function for "
+              << sparse.size() - dense_indices.size() << " and dense for "
+              << dense_indices.size() << " samples..." << std::endl;
+    auto dense = to_dense_data(data, dense_indices);
+    // same stride as dense, so the reference can be compared to its rows
+    auto dense_reference = to_dense_data(std::vector<std::string>{reference});
+    data.release();
+    print_timing("pre-processing");
+    distances_mixed(sparse, dense, dense_indices, dense_reference[0],
+                    result, max_dist);
+    progress.throw_if_cancelled();
+    print_timing("distance calculation", true);
+    return;
+  }
+  sparse.clear();
+
+  // on the CPU, sort the samples to skip the pairs whose lower bound is
+  // already max_dist, if this is a significant fraction of all pairs
+  LowerBoundPruning pruning;
+  if (!use_gpu) {
+    pruning = make_lower_bound_pruning(data, max_dist);
   }
-  if (use_sparse) {
-    std::cout << "# hammingdist :: Using CPU with sparse distance function..."
+  const LowerBoundPruning *pruning_ptr{nullptr};
+  if (8 * pruning.n_pruned >= n_distances && pruning.n_pruned > 0) {
+    std::cout << "# hammingdist :: Skipping " << pruning.n_pruned << " of "
+              << n_distances << " distances using lower bounds..."
               << std::endl;
-    if (clear_input_data) {
-      data.clear();
-    }
+    pruning_ptr = &pruning;
+  }
+
+  // the bit-plane encoding does not support X
+  if (encoding == DenseEncoding::BitPlane && !use_gpu && !include_x) {
+    auto bitplanes = pruning_ptr == nullptr
+                         ? to_bitplane_data(data)
+                         : to_bitplane_data(data, pruning.order);
+    data.release();
     print_timing("pre-processing");
-#ifdef HAMMING_WITH_OPENMP
-#pragma omp parallel for default(none)                                         \
-    shared(result, sparse, nsamples, max_dist)
-#endif
-    for (std::size_t i = 0; i < nsamples; ++i) {
-      std::size_t offset{i * (i - 1) / 2};
-      for (std::size_t j = 0; j < i; ++j) {
-        result[offset + j] = safe_int_cast<DistIntType>(
-            distance_sparse(sparse[i], sparse[j], max_dist));
-      }
-    }
+    distances_cpu(bitplanes, result, max_dist, pruning_ptr);
+    progress.throw_if_cancelled();
     print_timing("distance calculation", true);
-    return result;
+    return;
   }
 
   // otherwise use the fastest supported dense distance function
-  auto dense = to_dense_data(data);
-  if (clear_input_data) {
-    data.clear();
-  }
+  auto dense = pruning_ptr == nullptr
+                   ? to_dense_data(data, include_x)
+                   : to_dense_data(data, pruning.order, include_x);
+  data.release();
 
 #ifdef HAMMING_WITH_CUDA
   if (use_gpu) {
     std::cout << "# hammingdist :: Using GPU..." << std::endl;
     print_timing("pre-processing");
+    std::vector<DistIntType> gpu_result;
     if constexpr (sizeof(DistIntType) == 1) {
-      return distances_cuda_8bit(dense, max_dist);
+      gpu_result = distances_cuda_8bit(dense, max_dist);
     } else if constexpr (sizeof(DistIntType) == 2) {
-      return distances_cuda_16bit(dense, max_dist);
+      gpu_result = distances_cuda_16bit(dense, max_dist);
     } else {
       throw std::runtime_error("No GPU implementation available");
     }
+    std::copy(gpu_result.cbegin(), gpu_result.cend(), result);
+    return;
   }
 #endif
 
-  auto distance_func{get_fastest_supported_distance_func()};
   print_timing("pre-processing");
-#ifdef HAMMING_WITH_OPENMP
-#pragma omp parallel for schedule(static, 1) default(none)                     \
-    shared(result, dense, nsamples, distance_func, max_dist)
-#endif
-  for (std::size_t i = 0; i < nsamples; ++i) {
-    std::size_t offset{i * (i - 1) / 2};
-    for (std::size_t j = 0; j < i; ++j) {
-      result[offset + j] = safe_int_cast<DistIntType>(
-          distance_func(dense[i], dense[j], max_dist));
-    }
-  }
+  distances_cpu(dense, result, max_dist, pruning_ptr);
+  progress.throw_if_cancelled();
   print_timing("distance calculation", true);
+}
+
+// lower triangular distances matrix of all samples in data, which is released
+// once the sequences have been encoded
+template <typename DistIntType>
+std::vector<DistIntType>
+distances(Sequences &data, bool include_x, bool use_gpu, int max_distance,
+          DenseEncoding encoding = DenseEncoding::OneHot) {
+  std::vector<DistIntType> result((data.size() - 1) * data.size() / 2, 0);
+  distances(data, result.data(), include_x, use_gpu, max_distance, encoding);
   return result;
 }
 
+template <typename DistIntType>
+std::vector<DistIntType>
+distances(std::vector<std::string> &data, bool include_x, bool clear_input_data,
+          bool use_gpu, int max_distance,
+          DenseEncoding encoding = DenseEncoding::OneHot) {
+  Sequences sequences(data, clear_input_data);
+  return distances<DistIntType>(sequences, include_x, use_gpu, max_distance,
+                                encoding);
+}
+
 } // namespace hamming
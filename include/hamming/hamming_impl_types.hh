@@ -1,15 +1,263 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
+#include <new>
+#include <vector>
+
+// force inlining of SIMD kernels into the loops that call them
+#if defined(_MSC_VER)
+#define HAMMING_ALWAYS_INLINE __forceinline
+#else
+#define HAMMING_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
 
 namespace hamming {
 
 // 4-bit representation of gene:
 using GeneBlock = std::uint8_t;
-using SparseData = std::vector<std::size_t>;
 constexpr std::size_t n_bits_per_gene{4};
 constexpr GeneBlock mask_gene0{0x0f};
 constexpr GeneBlock mask_gene1{0xf0};
 
+// Sparse representation of a sample: the genes that differ from a reference
+// sequence, stored as a structure of arrays
+struct SparseData {
+  // positions of the genes that differ from the reference, in ascending order
+  std::vector<std::uint32_t> positions{};
+  // the lookupTable() codes of these genes
+  std::vector<GeneBlock> codes{};
+  // the number of these genes that are not '-'
+  int n_nondash{0};
+  std::size_t size() const { return positions.size(); }
+};
+
+// The distance between two sparse samples is the number of non-'-' genes in
+// each, minus a correction for each position where both differ from the
+// reference. This is the correction for codes ca and cb at such a position.
+inline int sparse_code_correction(GeneBlock ca, GeneBlock cb) {
+  bool nodash_a{ca != 0xff};
+  bool nodash_b{cb != 0xff};
+  bool differ{((ca & cb) == 0) || (ca != cb && nodash_a && nodash_b)};
+  return static_cast<int>(nodash_a) + static_cast<int>(nodash_b) -
+         static_cast<int>(differ);
+}
+
+// Sum of the corrections for positions a.positions[ia...] and
+// b.positions[ib...], using a branchless merge.
+inline int sparse_overlap_correction(const SparseData &a, std::size_t ia,
+                                     const SparseData &b, std::size_t ib) {
+  int r{0};
+  while (ia < a.size() && ib < b.size()) {
+    auto pa{a.positions[ia]};
+    auto pb{b.positions[ib]};
+    r += static_cast<int>(pa == pb) *
+         sparse_code_correction(a.codes[ia], b.codes[ib]);
+    ia += static_cast<std::size_t>(pa <= pb);
+    ib += static_cast<std::size_t>(pb <= pa);
+  }
+  return r;
+}
+
+// Rows of the distances matrix sorted such that, for each row i, the distances
+// to all rows j < first_col[i] are known to be at least max_dist, so these
+// pairs form a contiguous range that can be skipped
+struct LowerBoundPruning {
+  // original index of each sorted row
+  std::vector<std::size_t> order{};
+  // first sorted row j whose distance to sorted row i needs to be calculated
+  std::vector<std::size_t> first_col{};
+  // number of pairs that are skipped
+  std::size_t n_pruned{0};
+  // index of the first stored element, if only some rows of the distances
+  // matrix are stored
+  std::size_t index_offset{0};
+  // index in the lower triangular distances matrix of sorted rows i and j
+  std::size_t index(std::size_t i, std::size_t j) const {
+    std::size_t a{order[i]};
+    std::size_t b{order[j]};
+    return (a > b ? a * (a - 1) / 2 + b : b * (b - 1) / 2 + a) - index_offset;
+  }
+};
+
+// Rows [begin, end) of the lower triangular distances matrix, which are stored
+// contiguously from the index of element (begin, 0) onwards
+struct RowRange {
+  std::size_t begin{0};
+  std::size_t end{std::numeric_limits<std::size_t>::max()};
+  // index of element (i, j) relative to the start of the range
+  std::size_t index(std::size_t i, std::size_t j) const {
+    return i * (i - 1) / 2 - begin * (begin - 1) / 2 + j;
+  }
+};
+
+// non-owning view of the GeneBlocks of a single sample
+// (std::span would do, but this header is also compiled by nvcc as C++17)
+class DenseRow {
+public:
+  DenseRow(const GeneBlock *data, std::size_t size)
+      : data_{data}, size_{size} {}
+  DenseRow(const std::vector<GeneBlock> &v)
+      : data_{v.data()}, size_{v.size()} {}
+  const GeneBlock *data() const { return data_; }
+  std::size_t size() const { return size_; }
+  const GeneBlock *begin() const { return data_; }
+  const GeneBlock *end() const { return data_ + size_; }
+  GeneBlock operator[](std::size_t i) const { return data_[i]; }
+
+private:
+  const GeneBlock *data_;
+  std::size_t size_;
+};
+
+// number of partner rows in a register-blocked 1x4 distance kernel call
+constexpr std::size_t n_partners{4};
+
+// alignment of DenseData rows: cache line size, and the size of an AVX512
+// register
+constexpr std::size_t dense_alignment{64};
+
+template <typename T, std::size_t Alignment = dense_alignment>
+struct AlignedAllocator {
+  using value_type = T;
+  template <typename U> struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+  AlignedAllocator() = default;
+  template <typename U>
+  explicit AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+  }
+  void deallocate(T *p, std::size_t) {
+    ::operator delete(p, std::align_val_t{Alignment});
+  }
+  bool operator==(const AlignedAllocator &) const { return true; }
+  bool operator!=(const AlignedAllocator &) const { return false; }
+};
+
+// All samples in 4-bit dense format, stored in a single contiguous aligned
+// buffer with a fixed stride. Each row is padded with '-' (which never
+// contributes to a distance) to a multiple of dense_alignment GeneBlocks, so
+// every row is aligned and SIMD kernels need no remainder loop.
+//
+// If include_x is true, each gene is stored in its own GeneBlock using
+// lookupTableWide(), for which the same distance kernels count X as a valid
+// char.
+class DenseData {
+public:
+  DenseData() = default;
+  DenseData(std::size_t nsamples, std::size_t sample_length,
+            bool include_x = false)
+      : nsamples_{nsamples}, sample_length_{sample_length},
+        include_x_{include_x},
+        stride_{dense_alignment *
+                ((sample_length + (include_x ? 1 : 2) * dense_alignment - 1) /
+                 ((include_x ? 1 : 2) * dense_alignment))},
+        blocks_(nsamples_ * stride_, 0xff) {}
+  // number of samples
+  std::size_t size() const { return nsamples_; }
+  bool empty() const { return nsamples_ == 0; }
+  // number of genes in each sample
+  std::size_t sample_length() const { return sample_length_; }
+  // true if each gene is stored in its own GeneBlock, with X a valid char
+  bool include_x() const { return include_x_; }
+  // number of GeneBlocks in each row, including padding
+  std::size_t stride() const { return stride_; }
+  const GeneBlock *data() const { return blocks_.data(); }
+  GeneBlock *row_data(std::size_t i) { return blocks_.data() + i * stride_; }
+  DenseRow operator[](std::size_t i) const {
+    return {blocks_.data() + i * stride_, stride_};
+  }
+
+private:
+  std::size_t nsamples_{0};
+  std::size_t sample_length_{0};
+  bool include_x_{false};
+  std::size_t stride_{0};
+  std::vector<GeneBlock, AlignedAllocator<GeneBlock>> blocks_{};
+};
+
+// Dense encoding used by the CPU distance functions
+enum class DenseEncoding {
+  // DenseData: two 4-bit one-hot genes per GeneBlock
+  OneHot,
+  // BitPlaneData: each gene is one bit in each of three 64-bit word planes
+  BitPlane
+};
+
+// 3-bit bit-plane representation of gene, one bit in each plane:
+//   valid hi lo
+//     1   0  0 : 'A'
+//     1   0  1 : 'C'
+//     1   1  0 : 'G'
+//     1   1  1 : 'T'
+//     0   0  0 : '-'
+//     0   1  0 : invalid
+// so a pair of genes a, b differ if
+//   (valid_a & valid_b & ((lo_a ^ lo_b) | (hi_a ^ hi_b))) |
+//   (hi_a & ~valid_a) | (hi_b & ~valid_b)
+using BitPlaneWord = std::uint64_t;
+constexpr std::size_t n_genes_per_word{64};
+
+// non-owning view of the three bit planes of a single sample, each of which
+// consists of size() BitPlaneWords
+class BitPlaneRow {
+public:
+  BitPlaneRow(const BitPlaneWord *data, std::size_t size)
+      : data_{data}, size_{size} {}
+  BitPlaneRow(const std::vector<BitPlaneWord> &v)
+      : data_{v.data()}, size_{v.size() / 3} {}
+  const BitPlaneWord *lo() const { return data_; }
+  const BitPlaneWord *hi() const { return data_ + size_; }
+  const BitPlaneWord *valid() const { return data_ + 2 * size_; }
+  std::size_t size() const { return size_; }
+
+private:
+  const BitPlaneWord *data_;
+  std::size_t size_;
+};
+
+// All samples in bit-plane format, stored in a single contiguous aligned
+// buffer. Each plane is padded with '-' (all bits zero) to a multiple of
+// dense_alignment bytes, so every plane is aligned and SIMD kernels need no
+// remainder loop.
+class BitPlaneData {
+public:
+  BitPlaneData() = default;
+  BitPlaneData(std::size_t nsamples, std::size_t sample_length)
+      : nsamples_{nsamples}, sample_length_{sample_length},
+        words_per_plane_{words_per_alignment *
+                         ((sample_length + genes_per_alignment - 1) /
+                          genes_per_alignment)},
+        words_(nsamples_ * 3 * words_per_plane_, 0) {}
+  // number of samples
+  std::size_t size() const { return nsamples_; }
+  bool empty() const { return nsamples_ == 0; }
+  // number of genes in each sample
+  std::size_t sample_length() const { return sample_length_; }
+  // number of BitPlaneWords in each plane, including padding
+  std::size_t words_per_plane() const { return words_per_plane_; }
+  // number of BitPlaneWords in each row, i.e. all three planes
+  std::size_t stride() const { return 3 * words_per_plane_; }
+  const BitPlaneWord *data() const { return words_.data(); }
+  BitPlaneWord *row_data(std::size_t i) { return words_.data() + i * stride(); }
+  BitPlaneRow operator[](std::size_t i) const {
+    return {words_.data() + i * stride(), words_per_plane_};
+  }
+
+private:
+  static constexpr std::size_t words_per_alignment{dense_alignment /
+                                                   sizeof(BitPlaneWord)};
+  static constexpr std::size_t genes_per_alignment{words_per_alignment *
+                                                   n_genes_per_word};
+  std::size_t nsamples_{0};
+  std::size_t sample_length_{0};
+  std::size_t words_per_plane_{0};
+  std::vector<BitPlaneWord, AlignedAllocator<BitPlaneWord>> words_{};
+};
+
 } // namespace hamming
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace hamming {
+
+// how the contents of a MappedFile are accessed
+enum class MapMode {
+  // read-only, mostly from start to end
+  SequentialRead,
+  // read and written in any order, where writes are private to the mapping
+  // and are not saved to the file
+  CopyOnWrite,
+  // read and written in any order, where writes are saved to the file
+  ReadWrite
+};
+
+// Memory mapping of the contents of a file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &filename,
+                      MapMode mode = MapMode::SequentialRead);
+  // create (or overwrite) a file of size bytes which are all zero, mapped
+  // with ReadWrite; an existing file, such as a TemporaryFile, keeps its
+  // permissions
+  MappedFile(const std::string &filename, std::size_t size);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  const char *data() const { return data_; }
+  // only writable if the mode is not SequentialRead
+  char *data() { return data_; }
+  std::size_t size() const { return size_; }
+  // write any changes to the file, if the mode is ReadWrite
+  void flush();
+
+private:
+  char *data_{nullptr};
+  std::size_t size_{0};
+#ifdef _WIN32
+  void *file_handle_{nullptr};
+  void *mapping_handle_{nullptr};
+#endif
+};
+
+// A new empty file with a unique name in directory, or if it is empty in the
+// temporary directory (given by TMPDIR on POSIX systems). The file is created
+// by the constructor, which fails rather than open an existing file or link,
+// with permissions for the owner only. It is removed by the destructor.
+class TemporaryFile {
+public:
+  explicit TemporaryFile(const std::string &directory = {});
+  ~TemporaryFile();
+  TemporaryFile(const TemporaryFile &) = delete;
+  TemporaryFile &operator=(const TemporaryFile &) = delete;
+  const std::string &name() const { return name_; }
+
+private:
+  std::string name_;
+};
+
+} // namespace hamming
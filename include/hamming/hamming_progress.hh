@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+namespace hamming {
+
+// Called with the units of work done so far and the total units of work of
+// the current stage of a calculation, returns false to cancel the calculation
+using ProgressCallback =
+    std::function<bool(std::size_t done, std::size_t total)>;
+
+// Thrown by a calculation which was cancelled by its ProgressCallback
+class Cancelled : public std::runtime_error {
+public:
+  Cancelled() : std::runtime_error("Error: Calculation was cancelled") {}
+};
+
+// The progress of the calculations started by one thread, which can be added
+// to by any thread. The callback is only called by the thread that created
+// the Progress, and at most once per interval.
+class Progress {
+public:
+  // a Progress without a callback, which does nothing
+  Progress() = default;
+  Progress(ProgressCallback callback, std::chrono::milliseconds interval);
+  Progress(const Progress &) = delete;
+  Progress &operator=(const Progress &) = delete;
+  // the Progress set by a ProgressScope on the current thread, or a Progress
+  // without a callback if there is none
+  static Progress &current();
+  // start a new stage of the calculation with total units of work
+  void start(std::size_t total);
+  // add n units of work done to the current stage
+  void add(std::size_t n);
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+  void throw_if_cancelled() const {
+    if (cancelled()) {
+      throw Cancelled();
+    }
+  }
+
+private:
+  ProgressCallback callback_{};
+  std::chrono::milliseconds interval_{0};
+  std::thread::id owner_{};
+  std::atomic<std::size_t> done_{0};
+  std::size_t total_{0};
+  std::chrono::steady_clock::time_point last_call_{};
+  std::atomic<bool> cancelled_{false};
+};
+
+// Sets the Progress of the current thread while in scope
+class ProgressScope {
+public:
+  explicit ProgressScope(Progress &progress);
+  ~ProgressScope();
+  ProgressScope(const ProgressScope &) = delete;
+  ProgressScope &operator=(const ProgressScope &) = delete;
+
+private:
+  Progress *previous_{nullptr};
+};
+
+} // namespace hamming
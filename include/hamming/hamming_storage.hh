@@ -0,0 +1,87 @@
+#pragma once
+
+#include "hamming/hamming_mapped_file.hh"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace hamming {
+
+// The elements of a lower triangular distances matrix, which are either owned
+// in memory, or backed by a memory-mapped file. A mapped file is shared
+// between copies, so the elements are not copied.
+template <typename DistIntType> class DistancesStorage {
+public:
+  using value_type = DistIntType;
+  DistancesStorage() = default;
+  DistancesStorage(std::vector<DistIntType> &&distances)
+      : vector_{std::move(distances)}, data_{vector_.data()},
+        size_{vector_.size()} {}
+  // size elements of file starting at byte offset
+  DistancesStorage(std::shared_ptr<MappedFile> file, std::size_t offset,
+                   std::size_t size)
+      : file_{std::move(file)},
+        data_{reinterpret_cast<DistIntType *>(file_->data() + offset)},
+        size_{size} {}
+  DistancesStorage(const DistancesStorage &other)
+      : vector_{other.vector_}, file_{other.file_},
+        data_{other.file_ == nullptr ? vector_.data() : other.data_},
+        size_{other.size_} {}
+  DistancesStorage(DistancesStorage &&other) noexcept { swap(other); }
+  DistancesStorage &operator=(DistancesStorage other) noexcept {
+    swap(other);
+    return *this;
+  }
+  ~DistancesStorage() = default;
+  void swap(DistancesStorage &other) noexcept {
+    // the data of a moved std::vector stays at the same address
+    std::swap(vector_, other.vector_);
+    std::swap(file_, other.file_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+  }
+  // true if the elements are backed by a file
+  bool is_mapped() const { return file_ != nullptr; }
+  // write any changes to the elements to the file, if they are saved to it
+  void flush() {
+    if (file_ != nullptr) {
+      file_->flush();
+    }
+  }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // resize to n elements owned in memory
+  void resize(std::size_t n) {
+    if (file_ != nullptr) {
+      vector_.assign(data_, data_ + std::min(n, size_));
+      file_.reset();
+    }
+    vector_.resize(n);
+    data_ = vector_.data();
+    size_ = n;
+  }
+  const DistIntType *data() const { return data_; }
+  DistIntType *data() { return data_; }
+  const DistIntType *begin() const { return data_; }
+  const DistIntType *end() const { return data_ + size_; }
+  DistIntType *begin() { return data_; }
+  DistIntType *end() { return data_ + size_; }
+  const DistIntType &operator[](std::size_t i) const { return data_[i]; }
+  DistIntType &operator[](std::size_t i) { return data_[i]; }
+  bool operator==(const DistancesStorage &other) const {
+    return std::equal(begin(), end(), other.begin(), other.end());
+  }
+  bool operator!=(const DistancesStorage &other) const {
+    return !(*this == other);
+  }
+
+private:
+  std::vector<DistIntType> vector_{};
+  std::shared_ptr<MappedFile> file_{};
+  DistIntType *data_{nullptr};
+  std::size_t size_{0};
+};
+
+} // namespace hamming
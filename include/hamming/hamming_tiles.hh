@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#ifdef HAMMING_WITH_OPENMP
+#include <omp.h>
+#endif
+
+#include "hamming/hamming_impl_types.hh"
+#include "hamming/hamming_progress.hh"
+
+namespace hamming {
+
+// A square block of the lower triangular distances matrix: rows [i_begin,
+// i_end) x cols [j_begin, j_end), of which only elements with j < i are used
+struct Tile {
+  std::size_t i_begin;
+  std::size_t i_end;
+  std::size_t j_begin;
+  std::size_t j_end;
+};
+
+inline std::size_t lower_triangular_tile_size(std::size_t bytes_per_sample) {
+  // the rows and cols of a tile should together fit in (a share of) the L2
+  // cache, so that each sample is loaded from memory once per tile and then
+  // re-used for all of the other samples in the tile
+  constexpr std::size_t cache_bytes{512 * 1024};
+  // a lower limit keeps the scheduling overhead small for very large samples,
+  // an upper limit ensures there are enough tiles to keep all threads busy
+  constexpr std::size_t min_tile_size{8};
+  constexpr std::size_t max_tile_size{256};
+  std::size_t tile_size{cache_bytes / (2 * std::max(bytes_per_sample,
+                                                    std::size_t{1}))};
+  return std::clamp(tile_size, min_tile_size, max_tile_size);
+}
+
+inline std::size_t lower_triangular_tile_count(std::size_t nsamples,
+                                               std::size_t tile_size) {
+  std::size_t n_blocks{(nsamples + tile_size - 1) / tile_size};
+  return n_blocks * (n_blocks + 1) / 2;
+}
+
+inline Tile lower_triangular_tile(std::size_t index, std::size_t nsamples,
+                                  std::size_t tile_size) {
+  // tiles are numbered row-major over the lower triangle of tile blocks,
+  // including the diagonal: index = bi * (bi + 1) / 2 + bj, with bj <= bi
+  auto bi{static_cast<std::size_t>(
+      (std::sqrt(8.0 * static_cast<double>(index) + 1.0) - 1.0) / 2.0)};
+  // correct any floating point rounding error for large indices
+  while (bi * (bi + 1) / 2 > index) {
+    --bi;
+  }
+  while ((bi + 1) * (bi + 2) / 2 <= index) {
+    ++bi;
+  }
+  std::size_t bj{index - bi * (bi + 1) / 2};
+  return {bi * tile_size, std::min((bi + 1) * tile_size, nsamples),
+          bj * tile_size, std::min((bj + 1) * tile_size, nsamples)};
+}
+
+// number of bytes used to store each sample
+inline std::size_t sample_bytes(const DenseData &data) {
+  return sizeof(GeneBlock) * data.stride();
+}
+
+inline std::size_t sample_bytes(const BitPlaneData &data) {
+  return sizeof(BitPlaneWord) * data.stride();
+}
+
+// Calculate the lower triangular distances matrix of all rows of data.
+//
+// The matrix is split into tiles whose rows fit in cache, which are handed
+// out dynamically to threads: all tiles have (almost) the same amount of work.
+// DistanceFunc(a, b, max_dist) returns the distance between two rows, and
+// the optional Distance1x4Func(a, {b0, b1, b2, b3}, max_dist) returns the
+// distances between one row and n_partners rows. These are template
+// parameters, rather than function pointers, so that each SIMD implementation
+// can instantiate this loop with its own kernels inlined into it.
+//
+// If pruning is given, the rows of data are in the sorted order of pruning,
+// the skipped pairs are set to max_dist, and each distance is stored at its
+// position in the distances matrix of the original (unsorted) rows.
+//
+// Otherwise only the rows in the range rows are calculated, and stored in
+// result starting from the first element of row rows.begin.
+//
+// The number of pairs in each tile is added to the current Progress, and the
+// remaining tiles are skipped if it is cancelled.
+//
+// max_dist must fit in DistIntType.
+template <typename DistIntType, typename Data, typename DistanceFunc,
+          typename Distance1x4Func = std::nullptr_t>
+void distances_tiled(const Data &data, DistIntType *result, int max_dist,
+                     DistanceFunc distance_func,
+                     Distance1x4Func distance_1x4_func = nullptr,
+                     const LowerBoundPruning *pruning = nullptr,
+                     RowRange rows = {}) {
+  std::size_t nsamples{data.size()};
+  rows.end = std::min(rows.end, nsamples);
+  std::size_t tile_size{lower_triangular_tile_size(sample_bytes(data))};
+  // the tiles in the rows of tile blocks that overlap with rows
+  std::size_t t_begin{
+      lower_triangular_tile_count(rows.begin - rows.begin % tile_size,
+                                  tile_size)};
+  std::size_t t_end{lower_triangular_tile_count(rows.end, tile_size)};
+  auto *progress{&Progress::current()};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) default(none)                    \
+    shared(result, data, nsamples, distance_func, distance_1x4_func,           \
+               max_dist, tile_size, t_begin, t_end, pruning, rows, progress)
+#endif
+  for (std::size_t t = t_begin; t < t_end; ++t) {
+    if (progress->cancelled()) {
+      continue;
+    }
+    auto tile{lower_triangular_tile(t, nsamples, tile_size)};
+    std::size_t i_begin{std::max(tile.i_begin, rows.begin)};
+    std::size_t i_end{std::min(tile.i_end, rows.end)};
+    std::size_t n_pairs{0};
+    for (std::size_t i = i_begin; i < i_end; ++i) {
+      auto index = [i, pruning, &rows](std::size_t j) {
+        return pruning == nullptr ? rows.index(i, j) : pruning->index(i, j);
+      };
+      std::size_t j_end{std::min(tile.j_end, i)};
+      std::size_t j{tile.j_begin};
+      n_pairs += j_end > j ? j_end - j : 0;
+      if (pruning != nullptr) {
+        // the lower bound of these distances is at least max_dist
+        for (; j < std::min(j_end, pruning->first_col[i]); ++j) {
+          result[index(j)] = static_cast<DistIntType>(max_dist);
+        }
+      }
+      if constexpr (!std::is_same_v<Distance1x4Func, std::nullptr_t>) {
+        // row i against blocks of n_partners rows at a time
+        for (; j + n_partners <= j_end; j += n_partners) {
+          auto d{distance_1x4_func(
+              data[i], {data[j], data[j + 1], data[j + 2], data[j + 3]},
+              max_dist)};
+          for (std::size_t k = 0; k < n_partners; ++k) {
+            result[index(j + k)] = static_cast<DistIntType>(d[k]);
+          }
+        }
+      }
+      // remaining rows one at a time
+      for (; j < j_end; ++j) {
+        result[index(j)] =
+            static_cast<DistIntType>(distance_func(data[i], data[j], max_dist));
+      }
+    }
+    progress->add(n_pairs);
+  }
+}
+
+} // namespace hamming
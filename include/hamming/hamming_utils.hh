@@ -1,9 +1,23 @@
 #pragma once
 
-#include <fmt/core.h>
+#include "hamming/hamming_mapped_file.hh"
+#include "hamming/hamming_progress.hh"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <fmt/format.h>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 #ifdef HAMMING_WITH_OPENMP
 #include <omp.h>
@@ -11,45 +25,67 @@
 
 namespace hamming {
 
+// The decimal representations of all values of a small unsigned integer type,
+// each followed by a ','. Each entry is padded to 8 chars, with the number of
+// chars used (including the ',') in the last char.
+template <typename IntDistType> class DecimalTable {
+public:
+  static constexpr std::size_t entry_size{8};
+  DecimalTable() {
+    constexpr std::size_t n{std::numeric_limits<IntDistType>::max() + 1};
+    chars_.resize(n * entry_size);
+    for (std::size_t value = 0; value < n; ++value) {
+      auto str{fmt::to_string(value)};
+      str.push_back(',');
+      char *entry{chars_.data() + value * entry_size};
+      std::memcpy(entry, str.data(), str.size());
+      entry[entry_size - 1] = static_cast<char>(str.size());
+    }
+  }
+  const char *entry(IntDistType value) const {
+    return chars_.data() + static_cast<std::size_t>(value) * entry_size;
+  }
+  std::size_t size(IntDistType value) const {
+    return static_cast<std::size_t>(entry(value)[entry_size - 1]);
+  }
+
+private:
+  std::vector<char> chars_{};
+};
+
 template <typename IntDistType>
-void append_int(std::string &str, IntDistType value) {
-  str.append(fmt::to_string(value));
+inline constexpr bool has_decimal_table{std::is_unsigned_v<IntDistType> &&
+                                        sizeof(IntDistType) <= 2};
+
+template <typename IntDistType>
+const DecimalTable<IntDistType> &decimal_table() {
+  static const DecimalTable<IntDistType> table{};
+  return table;
 }
 
-template <typename DistIntType>
-std::string
-lower_triangular_lines(const std::vector<DistIntType> &partial_distances,
-                       std::size_t i_start, std::size_t i_end, std::size_t i0,
-                       std::size_t j0, std::size_t iN, std::size_t jN) {
-  std::string lines{};
-  std::size_t k{[i_start, i0, j0]() {
-    if (i_start == i0) {
-      // first row, no offset required
-      return std::size_t{0};
-    }
-    // offset for elements from first row and any previous full rows
-    return i0 - j0 + i_start * (i_start - 1) / 2 - (i0 + 1) * i0 / 2;
-  }()};
-  for (std::size_t i = i_start; i < i_end; ++i) {
-    // first row starts at j0, other rows are full and start at 0
-    std::size_t j_first{i == i0 ? j0 : 0};
-    std::size_t j_last{i - 1};
-    char final_char{'\n'};
-    if (i == iN && j_last != jN) {
-      // this is an incomplete final row of partial_distances: no newline at end
-      j_last = jN;
-      final_char = ',';
-    }
-    // do all but last element for this line
-    for (std::size_t j = j_first; j < j_last; ++j) {
-      append_int(lines, partial_distances[k++]);
-      lines.push_back(',');
-    }
-    // do last element for this line with ',' or '\n' as appropriate
-    append_int(lines, partial_distances[k++]);
-    lines.push_back(final_char);
+// number of chars in the decimal representation of value followed by a ','
+template <typename IntDistType> std::size_t formatted_size(IntDistType value) {
+  if constexpr (has_decimal_table<IntDistType>) {
+    return decimal_table<IntDistType>().size(value);
+  } else {
+    return fmt::formatted_size("{}", value) + 1;
+  }
+}
+
+// write the decimal representation of value followed by a ',' to out, which
+// must have space for at least DecimalTable::entry_size chars, and return a
+// pointer to the char after the ','
+template <typename IntDistType> char *format_int(char *out, IntDistType value) {
+  if constexpr (has_decimal_table<IntDistType>) {
+    const auto &table{decimal_table<IntDistType>()};
+    std::memcpy(out, table.entry(value), DecimalTable<IntDistType>::entry_size);
+    return out + table.size(value);
+  } else {
+    auto str{fmt::to_string(value)};
+    str.push_back(',');
+    std::memcpy(out, str.data(), str.size());
+    return out + str.size();
   }
-  return lines;
 }
 
 static std::size_t row_from_index(std::size_t index) {
@@ -61,52 +97,620 @@ static std::size_t col_from_index(std::size_t index, std::size_t row) {
   return index - row * (row - 1) / 2;
 }
 
-template <typename DistIntType>
+// A file which is written at given offsets, possibly by several threads at
+// once
+class PositionalFile {
+public:
+  // if append is false any existing contents of the file are discarded
+  PositionalFile(const std::string &filename, bool append);
+  ~PositionalFile();
+  PositionalFile(const PositionalFile &) = delete;
+  PositionalFile &operator=(const PositionalFile &) = delete;
+  // size of the file when it was opened
+  std::size_t initial_size() const { return initial_size_; }
+  // write size bytes of data to the file starting at byte offset, returns
+  // false if this failed
+  bool write(const char *data, std::size_t size, std::size_t offset);
+
+private:
+  std::size_t initial_size_{0};
+#ifdef _WIN32
+  void *handle_{nullptr};
+#else
+  int fd_{-1};
+#endif
+};
+
+// Write the lower triangular distances elements with indices from
+// distances_offset to distances_offset + n_partial_distances, which are the
+// first n_partial_distances elements of partial_distances, to filename. If
+// distances_offset is non-zero they are appended to the existing contents.
+//
+// The elements are split into blocks, and the number of chars in each block is
+// counted first to find the offset in the file of each block. The blocks can
+// then be formatted and written to the file by each thread independently.
+// The elements of each block are added to the current Progress once written.
+template <typename Distances>
 void partial_write_lower_triangular(
-    const std::string &filename,
-    const std::vector<DistIntType> &partial_distances,
+    const std::string &filename, const Distances &partial_distances,
     std::size_t distances_offset, std::size_t n_partial_distances) {
+  using IntDistType = std::decay_t<decltype(partial_distances[0])>;
+  PositionalFile file(filename, distances_offset != 0);
   if (n_partial_distances == 0) {
     return;
   }
-  // infer row/col (i0, j0) of first element of partial_distances
-  std::size_t i0{row_from_index(distances_offset)};
-  std::size_t j0{col_from_index(distances_offset, i0)};
-  // infer row/col (iN, jN) of last element of partial_distances
-  std::size_t last_element_index{distances_offset + n_partial_distances - 1};
-  std::size_t iN{row_from_index(last_element_index)};
-  std::size_t jN{col_from_index(last_element_index, iN)};
-  auto flag = [distances_offset]() {
-    if (distances_offset == 0) {
-      // overwrite any existing data
-      return std::ios_base::out;
+  constexpr std::size_t block_size{1 << 20};
+  std::size_t n_blocks{(n_partial_distances + block_size - 1) / block_size};
+  // offset in the file of the start of each block
+  std::vector<std::size_t> block_offsets(n_blocks + 1, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(static, 1) default(none)                     \
+    shared(partial_distances, n_partial_distances, n_blocks, block_offsets)
+#endif
+  for (std::size_t b = 0; b < n_blocks; ++b) {
+    std::size_t k_end{std::min((b + 1) * block_size, n_partial_distances)};
+    std::size_t size{0};
+    for (std::size_t k = b * block_size; k < k_end; ++k) {
+      size += formatted_size<IntDistType>(partial_distances[k]);
     }
-    // append to existing data
-    return std::ios_base::out | std::ios_base::app | std::ios_base::ate;
-  }();
-  std::ofstream output_file_stream(filename, flag);
-#ifdef HAMMING_WITH_OPENMP
-  constexpr std::size_t max_lines_per_thread{200};
-#pragma omp parallel for schedule(static, 1) ordered default(none)             \
-    shared(partial_distances, output_file_stream, i0, j0, iN, jN)
-  for (std::size_t i_start = i0; i_start <= iN;
-       i_start += max_lines_per_thread) {
-    std::size_t i_end{std::min(i_start + max_lines_per_thread, iN + 1)};
-    auto line = lower_triangular_lines(partial_distances, i_start, i_end, i0,
-                                       j0, iN, jN);
-#pragma omp ordered
-    output_file_stream << line;
+    block_offsets[b + 1] = size;
   }
-#else
-  output_file_stream << lower_triangular_lines(partial_distances, i0, iN + 1,
-                                               i0, j0, iN, jN);
+  block_offsets[0] = file.initial_size();
+  for (std::size_t b = 0; b < n_blocks; ++b) {
+    block_offsets[b + 1] += block_offsets[b];
+  }
+  bool write_failed{false};
+  auto *progress{&Progress::current()};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(partial_distances, distances_offset, n_partial_distances, n_blocks, \
+               block_offsets, file, write_failed, progress)
 #endif
+  {
+    std::vector<char> buffer;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(static, 1)
+#endif
+    for (std::size_t b = 0; b < n_blocks; ++b) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      std::size_t size{block_offsets[b + 1] - block_offsets[b]};
+      buffer.resize(size + DecimalTable<std::uint8_t>::entry_size);
+      std::size_t k_begin{b * block_size};
+      std::size_t k_end{std::min(k_begin + block_size, n_partial_distances)};
+      // row/col (i, j) of the first element of this block
+      std::size_t i{row_from_index(distances_offset + k_begin)};
+      std::size_t j{col_from_index(distances_offset + k_begin, i)};
+      char *out{buffer.data()};
+      for (std::size_t k = k_begin; k < k_end; ++k) {
+        out = format_int<IntDistType>(out, partial_distances[k]);
+        if (++j == i) {
+          // end of row i
+          *(out - 1) = '\n';
+          ++i;
+          j = 0;
+        }
+      }
+      if (!file.write(buffer.data(), size, block_offsets[b])) {
+        write_failed = true;
+      }
+      progress->add(k_end - k_begin);
+    }
+  }
+  progress->throw_if_cancelled();
+  if (write_failed) {
+    throw std::runtime_error("Error: Failed to write to file '" + filename +
+                             "'");
+  }
 }
 
-template <typename DistIntType>
+template <typename Distances>
 void write_lower_triangular(const std::string &filename,
-                            const std::vector<DistIntType> &distances) {
+                            const Distances &distances) {
+  Progress::current().start(distances.size());
   partial_write_lower_triangular(filename, distances, 0, distances.size());
 }
 
+// Write the full nsamples x nsamples distances matrix, with the lower
+// triangular elements given by distances, to filename as rows of ", "
+// separated integers.
+//
+// The rows are split into blocks which are formatted by each thread into a
+// buffer for each row, and then written to the file in order. The elements
+// of a row before the diagonal are contiguous in distances, but those after
+// the diagonal are a column of the lower triangle. These are instead appended
+// to all rows of the block at once, column by column, which reads the
+// distances contiguously and only once for each block.
+template <typename Distances>
+void write_full_matrix(const std::string &filename, const Distances &distances,
+                       std::size_t nsamples) {
+  using IntDistType = std::decay_t<decltype(distances[0])>;
+  std::ofstream stream(filename);
+  if (nsamples == 0) {
+    return;
+  }
+  // maximum number of chars of an element, including the ", " separator
+  std::size_t max_element_chars{
+      std::max(formatted_size(std::numeric_limits<IntDistType>::min()),
+               formatted_size(std::numeric_limits<IntDistType>::max())) +
+      1};
+  std::size_t max_row_chars{nsamples * max_element_chars +
+                            DecimalTable<std::uint8_t>::entry_size};
+  // limit the size of the buffers of each thread to around 16MB
+  std::size_t rows_per_block{
+      std::clamp((std::size_t{1} << 24) / max_row_chars, std::size_t{1},
+                 std::size_t{64})};
+  std::size_t n_blocks{(nsamples + rows_per_block - 1) / rows_per_block};
+  bool write_failed{false};
+  // one unit of work per row
+  auto *progress{&Progress::current()};
+  progress->start(nsamples);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(distances, nsamples, max_row_chars, rows_per_block, n_blocks,       \
+               stream, write_failed, progress)
+#endif
+  {
+    std::vector<std::vector<char>> rows(rows_per_block,
+                                        std::vector<char>(max_row_chars));
+    std::vector<char *> ends(rows_per_block);
+    auto append = [](char *&end, IntDistType value) {
+      end = format_int<IntDistType>(end, value);
+      *end++ = ' ';
+    };
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(static, 1) ordered
+#endif
+    for (std::size_t b = 0; b < n_blocks; ++b) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      std::size_t i_begin{b * rows_per_block};
+      std::size_t i_end{std::min(i_begin + rows_per_block, nsamples)};
+      for (std::size_t i = i_begin; i < i_end; ++i) {
+        char *&end{ends[i - i_begin]};
+        end = rows[i - i_begin].data();
+        // elements before the diagonal are row i of the lower triangle
+        std::size_t k{i * (i - 1) / 2};
+        for (std::size_t j = 0; j < i; ++j) {
+          append(end, distances[k + j]);
+        }
+        append(end, IntDistType{0});
+        // elements after the diagonal which are within the block
+        for (std::size_t j = i + 1; j < i_end; ++j) {
+          append(end, distances[j * (j - 1) / 2 + i]);
+        }
+      }
+      // elements after the block are rows of the lower triangle
+      for (std::size_t j = i_end; j < nsamples; ++j) {
+        std::size_t k{j * (j - 1) / 2};
+        for (std::size_t i = i_begin; i < i_end; ++i) {
+          append(ends[i - i_begin], distances[k + i]);
+        }
+      }
+      for (std::size_t i = i_begin; i < i_end; ++i) {
+        // replace the final ", " with a newline
+        ends[i - i_begin] -= 2;
+        *ends[i - i_begin]++ = '\n';
+      }
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp ordered
+#endif
+      {
+        for (std::size_t i = i_begin; i < i_end; ++i) {
+          const char *row{rows[i - i_begin].data()};
+          stream.write(row, ends[i - i_begin] - row);
+        }
+        if (!stream) {
+          write_failed = true;
+        }
+      }
+      progress->add(i_end - i_begin);
+    }
+  }
+  progress->throw_if_cancelled();
+  if (write_failed) {
+    throw std::runtime_error("Error: Failed to write to file '" + filename +
+                             "'");
+  }
+}
+
+// Call f(i, j, d) for each lower triangular distances element d with index k
+// in [k_begin, k_end) that is not above threshold, where (i, j) is its row
+// and column.
+template <typename Distances, typename Function>
+void for_each_sparse_element(const Distances &distances, std::size_t k_begin,
+                             std::size_t k_end, int threshold, Function &&f) {
+  std::size_t i{row_from_index(k_begin)};
+  std::size_t j{col_from_index(k_begin, i)};
+  for (std::size_t k = k_begin; k < k_end; ++k) {
+    if (distances[k] <= threshold) {
+      f(i, j, distances[k]);
+    }
+    if (++j == i) {
+      ++i;
+      j = 0;
+    }
+  }
+}
+
+// number of lower triangular distances elements in each block of the sparse
+// writers, which are processed by the threads independently
+inline std::size_t sparse_block_size() { return std::size_t{1} << 20; }
+
+// Write the lower triangular distances elements which are not above
+// threshold to filename, as lines of "i j d(i,j)" in row-major order.
+//
+// Each thread formats a block of elements into its own buffer, and the blocks
+// are written to the file in order, so the output is always the same.
+template <typename Distances>
+void write_sparse(const std::string &filename, const Distances &distances,
+                  int threshold) {
+  std::ofstream stream(filename);
+  std::size_t n_distances{distances.size()};
+  std::size_t block_size{sparse_block_size()};
+  std::size_t n_blocks{(n_distances + block_size - 1) / block_size};
+  bool write_failed{false};
+  auto *progress{&Progress::current()};
+  progress->start(n_distances);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none) shared(distances, threshold, n_distances,   \
+                                              block_size, n_blocks, stream,    \
+                                              write_failed, progress)
+#endif
+  {
+    fmt::memory_buffer buffer;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(static, 1) ordered
+#endif
+    for (std::size_t b = 0; b < n_blocks; ++b) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      buffer.clear();
+      for_each_sparse_element(
+          distances, b * block_size,
+          std::min((b + 1) * block_size, n_distances), threshold,
+          [&buffer](std::size_t i, std::size_t j, auto d) {
+            fmt::format_int i_str(i);
+            buffer.append(i_str.data(), i_str.data() + i_str.size());
+            buffer.push_back(' ');
+            fmt::format_int j_str(j);
+            buffer.append(j_str.data(), j_str.data() + j_str.size());
+            buffer.push_back(' ');
+            fmt::format_int d_str(static_cast<int>(d));
+            buffer.append(d_str.data(), d_str.data() + d_str.size());
+            buffer.push_back('\n');
+          });
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp ordered
+#endif
+      {
+        stream.write(buffer.data(),
+                     static_cast<std::streamsize>(buffer.size()));
+        if (!stream) {
+          write_failed = true;
+        }
+      }
+      progress->add(std::min(block_size, n_distances - b * block_size));
+    }
+  }
+  progress->throw_if_cancelled();
+  if (write_failed) {
+    throw std::runtime_error("Error: Failed to write to file '" + filename +
+                             "'");
+  }
+}
+
+// A numpy .npz file, i.e. an uncompressed zip file of .npy files, which is
+// written at given offsets, possibly by several threads at once. The arrays
+// are first added with their shape, and then their data can be written in
+// any order. Requires zlib, for the CRC-32 checksums of the zip file.
+class NpzFile {
+public:
+  explicit NpzFile(const std::string &filename);
+  // add an array, of elements of size item_size bytes and numpy type descr,
+  // and return its index
+  std::size_t add_array(const std::string &name, const std::string &descr,
+                        std::size_t item_size,
+                        const std::vector<std::size_t> &shape);
+  // write size bytes of data to the array starting at byte offset of its
+  // data, returns false if this failed
+  bool write(std::size_t array, const char *data, std::size_t size,
+             std::size_t offset);
+  // write the headers of the arrays and the zip central directory, after all
+  // data has been written
+  void close();
+
+private:
+  struct Array {
+    std::string name{};
+    std::string npy_header{};
+    std::size_t offset{0};
+    std::size_t data_size{0};
+    // the offset, size and CRC-32 of each write to the data
+    std::vector<std::array<std::size_t, 3>> writes{};
+  };
+  std::size_t data_offset(const Array &array) const;
+  std::string filename_{};
+  PositionalFile file_;
+  std::vector<Array> arrays_{};
+  std::size_t size_{0};
+  std::mutex mutex_{};
+};
+
+// numpy type of integer type IntType (in little-endian byte order)
+template <typename IntType> std::string npy_descr() {
+  return std::string{sizeof(IntType) == 1 ? "|" : "<"} +
+         (std::is_unsigned_v<IntType> ? "u" : "i") +
+         std::to_string(sizeof(IntType));
+}
+
+// Write the lower triangular distances elements which are not above
+// threshold to filename in a binary coordinate (COO) format, in the same
+// order as write_sparse(). If npz is false each element is written as a
+// record of the row and column as 32-bit signed integers followed by the
+// distance. Otherwise the file is a numpy .npz file of the arrays row, col
+// and data, which can be loaded with scipy.sparse.load_npz as a lower
+// triangular nsamples x nsamples coo matrix. Integers are little-endian.
+//
+// The elements in each block are counted first to find the offset in the
+// file of each block. The blocks can then be written to the file by each
+// thread independently.
+template <typename Distances>
+void write_sparse_binary(const std::string &filename,
+                         const Distances &distances, std::size_t nsamples,
+                         int threshold, bool npz) {
+  using IntDistType = std::decay_t<decltype(distances[0])>;
+  if (nsamples > static_cast<std::size_t>(
+                     std::numeric_limits<std::int32_t>::max())) {
+    throw std::runtime_error(
+        "Error: Too many samples for 32-bit row and column indices");
+  }
+  std::size_t n_distances{distances.size()};
+  std::size_t block_size{sparse_block_size()};
+  std::size_t n_blocks{(n_distances + block_size - 1) / block_size};
+  // index of the first element of each block in the output
+  std::vector<std::size_t> block_offsets(n_blocks + 1, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(static, 1) default(none)                     \
+    shared(distances, threshold, n_distances, block_size, n_blocks,            \
+               block_offsets)
+#endif
+  for (std::size_t b = 0; b < n_blocks; ++b) {
+    std::size_t count{0};
+    for_each_sparse_element(distances, b * block_size,
+                            std::min((b + 1) * block_size, n_distances),
+                            threshold,
+                            [&count](std::size_t, std::size_t, IntDistType) {
+                              ++count;
+                            });
+    block_offsets[b + 1] = count;
+  }
+  for (std::size_t b = 0; b < n_blocks; ++b) {
+    block_offsets[b + 1] += block_offsets[b];
+  }
+  std::size_t n_elements{block_offsets[n_blocks]};
+  std::size_t index_size{sizeof(std::int32_t)};
+  std::size_t record_size{2 * index_size + sizeof(IntDistType)};
+  std::unique_ptr<NpzFile> npz_file;
+  std::unique_ptr<PositionalFile> file;
+  // indices of the row, col, data, format and shape arrays of the npz file
+  std::array<std::size_t, 5> arrays{};
+  if (npz) {
+    npz_file = std::make_unique<NpzFile>(filename);
+    arrays[0] = npz_file->add_array("row", "<i4", index_size, {n_elements});
+    arrays[1] = npz_file->add_array("col", "<i4", index_size, {n_elements});
+    arrays[2] = npz_file->add_array("data", npy_descr<IntDistType>(),
+                                    sizeof(IntDistType), {n_elements});
+    arrays[3] = npz_file->add_array("format", "|S3", 3, {});
+    arrays[4] = npz_file->add_array("shape", "<i8", sizeof(std::int64_t), {2});
+  } else {
+    file = std::make_unique<PositionalFile>(filename, false);
+  }
+  bool write_failed{false};
+  auto *progress{&Progress::current()};
+  progress->start(n_distances);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(distances, threshold, n_distances, block_size, n_blocks,            \
+               block_offsets, index_size, record_size, npz_file, file, arrays, \
+               write_failed, progress)
+#endif
+  {
+    std::vector<std::int32_t> rows;
+    std::vector<std::int32_t> cols;
+    std::vector<IntDistType> values;
+    std::vector<char> records;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(static, 1)
+#endif
+    for (std::size_t b = 0; b < n_blocks; ++b) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      rows.clear();
+      cols.clear();
+      values.clear();
+      for_each_sparse_element(
+          distances, b * block_size,
+          std::min((b + 1) * block_size, n_distances), threshold,
+          [&rows, &cols, &values](std::size_t i, std::size_t j,
+                                  IntDistType d) {
+            rows.push_back(static_cast<std::int32_t>(i));
+            cols.push_back(static_cast<std::int32_t>(j));
+            values.push_back(d);
+          });
+      std::size_t offset{block_offsets[b]};
+      bool ok{true};
+      if (npz_file != nullptr) {
+        ok = npz_file->write(arrays[0],
+                             reinterpret_cast<const char *>(rows.data()),
+                             rows.size() * index_size, offset * index_size) &&
+             npz_file->write(arrays[1],
+                             reinterpret_cast<const char *>(cols.data()),
+                             cols.size() * index_size, offset * index_size) &&
+             npz_file->write(arrays[2],
+                             reinterpret_cast<const char *>(values.data()),
+                             values.size() * sizeof(IntDistType),
+                             offset * sizeof(IntDistType));
+      } else {
+        records.resize(values.size() * record_size);
+        char *out{records.data()};
+        for (std::size_t e = 0; e < values.size(); ++e) {
+          std::memcpy(out, &rows[e], index_size);
+          std::memcpy(out + index_size, &cols[e], index_size);
+          std::memcpy(out + 2 * index_size, &values[e], sizeof(IntDistType));
+          out += record_size;
+        }
+        ok = file->write(records.data(), records.size(),
+                         offset * record_size);
+      }
+      if (!ok) {
+        write_failed = true;
+      }
+      progress->add(std::min(block_size, n_distances - b * block_size));
+    }
+  }
+  progress->throw_if_cancelled();
+  if (write_failed) {
+    throw std::runtime_error("Error: Failed to write to file '" + filename +
+                             "'");
+  }
+  if (npz_file != nullptr) {
+    std::array<std::int64_t, 2> shape{static_cast<std::int64_t>(nsamples),
+                                      static_cast<std::int64_t>(nsamples)};
+    if (!npz_file->write(arrays[3], "coo", 3, 0) ||
+        !npz_file->write(arrays[4], reinterpret_cast<const char *>(&shape),
+                         sizeof(shape), 0)) {
+      throw std::runtime_error("Error: Failed to write to file '" + filename +
+                               "'");
+    }
+    npz_file->close();
+  }
+}
+
+// Read the lower triangular distances elements from a text file, where each
+// line contains a row of the distances matrix as comma-separated integers,
+// which may be preceded by spaces.
+// If full_matrix is true the file contains all rows and columns of the
+// matrix (as written by DataSet::dump), and only the elements below the
+// diagonal of each row are used. Otherwise the file contains only the
+// elements below the diagonal, starting with row 1 (as written by
+// write_lower_triangular). Integers larger than the maximum value of
+// DistIntType saturate at this value.
+//
+// The file is split into chunks of whole lines, and the number of lines in
+// each chunk is counted first to find the offset of the first element of each
+// chunk in the returned distances. The chunks can then be parsed into their
+// part of the distances by each thread independently.
+template <typename DistIntType>
+std::vector<DistIntType> read_lower_triangular(const std::string &filename,
+                                               bool full_matrix = false) {
+  MappedFile file(filename, MapMode::SequentialRead);
+  const char *data{file.data()};
+  std::size_t size{file.size()};
+  // the first line contains row 1 if only the lower triangle is in the file
+  std::size_t first_row{full_matrix ? std::size_t{0} : std::size_t{1}};
+  // split the file into chunks which start at the start of a line
+  constexpr std::size_t min_chunk_bytes{1 << 20};
+  std::size_t n_chunks{1};
+#ifdef HAMMING_WITH_OPENMP
+  n_chunks = 4 * static_cast<std::size_t>(omp_get_max_threads());
+#endif
+  n_chunks = std::clamp(size / min_chunk_bytes, std::size_t{1}, n_chunks);
+  std::vector<std::size_t> chunk_begin(n_chunks + 1, size);
+  chunk_begin[0] = 0;
+  for (std::size_t c = 1; c < n_chunks; ++c) {
+    std::size_t begin{std::max(c * size / n_chunks, chunk_begin[c - 1])};
+    const auto *newline{static_cast<const char *>(
+        std::memchr(data + begin, '\n', size - begin))};
+    chunk_begin[c] = newline == nullptr ? size : newline - data + 1;
+  }
+  // index of the first line of each chunk
+  std::vector<std::size_t> chunk_line(n_chunks + 1, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) default(none)                    \
+    shared(data, n_chunks, chunk_begin, chunk_line)
+#endif
+  for (std::size_t c = 0; c < n_chunks; ++c) {
+    chunk_line[c + 1] = static_cast<std::size_t>(
+        std::count(data + chunk_begin[c], data + chunk_begin[c + 1], '\n'));
+  }
+  for (std::size_t c = 0; c < n_chunks; ++c) {
+    chunk_line[c + 1] += chunk_line[c];
+  }
+  std::size_t n_lines{chunk_line[n_chunks]};
+  if (size > 0 && data[size - 1] != '\n') {
+    // final line without a newline
+    ++n_lines;
+  }
+  // the first k elements of the distances are in rows before row k
+  auto row_offset = [first_row](std::size_t row) {
+    return row * (row - 1) / 2 - first_row * (first_row - 1) / 2;
+  };
+  std::vector<DistIntType> distances(n_lines == 0 ? 0
+                                                  : row_offset(n_lines +
+                                                               first_row));
+  bool invalid{false};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) default(none)                    \
+    shared(data, n_chunks, chunk_begin, chunk_line, first_row, row_offset,     \
+               distances, invalid, full_matrix)
+#endif
+  for (std::size_t c = 0; c < n_chunks; ++c) {
+    const char *p{data + chunk_begin[c]};
+    const char *end{data + chunk_begin[c + 1]};
+    std::size_t row{chunk_line[c] + first_row};
+    DistIntType *out{distances.data() + (p == end ? 0 : row_offset(row))};
+    bool valid{true};
+    for (; p < end && valid; ++row) {
+      // parse the first row elements of this line
+      for (std::size_t j = 0; j < row; ++j) {
+        while (p < end && *p == ' ') {
+          ++p;
+        }
+        std::uint64_t value{0};
+        auto [ptr, ec]{std::from_chars(p, end, value)};
+        if (ec != std::errc{} ||
+            (ptr < end && *ptr != ',' && *ptr != '\n' && *ptr != '\r')) {
+          valid = false;
+          break;
+        }
+        *out++ = static_cast<DistIntType>(std::min<std::uint64_t>(
+            value, std::numeric_limits<DistIntType>::max()));
+        p = ptr;
+        if (j + 1 < row) {
+          if (p == end || *p != ',') {
+            valid = false;
+            break;
+          }
+          ++p;
+        }
+      }
+      if (p < end && *p == '\r') {
+        ++p;
+      }
+      if (full_matrix) {
+        // skip the remaining elements of the row
+        const auto *newline{
+            static_cast<const char *>(std::memchr(p, '\n', end - p))};
+        p = newline == nullptr ? end : newline;
+      }
+      if (p < end && *p++ != '\n') {
+        valid = false;
+      }
+    }
+    if (!valid) {
+      invalid = true;
+    }
+  }
+  if (invalid) {
+    throw std::runtime_error("Error: Invalid distances in file '" + filename +
+                             "'");
+  }
+  return distances;
+}
+
 } // namespace hamming
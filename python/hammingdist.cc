@@ -1,4 +1,9 @@
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <optional>
+#include <type_traits>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -11,91 +16,290 @@ namespace py = pybind11;
 // author: https://github.com/YannickJadoul
 // source: https://github.com/pybind/pybind11/issues/1042#issuecomment-642215028
 template <typename Sequence>
-inline py::array_t<typename Sequence::value_type> as_pyarray(Sequence &&seq) {
+inline py::array_t<typename Sequence::value_type>
+as_pyarray(Sequence &&seq, std::vector<py::ssize_t> shape = {}) {
   auto size = seq.size();
   auto data = seq.data();
+  if (shape.empty()) {
+    shape.push_back(static_cast<py::ssize_t>(size));
+  }
   std::unique_ptr<Sequence> seq_ptr =
       std::make_unique<Sequence>(std::move(seq));
   auto capsule = py::capsule(seq_ptr.get(), [](void *p) {
     std::unique_ptr<Sequence>(reinterpret_cast<Sequence *>(p));
   });
   seq_ptr.release();
-  return py::array(size, data, capsule);
+  return py::array(shape, data, capsule);
+}
+
+// helper function to return a read-only view of n elements of data as a
+// py::array_t without making a copy, which keeps base alive
+template <typename T>
+inline py::array_t<T> as_readonly_pyarray(const T *data, std::size_t n,
+                                          py::handle base) {
+  py::array_t<T> array({static_cast<py::ssize_t>(n)},
+                       {static_cast<py::ssize_t>(sizeof(T))}, data, base);
+  array.attr("setflags")(py::arg("write") = false);
+  return array;
 }
 
 namespace hamming {
 
+// Call f() with the GIL released, so that other Python threads can run during
+// the calculation. A few times per second the calling thread acquires the GIL
+// to check for signals such as KeyboardInterrupt, and to call
+// progress(done, total) if progress is not None. If either raises an
+// exception, the calculation is cancelled and the exception is raised. If
+// progress returns False, the calculation is cancelled and Cancelled is
+// raised.
+template <typename Function>
+auto without_gil(const py::object &progress, Function &&f) {
+  std::optional<py::error_already_set> error;
+  auto callback = [&progress, &error](std::size_t done, std::size_t total) {
+    py::gil_scoped_acquire acquire;
+    try {
+      if (PyErr_CheckSignals() != 0) {
+        throw py::error_already_set();
+      }
+      return progress.is_none() ||
+             !progress(done, total).is(py::bool_(false));
+    } catch (py::error_already_set &e) {
+      error = std::move(e);
+      return false;
+    }
+  };
+  Progress calculation_progress(callback, std::chrono::milliseconds{250});
+  ProgressScope scope(calculation_progress);
+  auto calculate = [&f]() {
+    py::gil_scoped_release release;
+    return f();
+  };
+  // the last call to the callback may raise an exception after the
+  // calculation has already finished, which is still raised
+  auto raise_error = [&error]() {
+    if (error) {
+      throw std::move(*error);
+    }
+  };
+  try {
+    if constexpr (std::is_void_v<std::invoke_result_t<Function>>) {
+      calculate();
+      raise_error();
+    } else {
+      auto result{calculate()};
+      raise_error();
+      return result;
+    }
+  } catch (const Cancelled &) {
+    raise_error();
+    throw;
+  }
+}
+
+// func with an additional progress argument, which is called without the GIL
+template <typename Return, typename... Args>
+auto with_progress(Return (*func)(Args...)) {
+  return [func](Args... args, const py::object &progress) {
+    return without_gil(progress, [&]() { return func(args...); });
+  };
+}
+
+template <typename DistIntType, typename... Args>
+auto with_progress(void (DataSet<DistIntType>::*func)(Args...)) {
+  return [func](DataSet<DistIntType> &self, Args... args,
+                const py::object &progress) {
+    without_gil(progress, [&]() { (self.*func)(args...); });
+  };
+}
+
+// read-only view of the lower triangular distances of a DataSet
+template <typename DistIntType>
+py::array_t<DistIntType> lt_array(py::object self) {
+  const auto &data{self.cast<const DataSet<DistIntType> &>()};
+  return as_readonly_pyarray(data.result.data(), data.result.size(), self);
+}
+
+// read-only view of the sequence indices of a DataSet, or if there are none
+// (as duplicates were not removed) an array of the indices of each sample
+template <typename DistIntType>
+py::array_t<std::size_t> sequence_indices(py::object self) {
+  const auto &data{self.cast<const DataSet<DistIntType> &>()};
+  if (data.sequence_indices.empty()) {
+    std::vector<std::size_t> indices(data.nsamples);
+    std::iota(indices.begin(), indices.end(), std::size_t{0});
+    return as_pyarray(std::move(indices));
+  }
+  return as_readonly_pyarray(data.sequence_indices.data(),
+                             data.sequence_indices.size(), self);
+}
+
+// the lower triangular distances of a DataSet as a read-only 1-d buffer
+template <typename DistIntType>
+py::buffer_info distances_buffer(DataSet<DistIntType> &self) {
+  return py::buffer_info(
+      self.result.data(), static_cast<py::ssize_t>(sizeof(DistIntType)),
+      py::format_descriptor<DistIntType>::format(), 1,
+      {static_cast<py::ssize_t>(self.result.size())},
+      {static_cast<py::ssize_t>(sizeof(DistIntType))}, true);
+}
+
 PYBIND11_MODULE(hammingdist, m) {
   m.doc() = "Small tool to calculate Hamming distances between gene sequences";
 
-  py::class_<DataSet<DefaultDistIntType>>(m, "DataSet")
-      .def("dump", &DataSet<DefaultDistIntType>::dump,
+  py::register_exception<Cancelled>(m, "Cancelled");
+
+  py::enum_<DenseEncoding>(m, "DenseEncoding",
+                           "Encoding of the sequences used by the CPU "
+                           "distance calculation")
+      .value("OneHot", DenseEncoding::OneHot,
+             "Two 4-bit one-hot encoded genes per byte (default)")
+      .value("BitPlane", DenseEncoding::BitPlane,
+             "Three bits per gene in separate 64-bit words, which can be "
+             "faster for long sequences. Not used if include_x=True or "
+             "use_gpu=True");
+
+  py::class_<DataSet<DefaultDistIntType>>(m, "DataSet", py::buffer_protocol())
+      .def("dump", with_progress(&DataSet<DefaultDistIntType>::dump),
+           py::arg("filename"), py::arg("progress") = py::none(),
            "Dump distances matrix in csv format")
       .def("dump_lower_triangular",
-           &DataSet<DefaultDistIntType>::dump_lower_triangular,
+           with_progress(&DataSet<DefaultDistIntType>::dump_lower_triangular),
+           py::arg("filename"), py::arg("progress") = py::none(),
            "Dump distances matrix in lower triangular format (comma-delimited, "
            "row-major)")
-      .def("dump_sparse", &DataSet<DefaultDistIntType>::dump_sparse,
+      .def("dump_sparse",
+           with_progress(&DataSet<DefaultDistIntType>::dump_sparse),
            py::arg("filename"), py::arg("threshold") = 255,
+           py::arg("progress") = py::none(),
            "Dump distances matrix in sparse format excluding any distances "
            "above threshold")
+      .def("dump_sparse_binary",
+           with_progress(&DataSet<DefaultDistIntType>::dump_sparse_binary),
+           py::arg("filename"), py::arg("threshold") = 255,
+           py::arg("progress") = py::none(),
+           "Dump distances matrix in binary sparse format of (int32 i, int32 "
+           "j, uint8 d) records excluding any distances above threshold")
+      .def("dump_sparse_npz",
+           with_progress(&DataSet<DefaultDistIntType>::dump_sparse_npz),
+           py::arg("filename"), py::arg("threshold") = 255,
+           py::arg("progress") = py::none(),
+           "Dump lower triangular distances matrix as a scipy sparse coo "
+           "matrix in npz format excluding any distances above threshold")
       .def("dump_sequence_indices",
            &DataSet<DefaultDistIntType>::dump_sequence_indices,
            "Dump row index in distances matrix for each input sequence")
+      .def("dump_binary", &DataSet<DefaultDistIntType>::dump_binary,
+           "Dump distances matrix and sequence indices in binary format, "
+           "which can be loaded without parsing")
       .def("__getitem__", &DataSet<DefaultDistIntType>::operator[])
-      .def_readonly("_distances", &DataSet<DefaultDistIntType>::result)
-      .def_property_readonly("lt_array", [](DataSet<DefaultDistIntType> &self) {
-        return py::array(self.result.size(), self.result.data());
-      });
+      .def_buffer(&distances_buffer<DefaultDistIntType>)
+      .def_property_readonly("_distances", &lt_array<DefaultDistIntType>)
+      .def_property_readonly("lt_array", &lt_array<DefaultDistIntType>,
+                             "Read-only view of the lower triangular "
+                             "distances, without copying them")
+      .def_property_readonly(
+          "sequence_indices", &sequence_indices<DefaultDistIntType>,
+          "Read-only view of the row index in distances matrix for each "
+          "input sequence, without copying them");
 
-  py::class_<DataSet<uint16_t>>(m, "DataSetLarge")
-      .def("dump", &DataSet<uint16_t>::dump,
+  py::class_<DataSet<uint16_t>>(m, "DataSetLarge", py::buffer_protocol())
+      .def("dump", with_progress(&DataSet<uint16_t>::dump),
+           py::arg("filename"), py::arg("progress") = py::none(),
            "Dump distances matrix in csv format")
-      .def("dump_lower_triangular", &DataSet<uint16_t>::dump_lower_triangular,
+      .def("dump_lower_triangular",
+           with_progress(&DataSet<uint16_t>::dump_lower_triangular),
+           py::arg("filename"), py::arg("progress") = py::none(),
            "Dump distances matrix in lower triangular format (comma-delimited, "
            "row-major)")
-      .def("dump_sparse", &DataSet<uint16_t>::dump_sparse, py::arg("filename"),
-           py::arg("threshold") = 65535,
+      .def("dump_sparse", with_progress(&DataSet<uint16_t>::dump_sparse),
+           py::arg("filename"), py::arg("threshold") = 65535,
+           py::arg("progress") = py::none(),
            "Dump distances matrix in sparse format excluding any distances "
            "above threshold")
+      .def("dump_sparse_binary",
+           with_progress(&DataSet<uint16_t>::dump_sparse_binary),
+           py::arg("filename"), py::arg("threshold") = 65535,
+           py::arg("progress") = py::none(),
+           "Dump distances matrix in binary sparse format of (int32 i, int32 "
+           "j, uint16 d) records excluding any distances above threshold")
+      .def("dump_sparse_npz",
+           with_progress(&DataSet<uint16_t>::dump_sparse_npz),
+           py::arg("filename"), py::arg("threshold") = 65535,
+           py::arg("progress") = py::none(),
+           "Dump lower triangular distances matrix as a scipy sparse coo "
+           "matrix in npz format excluding any distances above threshold")
       .def("dump_sequence_indices", &DataSet<uint16_t>::dump_sequence_indices,
            "Dump row index in distances matrix for each input sequence")
+      .def("dump_binary", &DataSet<uint16_t>::dump_binary,
+           "Dump distances matrix and sequence indices in binary format, "
+           "which can be loaded without parsing")
       .def("__getitem__", &DataSet<uint16_t>::operator[])
-      .def_readonly("_distances", &DataSet<uint16_t>::result)
-      .def_property_readonly("lt_array", [](DataSet<uint16_t> &self) {
-        return py::array(self.result.size(), self.result.data());
-      });
+      .def_buffer(&distances_buffer<uint16_t>)
+      .def_property_readonly("_distances", &lt_array<uint16_t>)
+      .def_property_readonly("lt_array", &lt_array<uint16_t>,
+                             "Read-only view of the lower triangular "
+                             "distances, without copying them")
+      .def_property_readonly("sequence_indices", &sequence_indices<uint16_t>,
+                             "Read-only view of the row index in distances "
+                             "matrix for each input sequence, without copying "
+                             "them");
 
-  m.def("from_stringlist", &from_stringlist,
+  m.def("from_stringlist", &from_stringlist, py::arg("data"),
+        py::arg("include_x") = false, py::arg("use_gpu") = false,
+        py::arg("max_distance") = std::numeric_limits<int>::max(),
+        py::arg("encoding") = DenseEncoding::OneHot,
         "Creates a dataset from a list of strings");
   m.def("from_csv", &from_csv,
         "Creates a dataset by reading already computed distances from csv "
         "(full matrix expected)");
-  m.def("from_fasta", &from_fasta<uint8_t>, py::arg("filename"),
-        py::arg("include_x") = false, py::arg("remove_duplicates") = false,
-        py::arg("n") = 0, py::arg("use_gpu") = false,
-        py::arg("max_distance") = 255,
+  m.def("from_fasta", with_progress(&from_fasta<uint8_t>),
+        py::arg("filename"), py::arg("include_x") = false,
+        py::arg("remove_duplicates") = false, py::arg("n") = 0,
+        py::arg("use_gpu") = false, py::arg("max_distance") = 255,
+        py::arg("distances_filename") = "",
+        py::arg("encoding") = DenseEncoding::OneHot,
+        py::arg("progress") = py::none(),
         "Creates a dataset by reading from a fasta file (assuming all "
         "sequences have equal length). Maximum value of an element in the "
         "distances matrix: max_distance or 255, whichever is lower."
         "Distances that would have been larger than "
         "this value instead saturate at this value - to support genomes with "
-        "larger distances than this see `from_fasta_large` instead.");
-  m.def("from_fasta_large", &from_fasta<uint16_t>, py::arg("filename"),
-        py::arg("include_x") = false, py::arg("remove_duplicates") = false,
-        py::arg("n") = 0, py::arg("use_gpu") = false,
-        py::arg("max_distance") = 65535,
+        "larger distances than this see `from_fasta_large` instead. If "
+        "distances_filename is given, the distances matrix is stored in this "
+        "file (in the format of dump_binary) instead of in memory. "
+        "encoding is the DenseEncoding of the sequences on the CPU. If "
+        "progress is given, it is called as progress(done, total) a few "
+        "times per second during the calculation, which is cancelled if it "
+        "returns False.");
+  m.def("from_fasta_large", with_progress(&from_fasta<uint16_t>),
+        py::arg("filename"), py::arg("include_x") = false,
+        py::arg("remove_duplicates") = false, py::arg("n") = 0,
+        py::arg("use_gpu") = false, py::arg("max_distance") = 65535,
+        py::arg("distances_filename") = "",
+        py::arg("encoding") = DenseEncoding::OneHot,
+        py::arg("progress") = py::none(),
         "Creates a dataset by reading from a fasta file (assuming all "
         "sequences have equal length). Maximum value of an element in the "
-        "distances matrix: max_distance or 65535, whichever is lower");
-  m.def("from_fasta_to_lower_triangular", &from_fasta_to_lower_triangular,
+        "distances matrix: max_distance or 65535, whichever is lower. If "
+        "distances_filename is given, the distances matrix is stored in this "
+        "file (in the format of dump_binary) instead of in memory. "
+        "encoding is the DenseEncoding of the sequences on the CPU. If "
+        "progress is given, it is called as progress(done, total) a few "
+        "times per second during the calculation, which is cancelled if it "
+        "returns False.");
+  m.def("from_fasta_to_lower_triangular",
+        with_progress(&from_fasta_to_lower_triangular),
         py::arg("fasta_filename"), py::arg("output_filename"),
         py::arg("remove_duplicates") = false, py::arg("n") = 0,
-        py::arg("use_gpu") = true, py::arg("max_distance") = 65535,
+        py::arg("use_gpu") = false, py::arg("max_distance") = 65535,
+        py::arg("buffer_bytes") = std::size_t{1} << 30,
+        py::arg("progress") = py::none(),
         "Construct lower triangular distances matrix output file from the "
-        "fasta file,"
-        "requires an NVIDIA GPU. Maximum value of an element in "
-        "the distances matrix: max_distance or 65535, whichever is lower");
+        "fasta file, without storing the entire distances matrix in memory. "
+        "Maximum value of an element in "
+        "the distances matrix: max_distance or 65535, whichever is lower. "
+        "On the CPU, the distances are calculated and written in blocks of "
+        "rows that use at most buffer_bytes of memory.");
   m.def("from_lower_triangular", &from_lower_triangular<uint8_t>,
         "Creates a dataset by reading already computed distances from lower "
         "triangular format. Maximum value of an element in the distances "
@@ -104,20 +308,53 @@ PYBIND11_MODULE(hammingdist, m) {
         "Creates a dataset by reading already computed distances from lower "
         "triangular format. Maximum value of an element in the distances "
         "matrix: 65535.");
+  m.def("from_binary", &from_binary<uint8_t>, py::arg("filename"),
+        "Creates a dataset from a file written by dump_binary, without copying "
+        "the distances into memory. Maximum value of an element in the "
+        "distances matrix: 255.");
+  m.def("from_binary_large", &from_binary<uint16_t>, py::arg("filename"),
+        "Creates a dataset from a file written by dump_binary, without copying "
+        "the distances into memory. Maximum value of an element in the "
+        "distances matrix: 65535.");
   m.def("distance", &distance, py::arg("seq0"), py::arg("seq1"),
         py::arg("include_x") = false,
         "Calculate the distance between seq0 and seq1");
   m.def(
       "fasta_reference_distances",
       [](const std::string &reference_sequence, const std::string &fasta_file,
-         bool include_x) {
-        return as_pyarray(fasta_reference_distances(reference_sequence,
-                                                    fasta_file, include_x));
+         bool include_x, const py::object &progress) {
+        return as_pyarray(without_gil(progress, [&]() {
+          return fasta_reference_distances(reference_sequence, fasta_file,
+                                           include_x);
+        }));
       },
       py::arg("reference_sequence"), py::arg("fasta_file"),
-      py::arg("include_x") = false,
+      py::arg("include_x") = false, py::arg("progress") = py::none(),
       "Calculates the distance of each sequence in the fasta file from the "
-      "supplied reference sequence");
+      "supplied reference sequence. If progress is given, it is called as "
+      "progress(done, total) a few times per second, and the calculation is "
+      "cancelled if it returns False");
+  m.def(
+      "fasta_reference_distances",
+      [](const std::vector<std::string> &reference_sequences,
+         const std::string &fasta_file, bool include_x,
+         const py::object &progress) {
+        auto distances{without_gil(progress, [&]() {
+          return fasta_reference_distances(reference_sequences, fasta_file,
+                                           include_x);
+        })};
+        auto n_references{static_cast<py::ssize_t>(reference_sequences.size())};
+        auto n_sequences{static_cast<py::ssize_t>(distances.size()) /
+                         n_references};
+        return as_pyarray(std::move(distances), {n_references, n_sequences});
+      },
+      py::arg("reference_sequences"), py::arg("fasta_file"),
+      py::arg("include_x") = false, py::arg("progress") = py::none(),
+      "Calculates the distance of each sequence in the fasta file from each "
+      "of the supplied reference sequences, reading the fasta file once. "
+      "Returns an array with one row for each reference sequence. If "
+      "progress is given, it is called as progress(done, total) a few times "
+      "per second, and the calculation is cancelled if it returns False");
   m.def(
       "fasta_sequence_indices",
       [](const std::string &fasta_file, std::size_t n) {
@@ -128,6 +365,28 @@ PYBIND11_MODULE(hammingdist, m) {
       "constructing the distances matrix."
       "For each genome in the input fasta file it gives the index of the "
       "corresponding row in the distances matrix which excludes duplicates");
+  m.def(
+      "fasta_threshold_pairs",
+      [](const std::string &fasta_file, const std::string &output_filename,
+         int threshold, bool remove_duplicates, std::size_t n,
+         const py::object &progress) {
+        return as_pyarray(without_gil(progress, [&]() {
+          return fasta_threshold_pairs(fasta_file, output_filename, threshold,
+                                       remove_duplicates, n);
+        }));
+      },
+      py::arg("fasta_file"), py::arg("output_filename"),
+      py::arg("threshold"), py::arg("remove_duplicates") = false,
+      py::arg("n") = 0, py::arg("progress") = py::none(),
+      "Writes all pairs of sequences in the fasta file with distance not "
+      "above threshold to output_filename, in the same format and order as "
+      "dump_sparse(), without constructing the distances matrix. If "
+      "remove_duplicates is True, the indices in the output refer to the "
+      "sequences without duplicates. Returns the index used in the output "
+      "for each sequence in the fasta file, as given by "
+      "fasta_sequence_indices(). If progress is given, it is called as "
+      "progress(done, total) a few times per second, and the calculation is "
+      "cancelled if it returns False");
   m.def("cuda_gpu_available", &cuda_gpu_available,
         "True if a GPU that supports CUDA is available");
 }
@@ -1,3 +1,4 @@
+import concurrent.futures
 import hammingdist
 import numpy as np
 import random
@@ -32,6 +33,7 @@ def check_output_sizes(dat, n_in, n_out, tmp_out_file, fasta_sequence_indices=No
     indices = np.loadtxt(tmp_out_file, delimiter=",")
     assert len(indices) == n_in
     assert indices[0] == 0
+    assert np.array_equal(dat.sequence_indices, indices)
     if fasta_sequence_indices is not None:
         assert np.allclose(indices, fasta_sequence_indices)
 
@@ -136,6 +138,95 @@ def test_fasta_reference_distances(chars, include_x, max_distance, tmp_path):
             )
 
 
+@pytest.mark.parametrize("include_x", [False, True])
+@pytest.mark.parametrize("n_references", [1, 2, 5, 12])
+def test_fasta_reference_distances_multiple(include_x, n_references, tmp_path):
+    chars = ["A", "C", "G", "T", "-", "X"]
+    sequences = ["".join(random.choices(chars, k=37)) for i in range(40)]
+    references = ["".join(random.choices(chars, k=37)) for i in range(n_references)]
+    fasta_file = str(tmp_path / "fasta.txt")
+    write_fasta_file(fasta_file, sequences)
+    distances = hammingdist.fasta_reference_distances(
+        references, fasta_file, include_x=include_x
+    )
+    assert distances.shape == (n_references, len(sequences))
+    assert distances.dtype == np.uint32
+    for r, reference in enumerate(references):
+        assert np.array_equal(
+            distances[r],
+            hammingdist.fasta_reference_distances(
+                reference, fasta_file, include_x=include_x
+            ),
+        )
+        for i, sequence in enumerate(sequences):
+            assert distances[r, i] == hammingdist.distance(
+                reference, sequence, include_x=include_x
+            )
+
+
+@pytest.mark.parametrize(
+    "from_fasta_func", [hammingdist.from_fasta, hammingdist.from_fasta_large]
+)
+def test_progress(tmp_path, from_fasta_func):
+    sequences = ["".join(random.choices("ACGT-", k=64)) for i in range(200)]
+    fasta_file = str(tmp_path / "fasta.txt")
+    write_fasta_file(fasta_file, sequences)
+    expected = from_fasta_func(fasta_file)
+    calls = []
+
+    def progress(done, total):
+        calls.append((done, total))
+        return True
+
+    # the GIL is released, so the calculation can run in another thread
+    with concurrent.futures.ThreadPoolExecutor() as executor:
+        future = executor.submit(from_fasta_func, fasta_file, progress=progress)
+        data = future.result()
+    assert np.array_equal(data.lt_array, expected.lt_array)
+    for done, total in calls:
+        assert done <= total
+    lt_file = str(tmp_path / "lt.txt")
+    data.dump_lower_triangular(lt_file, progress=progress)
+    assert np.array_equal(
+        hammingdist.from_lower_triangular_large(lt_file).lt_array, expected.lt_array
+    )
+    distances = hammingdist.fasta_reference_distances(
+        sequences[0], fasta_file, progress=progress
+    )
+    assert distances[0] == 0
+    assert issubclass(hammingdist.Cancelled, Exception)
+
+
+class ProgressError(Exception):
+    pass
+
+
+@pytest.mark.parametrize("raise_error", [False, True])
+def test_progress_cancel(tmp_path, raise_error):
+    fasta_file = str(tmp_path / "fasta.txt")
+    calls = []
+
+    def progress(done, total):
+        calls.append((done, total))
+        if raise_error:
+            raise ProgressError()
+        return False
+
+    expected_error = ProgressError if raise_error else hammingdist.Cancelled
+    # progress is only called if the calculation takes long enough
+    for n_seq in [500, 1000, 2000, 4000, 8000]:
+        sequences = ["".join(random.choices("ACGT", k=1000)) for i in range(n_seq)]
+        write_fasta_file(fasta_file, sequences)
+        calls.clear()
+        try:
+            hammingdist.from_fasta(fasta_file, progress=progress)
+        except expected_error:
+            assert calls
+            return
+        assert not calls
+    pytest.skip("calculation was too fast to call progress")
+
+
 def test_distance():
     assert hammingdist.distance("ACGT", "ACCT") == 1
     # here X is invalid so has distance 1 from itself:
@@ -146,12 +237,10 @@ def test_distance():
         hammingdist.distance("ACGT", "ACC")
 
 
-@pytest.mark.skipif(
-    not hammingdist.cuda_gpu_available(),
-    reason="No CUDA GPU available or hammingdist was compiled without CUDA support",
-)
+@pytest.mark.parametrize("use_gpu", gpu_options)
 @pytest.mark.parametrize("max_distance", [0, 1, 2, 3, 89, 497, 9999999])
-def test_from_fasta_to_lower_triangular(tmp_path, max_distance):
+@pytest.mark.parametrize("buffer_bytes", [0, 1 << 30])
+def test_from_fasta_to_lower_triangular(tmp_path, use_gpu, max_distance, buffer_bytes):
     sequences = [
         "ACGTGTCGTGTCGACGTGTCGCAGGTGTCGACGTGTCGCAGGTGTCGACGTGTCGCAG",
         "CCGTGTCGTGTCGACGTGTCGC-GGTGTCGACGTGTCGCAGGTGTCGACGTGTCGCAG",
@@ -165,7 +254,11 @@ def test_from_fasta_to_lower_triangular(tmp_path, max_distance):
     output_file = str(tmp_path / "out.txt")
     write_fasta_file(fasta_file, sequences)
     hammingdist.from_fasta_to_lower_triangular(
-        fasta_file, output_file, max_distance=max_distance
+        fasta_file,
+        output_file,
+        use_gpu=use_gpu,
+        max_distance=max_distance,
+        buffer_bytes=buffer_bytes,
     )
     with open(output_file) as f:
         data = f.read().splitlines()
@@ -174,6 +267,128 @@ def test_from_fasta_to_lower_triangular(tmp_path, max_distance):
     assert np.allclose(np.fromstring(data[1], sep=","), lower_triangular_dist[1])
 
 
+@pytest.mark.parametrize(
+    "from_fasta_func, from_binary_func, dtype",
+    [
+        (hammingdist.from_fasta, hammingdist.from_binary, np.uint8),
+        (hammingdist.from_fasta_large, hammingdist.from_binary_large, np.uint16),
+    ],
+)
+@pytest.mark.parametrize("remove_duplicates", [False, True])
+def test_dump_binary(
+    tmp_path, from_fasta_func, from_binary_func, dtype, remove_duplicates
+):
+    fasta_file = str(tmp_path / "fasta.txt")
+    binary_file = str(tmp_path / "distances.bin")
+    sequences = ["".join(random.choices("ACGT-", k=50)) for _ in range(30)]
+    write_fasta_file(fasta_file, sequences + sequences[:10])
+    data = from_fasta_func(fasta_file, remove_duplicates=remove_duplicates)
+    data.dump_binary(binary_file)
+    restored = from_binary_func(binary_file)
+    assert np.array_equal(restored.lt_array, data.lt_array)
+    n = 30 if remove_duplicates else 40
+    for i in range(n):
+        for j in range(n):
+            assert restored[i, j] == data[i, j]
+    # the distances can also be read directly with numpy
+    mapped = np.memmap(
+        binary_file, dtype=dtype, mode="r", offset=64, shape=(n * (n - 1) // 2,)
+    )
+    assert np.array_equal(mapped, data.lt_array)
+
+
+@pytest.mark.parametrize(
+    "from_fasta_func, dtype",
+    [(hammingdist.from_fasta, np.uint8), (hammingdist.from_fasta_large, np.uint16)],
+)
+def test_read_only_views(tmp_path, from_fasta_func, dtype):
+    fasta_file = str(tmp_path / "fasta.txt")
+    sequences = ["".join(random.choices("ACGT", k=30)) for _ in range(20)]
+    write_fasta_file(fasta_file, sequences + sequences[:5])
+    data = from_fasta_func(fasta_file, remove_duplicates=True)
+    lt_array = data.lt_array
+    assert lt_array.dtype == dtype
+    assert not lt_array.flags.writeable
+    assert not lt_array.flags.owndata
+    with pytest.raises(ValueError):
+        lt_array[0] = 1
+    # each access returns a view of the same memory
+    assert np.shares_memory(lt_array, data.lt_array)
+    # the DataSet also supports the buffer protocol
+    buffer = memoryview(data)
+    assert buffer.readonly
+    assert np.shares_memory(np.asarray(data), lt_array)
+    sequence_indices = data.sequence_indices
+    assert not sequence_indices.flags.writeable
+    assert np.array_equal(
+        sequence_indices, hammingdist.fasta_sequence_indices(fasta_file)
+    )
+    expected = np.array(lt_array)
+    # the views keep the DataSet alive
+    del data, buffer
+    assert np.array_equal(lt_array, expected)
+    assert np.array_equal(sequence_indices[20:], np.arange(5))
+    # a single sequence has no distances
+    write_fasta_file(fasta_file, sequences[:1])
+    data = from_fasta_func(fasta_file)
+    assert data.lt_array.shape == (0,)
+    assert data.lt_array.dtype == dtype
+    assert not data.lt_array.flags.writeable
+    assert memoryview(data).nbytes == 0
+    assert np.asarray(data).shape == (0,)
+    assert np.array_equal(data.sequence_indices, [0])
+
+
+@pytest.mark.parametrize(
+    "from_fasta_func, from_binary_func",
+    [
+        (hammingdist.from_fasta, hammingdist.from_binary),
+        (hammingdist.from_fasta_large, hammingdist.from_binary_large),
+    ],
+)
+@pytest.mark.parametrize("remove_duplicates", [False, True])
+def test_from_fasta_distances_filename(
+    tmp_path, from_fasta_func, from_binary_func, remove_duplicates
+):
+    fasta_file = str(tmp_path / "fasta.txt")
+    binary_file = str(tmp_path / "distances.bin")
+    sequences = ["".join(random.choices("ACGT-", k=50)) for _ in range(30)]
+    write_fasta_file(fasta_file, sequences + sequences[:10])
+    data = from_fasta_func(fasta_file, remove_duplicates=remove_duplicates)
+    data_file = from_fasta_func(
+        fasta_file,
+        remove_duplicates=remove_duplicates,
+        distances_filename=binary_file,
+    )
+    assert np.array_equal(data_file.lt_array, data.lt_array)
+    assert data_file[3, 7] == data[3, 7]
+    del data_file
+    mapped = from_binary_func(binary_file)
+    lt_array = mapped.lt_array
+    assert not lt_array.flags.writeable
+    assert np.shares_memory(np.asarray(mapped), lt_array)
+    # the view of the mapped file keeps the DataSet, and hence the mapping, alive
+    del mapped
+    assert np.array_equal(lt_array, data.lt_array)
+
+
+@pytest.mark.parametrize(
+    "from_fasta_func", [hammingdist.from_fasta, hammingdist.from_fasta_large]
+)
+@pytest.mark.parametrize("include_x", [False, True])
+def test_from_fasta_encoding(tmp_path, from_fasta_func, include_x):
+    fasta_file = str(tmp_path / "fasta.txt")
+    sequences = ["".join(random.choices("ACGTX-", k=300)) for _ in range(40)]
+    write_fasta_file(fasta_file, sequences)
+    data = from_fasta_func(fasta_file, include_x=include_x)
+    data_bitplane = from_fasta_func(
+        fasta_file,
+        include_x=include_x,
+        encoding=hammingdist.DenseEncoding.BitPlane,
+    )
+    assert np.array_equal(data_bitplane.lt_array, data.lt_array)
+
+
 @pytest.mark.parametrize("samples", [2, 3, 5, 11, 54, 120, 532, 981, 1568])
 @pytest.mark.parametrize("threshold", [0, 1, 2, 3, 4, 9, 89, 497])
 def test_dump_sparse(tmp_path, samples, threshold):
@@ -202,3 +417,65 @@ def test_dump_sparse(tmp_path, samples, threshold):
         for e in sparse:
             assert e[2] <= threshold
             assert data[e[0], e[1]] == e[2]
+
+
+@pytest.mark.parametrize("samples", [2, 3, 11, 120, 1500])
+@pytest.mark.parametrize("threshold", [0, 3, 255])
+def test_dump_sparse_binary(tmp_path, samples, threshold):
+    lt_file = str(tmp_path / "lt.txt")
+    with open(lt_file, "w") as f:
+        for n in range(1, samples):
+            f.write(",".join(str(x) for x in np.random.randint(0, 256, size=n)))
+            f.write("\n")
+    data = hammingdist.from_lower_triangular(lt_file)
+    sparse_file = str(tmp_path / "sparse.txt")
+    data.dump_sparse(sparse_file, threshold)
+    with open(sparse_file) as f:
+        sparse = np.array([line.split() for line in f], dtype=np.int64).reshape(-1, 3)
+    binary_file = str(tmp_path / "sparse.bin")
+    data.dump_sparse_binary(binary_file, threshold)
+    records = np.fromfile(
+        binary_file, dtype=np.dtype([("i", "<i4"), ("j", "<i4"), ("d", "u1")])
+    )
+    assert np.array_equal(records["i"], sparse[:, 0])
+    assert np.array_equal(records["j"], sparse[:, 1])
+    assert np.array_equal(records["d"], sparse[:, 2])
+    npz_file = str(tmp_path / "sparse.npz")
+    try:
+        data.dump_sparse_npz(npz_file, threshold)
+    except RuntimeError as e:
+        pytest.skip(str(e))
+    with np.load(npz_file) as npz:
+        assert npz["format"] == b"coo"
+        assert np.array_equal(npz["shape"], [samples, samples])
+        assert np.array_equal(npz["row"], records["i"])
+        assert np.array_equal(npz["col"], records["j"])
+        assert np.array_equal(npz["data"], records["d"])
+
+
+@pytest.mark.parametrize("samples", [2, 3, 11, 120])
+@pytest.mark.parametrize("threshold", [0, 1, 3, 9])
+@pytest.mark.parametrize("remove_duplicates", [False, True])
+def test_fasta_threshold_pairs(tmp_path, samples, threshold, remove_duplicates):
+    base = "".join(random.choices(["A", "C", "G", "T"], k=200))
+    sequences = []
+    for i in range(samples):
+        seq = list(base)
+        for _ in range(random.randint(0, 12)):
+            seq[random.randrange(len(seq))] = random.choice("ACGT-N")
+        sequences.append("".join(seq))
+    fasta_file = str(tmp_path / "fasta.txt")
+    pairs_file = str(tmp_path / "pairs.txt")
+    sparse_file = str(tmp_path / "sparse.txt")
+    write_fasta_file(fasta_file, sequences)
+    sequence_indices = hammingdist.fasta_threshold_pairs(
+        fasta_file, pairs_file, threshold, remove_duplicates=remove_duplicates
+    )
+    data = hammingdist.from_fasta(fasta_file, remove_duplicates=remove_duplicates)
+    data.dump_sparse(sparse_file, threshold)
+    with open(pairs_file) as f:
+        pairs = f.read()
+    with open(sparse_file) as f:
+        sparse = f.read()
+    assert pairs == sparse
+    assert np.array_equal(sequence_indices, data.sequence_indices)
@@ -22,6 +22,15 @@ void CheckedCopyToDevice(T *dest, const std::vector<T> &src) {
   }
 }
 
+template <typename T>
+void CheckedCopyToDevice(T *dest, const T *src, std::size_t n_elements) {
+  std::size_t count{sizeof(T) * n_elements}; // count in bytes
+  if (cudaError err{cudaMemcpy(dest, src, count, cudaMemcpyHostToDevice)};
+      err != cudaSuccess) {
+    throw std::runtime_error(cudaGetErrorString(err));
+  }
+}
+
 template <typename T>
 void CheckedCopyToHost(T *dest, const T *src, std::size_t n_elements) {
   std::size_t count{sizeof(T) * n_elements}; // count in bytes
@@ -1,10 +1,12 @@
 #include "hamming/distance_avx2.hh"
+#include "hamming/hamming_tiles.hh"
+#include <bit>
 #include <immintrin.h>
 
 namespace hamming {
 
-int distance_avx2(const std::vector<GeneBlock> &a,
-                  const std::vector<GeneBlock> &b, int max_dist) {
+HAMMING_ALWAYS_INLINE static int distance_impl(DenseRow a, DenseRow b,
+                                               int max_dist) {
   // distance implementation using AVX2 simd intrinsics
   // a 256-bit register holds 32 GeneBlocks, i.e. 64 genes
   constexpr std::size_t n_geneblocks{32};
@@ -76,4 +78,348 @@ int distance_avx2(const std::vector<GeneBlock> &a,
   return std::min(max_dist, r);
 }
 
+HAMMING_ALWAYS_INLINE static std::array<int, n_partners>
+distance_1x4_impl(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist) {
+  // register-blocked version of distance_avx2: each chunk of a is loaded once
+  // and compared with the corresponding chunk of n_partners rows, each of
+  // which has its own vector of distance counts
+  constexpr std::size_t n_geneblocks{32};
+  std::array<int, n_partners> r{};
+  // mask to select lower gene from each GeneBlock
+  const __m256i mask0 = _mm256_set1_epi8(mask_gene0);
+  // mask to select upper gene from each GeneBlock
+  const __m256i mask1 = _mm256_set1_epi8(mask_gene1);
+  const __m256i zero = _mm256_setzero_si256();
+  // vectors of distance counts, one for each partner
+  __m256i r_s[n_partners];
+  // work registers
+  __m256i r_a;
+  __m256i r_b;
+  __m256i r_c;
+  std::size_t n_iter{a.size() / n_geneblocks};
+  // see distance_avx2 for the choice of the number of inner iterations
+  std::size_t n_inner = max_dist >= 255 ? 127 : 16;
+  std::size_t n_outer{1 + n_iter / n_inner};
+  for (std::size_t j = 0; j < n_outer; ++j) {
+    std::size_t n{std::min((j + 1) * n_inner, n_iter)};
+    for (auto &r_sk : r_s) {
+      r_sk = zero;
+    }
+    for (std::size_t i = j * n_inner; i < n; ++i) {
+      r_a = _mm256_loadu_si256((__m256i *)(a.data() + n_geneblocks * i));
+      for (std::size_t k = 0; k < n_partners; ++k) {
+        r_b = _mm256_loadu_si256((__m256i *)(b[k].data() + n_geneblocks * i));
+        // a[i] & b[i]
+        r_b = _mm256_and_si256(r_a, r_b);
+        // compare lower and upper genes with zero: 0xff if zero, 0 otherwise
+        r_c = _mm256_cmpeq_epi8(_mm256_and_si256(r_b, mask0), zero);
+        r_b = _mm256_cmpeq_epi8(_mm256_and_si256(r_b, mask1), zero);
+        // subtracting 0xff (i.e. -1) adds one to the distance count
+        r_s[k] = _mm256_sub_epi8(r_s[k], r_c);
+        r_s[k] = _mm256_sub_epi8(r_s[k], r_b);
+      }
+    }
+    // sum the 32 distances in each r_s & add to r
+    bool all_at_max_dist{true};
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      constexpr std::size_t n_partialsums{n_geneblocks / 8};
+      r_c = _mm256_sad_epu8(r_s[k], zero);
+      alignas(32) std::uint64_t r_partial[n_partialsums];
+      _mm256_store_si256((__m256i *)r_partial, r_c);
+      for (std::size_t i = 0; i < n_partialsums; ++i) {
+        r[k] += static_cast<int>(r_partial[i]);
+      }
+      all_at_max_dist = all_at_max_dist && (r[k] >= max_dist);
+    }
+    if (all_at_max_dist) {
+      r.fill(max_dist);
+      return r;
+    }
+  }
+  // do last partial block without simd intrinsics
+  for (std::size_t i = n_geneblocks * n_iter; i < a.size(); ++i) {
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      auto c{static_cast<GeneBlock>(a[i] & b[k][i])};
+      r[k] += static_cast<int>((c & mask_gene0) == 0);
+      r[k] += static_cast<int>((c & mask_gene1) == 0);
+    }
+  }
+  for (auto &rk : r) {
+    rk = std::min(max_dist, rk);
+  }
+  return r;
+}
+
+// carry-save adder: the sum of the bits of a, b and c is 2 * h + l
+static inline void csa(__m256i &h, __m256i &l, __m256i a, __m256i b,
+                       __m256i c) {
+  const __m256i u = _mm256_xor_si256(a, b);
+  h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+  l = _mm256_xor_si256(u, c);
+}
+
+// number of set bits in each 64-bit element of v
+static inline __m256i popcount_epi64(__m256i v) {
+  // number of set bits in each possible 4-bit value
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                       2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, mask));
+  __m256i hi = _mm256_shuffle_epi8(
+      lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static inline std::uint64_t sum_epi64(__m256i v) {
+  alignas(32) std::uint64_t r_partial[4];
+  _mm256_store_si256((__m256i *)r_partial, v);
+  return r_partial[0] + r_partial[1] + r_partial[2] + r_partial[3];
+}
+
+// bit mask of the genes that differ in words [i, i+4) of a and b
+static inline __m256i mismatch_bitplane(const BitPlaneRow &a,
+                                        const BitPlaneRow &b, std::size_t i) {
+  __m256i lo_a = _mm256_loadu_si256((__m256i *)(a.lo() + i));
+  __m256i hi_a = _mm256_loadu_si256((__m256i *)(a.hi() + i));
+  __m256i valid_a = _mm256_loadu_si256((__m256i *)(a.valid() + i));
+  __m256i lo_b = _mm256_loadu_si256((__m256i *)(b.lo() + i));
+  __m256i hi_b = _mm256_loadu_si256((__m256i *)(b.hi() + i));
+  __m256i valid_b = _mm256_loadu_si256((__m256i *)(b.valid() + i));
+  // both valid and differ
+  __m256i m = _mm256_and_si256(
+      _mm256_and_si256(valid_a, valid_b),
+      _mm256_or_si256(_mm256_xor_si256(lo_a, lo_b),
+                      _mm256_xor_si256(hi_a, hi_b)));
+  // or either is invalid
+  m = _mm256_or_si256(m, _mm256_andnot_si256(valid_a, hi_a));
+  return _mm256_or_si256(m, _mm256_andnot_si256(valid_b, hi_b));
+}
+
+HAMMING_ALWAYS_INLINE static int
+distance_bitplane_impl(BitPlaneRow a, BitPlaneRow b, int max_dist) {
+  // distance implementation for bit-plane encoded data using AVX2 simd
+  // intrinsics: a 256-bit register holds 4 BitPlaneWords, i.e. 256 genes.
+  // the mismatch bits are counted using a Harley-Seal carry-save adder tree,
+  // so that only one in 16 registers needs a full popcount
+  constexpr std::size_t n_words{4};
+  constexpr std::size_t n_block{16};
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i total = zero;
+  __m256i ones = zero;
+  __m256i twos = zero;
+  __m256i fours = zero;
+  __m256i eights = zero;
+  __m256i sixteens;
+  __m256i twos_a;
+  __m256i twos_b;
+  __m256i fours_a;
+  __m256i fours_b;
+  __m256i eights_a;
+  __m256i eights_b;
+  std::size_t n_iter{a.size() / n_words};
+  std::size_t i{0};
+  auto m = [&a, &b, &i](std::size_t k) {
+    return mismatch_bitplane(a, b, n_words * (i + k));
+  };
+  for (; i + n_block <= n_iter; i += n_block) {
+    csa(twos_a, ones, ones, m(0), m(1));
+    csa(twos_b, ones, ones, m(2), m(3));
+    csa(fours_a, twos, twos, twos_a, twos_b);
+    csa(twos_a, ones, ones, m(4), m(5));
+    csa(twos_b, ones, ones, m(6), m(7));
+    csa(fours_b, twos, twos, twos_a, twos_b);
+    csa(eights_a, fours, fours, fours_a, fours_b);
+    csa(twos_a, ones, ones, m(8), m(9));
+    csa(twos_b, ones, ones, m(10), m(11));
+    csa(fours_a, twos, twos, twos_a, twos_b);
+    csa(twos_a, ones, ones, m(12), m(13));
+    csa(twos_b, ones, ones, m(14), m(15));
+    csa(fours_b, twos, twos, twos_a, twos_b);
+    csa(eights_b, fours, fours, fours_a, fours_b);
+    csa(sixteens, eights, eights, eights_a, eights_b);
+    total = _mm256_add_epi64(total, popcount_epi64(sixteens));
+    // 16 * total is a lower bound on the distance
+    if (16 * sum_epi64(total) >= static_cast<std::uint64_t>(max_dist)) {
+      return max_dist;
+    }
+  }
+  total = _mm256_slli_epi64(total, 4);
+  total = _mm256_add_epi64(total,
+                           _mm256_slli_epi64(popcount_epi64(eights), 3));
+  total =
+      _mm256_add_epi64(total, _mm256_slli_epi64(popcount_epi64(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_epi64(twos), 1));
+  total = _mm256_add_epi64(total, popcount_epi64(ones));
+  // remaining registers that don't fill a Harley-Seal block
+  for (; i < n_iter; ++i) {
+    total = _mm256_add_epi64(total, popcount_epi64(m(0)));
+  }
+  auto r{static_cast<int>(
+      std::min(sum_epi64(total), static_cast<std::uint64_t>(max_dist)))};
+  // do last partial register without simd intrinsics
+  for (std::size_t k = n_words * n_iter; k < a.size(); ++k) {
+    auto va{a.valid()[k]};
+    auto vb{b.valid()[k]};
+    auto differ{(a.lo()[k] ^ b.lo()[k]) | (a.hi()[k] ^ b.hi()[k])};
+    r += std::popcount((va & vb & differ) | (a.hi()[k] & ~va) |
+                       (b.hi()[k] & ~vb));
+  }
+  return std::min(max_dist, r);
+}
+
+static inline int sum_epi32(__m256i v) {
+  alignas(32) std::int32_t r_partial[8];
+  _mm256_store_si256((__m256i *)r_partial, v);
+  int r{0};
+  for (auto x : r_partial) {
+    r += x;
+  }
+  return r;
+}
+
+HAMMING_ALWAYS_INLINE static int
+distance_sparse_impl(const SparseData &a, const SparseData &b, int max_dist) {
+  // sparse distance implementation using AVX2 simd intrinsics: blocks of 8
+  // positions from a and b are compared all-against-all, by comparing them 8
+  // times while rotating the block from b, and for each match the correction
+  // to n_nondash_a + n_nondash_b is calculated from the codes (see
+  // sparse_overlap_correction)
+  constexpr std::size_t n_block{8};
+  int r{a.n_nondash + b.n_nondash};
+  // each overlapping position reduces the distance by at most 2
+  if (r - 2 * static_cast<int>(std::min(a.size(), b.size())) >= max_dist) {
+    return max_dist;
+  }
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  const __m256i dash = _mm256_set1_epi32(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi32(-1);
+  // sum of minus the corrections
+  __m256i r_s = zero;
+  __m256i r_pa;
+  __m256i r_pb;
+  __m256i r_ca;
+  __m256i r_cb;
+  // -1 where the code is not '-', 0 otherwise
+  __m256i r_nda;
+  __m256i r_ndb;
+  __m256i r_differ;
+  __m256i r_eq;
+  std::size_t ia{0};
+  std::size_t ib{0};
+  std::size_t na{n_block * (a.size() / n_block)};
+  std::size_t nb{n_block * (b.size() / n_block)};
+  while (ia < na && ib < nb) {
+    r_pa = _mm256_loadu_si256((__m256i *)(a.positions.data() + ia));
+    r_pb = _mm256_loadu_si256((__m256i *)(b.positions.data() + ib));
+    r_ca = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((__m128i *)(a.codes.data() + ia)));
+    r_cb = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((__m128i *)(b.codes.data() + ib)));
+    r_nda = _mm256_xor_si256(_mm256_cmpeq_epi32(r_ca, dash), ones);
+    r_ndb = _mm256_xor_si256(_mm256_cmpeq_epi32(r_cb, dash), ones);
+    for (std::size_t k = 0; k < n_block; ++k) {
+      r_eq = _mm256_cmpeq_epi32(r_pa, r_pb);
+      // (a & b) == 0 || (a != b && nodash_a && nodash_b)
+      r_differ = _mm256_or_si256(
+          _mm256_cmpeq_epi32(_mm256_and_si256(r_ca, r_cb), zero),
+          _mm256_andnot_si256(_mm256_cmpeq_epi32(r_ca, r_cb),
+                              _mm256_and_si256(r_nda, r_ndb)));
+      // minus the correction is nodash_a + nodash_b - differ, where true = -1
+      r_differ = _mm256_sub_epi32(_mm256_add_epi32(r_nda, r_ndb), r_differ);
+      r_s = _mm256_add_epi32(r_s, _mm256_and_si256(r_eq, r_differ));
+      // rotate b
+      r_pb = _mm256_permutevar8x32_epi32(r_pb, rotate);
+      r_cb = _mm256_permutevar8x32_epi32(r_cb, rotate);
+      r_ndb = _mm256_permutevar8x32_epi32(r_ndb, rotate);
+    }
+    // advance the block(s) with the smallest last position: any remaining
+    // matches for its elements can only be in blocks that have already been
+    // compared with it
+    auto a_max{a.positions[ia + n_block - 1]};
+    auto b_max{b.positions[ib + n_block - 1]};
+    ia += n_block * static_cast<std::size_t>(a_max <= b_max);
+    ib += n_block * static_cast<std::size_t>(b_max <= a_max);
+  }
+  r += sum_epi32(r_s);
+  // do remaining partial blocks without simd intrinsics
+  r -= sparse_overlap_correction(a, ia, b, ib);
+  return std::min(r, max_dist);
+}
+
+int distance_avx2(DenseRow a, DenseRow b, int max_dist) {
+  return distance_impl(a, b, max_dist);
+}
+
+std::array<int, n_partners>
+distance_avx2_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist) {
+  return distance_1x4_impl(a, b, max_dist);
+}
+
+int distance_avx2_bitplane(BitPlaneRow a, BitPlaneRow b, int max_dist) {
+  return distance_bitplane_impl(a, b, max_dist);
+}
+
+int distance_avx2_sparse(const SparseData &a, const SparseData &b,
+                         int max_dist) {
+  return distance_sparse_impl(a, b, max_dist);
+}
+
+// the kernels are wrapped in lambdas, and always inlined, so that they are
+// compiled into the distances_tiled loop
+static constexpr auto distance_kernel = [](DenseRow a, DenseRow b,
+                                           int max_dist) {
+  return distance_impl(a, b, max_dist);
+};
+
+static constexpr auto distance_1x4_kernel =
+    [](DenseRow a, const std::array<DenseRow, n_partners> &b, int max_dist) {
+      return distance_1x4_impl(a, b, max_dist);
+    };
+
+static constexpr auto distance_bitplane_kernel = [](BitPlaneRow a,
+                                                    BitPlaneRow b,
+                                                    int max_dist) {
+  return distance_bitplane_impl(a, b, max_dist);
+};
+
+void distances_avx2(const DenseData &data, std::uint8_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx2(const DenseData &data, std::uint16_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx2(const DenseData &data, std::uint32_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx2(const BitPlaneData &data, std::uint8_t *result,
+                    int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
+void distances_avx2(const BitPlaneData &data, std::uint16_t *result,
+                    int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
+void distances_avx2(const BitPlaneData &data, std::uint32_t *result,
+                    int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
 } // namespace hamming
@@ -24,3 +24,61 @@ static void bench_distance_avx2(benchmark::State &state) {
 }
 
 BENCHMARK(bench_distance_avx2)->Range(4096, 4194304)->Complexity();
+
+static void bench_distance_avx2_1x4(benchmark::State &state) {
+#ifdef HAMMING_WITH_OPENMP
+  omp_set_num_threads(1);
+#endif
+  std::mt19937 gen(12345);
+  int64_t n{state.range(0)};
+  auto s1{from_string(make_string(n, gen))};
+  std::array<std::vector<GeneBlock>, n_partners> s2;
+  for (auto &s : s2) {
+    s = from_string(make_string(n, gen));
+  }
+  int d{0};
+  for (auto _ : state) {
+    auto r{distance_avx2_1x4(s1, {s2[0], s2[1], s2[2], s2[3]})};
+    d += r[0];
+  }
+  state.SetComplexityN(n);
+}
+
+BENCHMARK(bench_distance_avx2_1x4)->Range(4096, 4194304)->Complexity();
+
+static void bench_distance_avx2_bitplane(benchmark::State &state) {
+#ifdef HAMMING_WITH_OPENMP
+  omp_set_num_threads(1);
+#endif
+  std::mt19937 gen(12345);
+  int64_t n{state.range(0)};
+  auto s1{from_string_bitplane(make_string(n, gen))};
+  auto s2{from_string_bitplane(make_string(n, gen))};
+  int d{0};
+  for (auto _ : state) {
+    d += distance_avx2_bitplane(s1, s2);
+  }
+  state.SetComplexityN(n);
+}
+
+BENCHMARK(bench_distance_avx2_bitplane)->Range(4096, 4194304)->Complexity();
+
+static void bench_distance_avx2_sparse(benchmark::State &state) {
+#ifdef HAMMING_WITH_OPENMP
+  omp_set_num_threads(1);
+#endif
+  std::mt19937 gen(12345);
+  int64_t n{state.range(0)};
+  auto s1{make_string(n, gen, false)};
+  auto s2{s1};
+  // make ~0.5% of s2 elements differ from s1
+  randomize_n(s2, n / 200, gen);
+  auto sparse = to_sparse_data(std::vector<std::string>{s1, s2}, false);
+  int d{0};
+  for (auto _ : state) {
+    d += distance_avx2_sparse(sparse[0], sparse[1]);
+  }
+  state.SetComplexityN(n);
+}
+
+BENCHMARK(bench_distance_avx2_sparse)->Range(4096, 4194304)->Complexity();
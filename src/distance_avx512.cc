@@ -1,10 +1,12 @@
 #include "hamming/distance_avx512.hh"
+#include "hamming/hamming_tiles.hh"
+#include <bit>
 #include <immintrin.h>
 
 namespace hamming {
 
-int distance_avx512(const std::vector<GeneBlock> &a,
-                    const std::vector<GeneBlock> &b, int max_dist) {
+HAMMING_ALWAYS_INLINE static int distance_impl(DenseRow a, DenseRow b,
+                                               int max_dist) {
   // distance implementation using AVX512 simd intrinsics
   // a 512-bit register holds 64 GeneBlocks, i.e. 128 genes
   constexpr std::size_t n_geneblocks{64};
@@ -75,4 +77,264 @@ int distance_avx512(const std::vector<GeneBlock> &a,
   return std::min(max_dist, r);
 }
 
+// sum of the 64-bit elements of v
+static inline std::uint64_t sum_epi64(__m512i v) {
+  alignas(64) std::uint64_t partial[8];
+  _mm512_store_si512((__m512i *)partial, v);
+  std::uint64_t sum{0};
+  for (auto p : partial) {
+    sum += p;
+  }
+  return sum;
+}
+
+HAMMING_ALWAYS_INLINE static std::array<int, n_partners>
+distance_1x4_impl(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist) {
+  // register-blocked version of distance_avx512: each chunk of a is loaded
+  // once and compared with the corresponding chunk of n_partners rows, each of
+  // which has its own vector of distance counts
+  constexpr std::size_t n_geneblocks{64};
+  std::array<int, n_partners> r{};
+  // mask to select LSB of each gene
+  const __m512i lsb = _mm512_set1_epi8(1);
+  // mask to select lower gene from each GeneBlock
+  const __m512i mask0 = _mm512_set1_epi8(mask_gene0);
+  // mask to select upper gene from each GeneBlock
+  const __m512i mask1 = _mm512_set1_epi8(mask_gene1);
+  const __m512i zero = _mm512_setzero_si512();
+  // vectors of distance counts, one for each partner
+  __m512i r_s[n_partners];
+  // work registers
+  __m512i r_a;
+  __m512i r_b;
+  // mask register
+  __mmask64 r_m;
+  std::size_t n_iter{a.size() / n_geneblocks};
+  // see distance_avx512 for the choice of the number of inner iterations
+  std::size_t n_inner = max_dist >= 255 ? 127 : 16;
+  std::size_t n_outer{1 + n_iter / n_inner};
+  for (std::size_t j = 0; j < n_outer; ++j) {
+    std::size_t n{std::min((j + 1) * n_inner, n_iter)};
+    for (auto &r_sk : r_s) {
+      r_sk = zero;
+    }
+    for (std::size_t i = j * n_inner; i < n; ++i) {
+      r_a = _mm512_loadu_si512((__m512i *)(a.data() + n_geneblocks * i));
+      for (std::size_t k = 0; k < n_partners; ++k) {
+        r_b = _mm512_loadu_si512((__m512i *)(b[k].data() + n_geneblocks * i));
+        // a[i] & b[i]
+        r_b = _mm512_and_si512(r_a, r_b);
+        // mask bit is set where (a[i] & b[i]) & mask0 is zero
+        r_m = _mm512_testn_epi8_mask(r_b, mask0);
+        r_s[k] = _mm512_mask_add_epi8(r_s[k], r_m, lsb, r_s[k]);
+        // repeat for upper genes
+        r_m = _mm512_testn_epi8_mask(r_b, mask1);
+        r_s[k] = _mm512_mask_add_epi8(r_s[k], r_m, lsb, r_s[k]);
+      }
+    }
+    // sum the 64 distances in each r_s & add to r
+    bool all_at_max_dist{true};
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      r[k] += static_cast<int>(sum_epi64(_mm512_sad_epu8(r_s[k], zero)));
+      all_at_max_dist = all_at_max_dist && (r[k] >= max_dist);
+    }
+    if (all_at_max_dist) {
+      r.fill(max_dist);
+      return r;
+    }
+  }
+  // do last partial block without simd intrinsics
+  for (std::size_t i = n_geneblocks * n_iter; i < a.size(); ++i) {
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      auto c{static_cast<GeneBlock>(a[i] & b[k][i])};
+      r[k] += static_cast<int>((c & mask_gene0) == 0);
+      r[k] += static_cast<int>((c & mask_gene1) == 0);
+    }
+  }
+  for (auto &rk : r) {
+    rk = std::min(max_dist, rk);
+  }
+  return r;
+}
+
+// carry-save adder: the sum of the bits of a, b and c is 2 * h + l
+static inline void csa(__m512i &h, __m512i &l, __m512i a, __m512i b,
+                       __m512i c) {
+  // majority(a, b, c)
+  h = _mm512_ternarylogic_epi64(a, b, c, 0xe8);
+  // a ^ b ^ c
+  l = _mm512_ternarylogic_epi64(a, b, c, 0x96);
+}
+
+// number of set bits in each 64-bit element of v
+static inline __m512i popcount_epi64(__m512i v) {
+  // number of set bits in each possible 4-bit value, in each 128-bit lane
+  const __m512i lookup =
+      _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+  const __m512i mask = _mm512_set1_epi8(0x0f);
+  __m512i lo = _mm512_shuffle_epi8(lookup, _mm512_and_si512(v, mask));
+  __m512i hi = _mm512_shuffle_epi8(
+      lookup, _mm512_and_si512(_mm512_srli_epi16(v, 4), mask));
+  return _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512());
+}
+
+// bit mask of the genes that differ in words [i, i+8) of a and b
+static inline __m512i mismatch_bitplane(const BitPlaneRow &a,
+                                        const BitPlaneRow &b, std::size_t i) {
+  __m512i lo_a = _mm512_loadu_si512((__m512i *)(a.lo() + i));
+  __m512i hi_a = _mm512_loadu_si512((__m512i *)(a.hi() + i));
+  __m512i valid_a = _mm512_loadu_si512((__m512i *)(a.valid() + i));
+  __m512i lo_b = _mm512_loadu_si512((__m512i *)(b.lo() + i));
+  __m512i hi_b = _mm512_loadu_si512((__m512i *)(b.hi() + i));
+  __m512i valid_b = _mm512_loadu_si512((__m512i *)(b.valid() + i));
+  // both valid and differ
+  __m512i m = _mm512_and_si512(
+      _mm512_and_si512(valid_a, valid_b),
+      _mm512_ternarylogic_epi64(lo_a, lo_b,
+                                _mm512_xor_si512(hi_a, hi_b), 0xbe));
+  // or either is invalid, i.e. m | (~valid & hi)
+  m = _mm512_ternarylogic_epi64(m, valid_a, hi_a, 0xf2);
+  return _mm512_ternarylogic_epi64(m, valid_b, hi_b, 0xf2);
+}
+
+HAMMING_ALWAYS_INLINE static int
+distance_bitplane_impl(BitPlaneRow a, BitPlaneRow b, int max_dist) {
+  // distance implementation for bit-plane encoded data using AVX512 simd
+  // intrinsics: a 512-bit register holds 8 BitPlaneWords, i.e. 512 genes.
+  // the mismatch bits are counted using a Harley-Seal carry-save adder tree,
+  // so that only one in 16 registers needs a full popcount
+  constexpr std::size_t n_words{8};
+  constexpr std::size_t n_block{16};
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i total = zero;
+  __m512i ones = zero;
+  __m512i twos = zero;
+  __m512i fours = zero;
+  __m512i eights = zero;
+  __m512i sixteens;
+  __m512i twos_a;
+  __m512i twos_b;
+  __m512i fours_a;
+  __m512i fours_b;
+  __m512i eights_a;
+  __m512i eights_b;
+  std::size_t n_iter{a.size() / n_words};
+  std::size_t i{0};
+  auto m = [&a, &b, &i](std::size_t k) {
+    return mismatch_bitplane(a, b, n_words * (i + k));
+  };
+  for (; i + n_block <= n_iter; i += n_block) {
+    csa(twos_a, ones, ones, m(0), m(1));
+    csa(twos_b, ones, ones, m(2), m(3));
+    csa(fours_a, twos, twos, twos_a, twos_b);
+    csa(twos_a, ones, ones, m(4), m(5));
+    csa(twos_b, ones, ones, m(6), m(7));
+    csa(fours_b, twos, twos, twos_a, twos_b);
+    csa(eights_a, fours, fours, fours_a, fours_b);
+    csa(twos_a, ones, ones, m(8), m(9));
+    csa(twos_b, ones, ones, m(10), m(11));
+    csa(fours_a, twos, twos, twos_a, twos_b);
+    csa(twos_a, ones, ones, m(12), m(13));
+    csa(twos_b, ones, ones, m(14), m(15));
+    csa(fours_b, twos, twos, twos_a, twos_b);
+    csa(eights_b, fours, fours, fours_a, fours_b);
+    csa(sixteens, eights, eights, eights_a, eights_b);
+    total = _mm512_add_epi64(total, popcount_epi64(sixteens));
+    // 16 * total is a lower bound on the distance
+    if (16 * sum_epi64(total) >= static_cast<std::uint64_t>(max_dist)) {
+      return max_dist;
+    }
+  }
+  // 16 * total + 8 * eights + 4 * fours + 2 * twos + ones
+  for (const auto &v : {eights, fours, twos, ones}) {
+    total = _mm512_add_epi64(_mm512_add_epi64(total, total), popcount_epi64(v));
+  }
+  // remaining registers that don't fill a Harley-Seal block
+  for (; i < n_iter; ++i) {
+    total = _mm512_add_epi64(total, popcount_epi64(m(0)));
+  }
+  auto r{static_cast<int>(
+      std::min(sum_epi64(total), static_cast<std::uint64_t>(max_dist)))};
+  // do last partial register without simd intrinsics
+  for (std::size_t k = n_words * n_iter; k < a.size(); ++k) {
+    auto va{a.valid()[k]};
+    auto vb{b.valid()[k]};
+    auto differ{(a.lo()[k] ^ b.lo()[k]) | (a.hi()[k] ^ b.hi()[k])};
+    r += std::popcount((va & vb & differ) | (a.hi()[k] & ~va) |
+                       (b.hi()[k] & ~vb));
+  }
+  return std::min(max_dist, r);
+}
+
+int distance_avx512(DenseRow a, DenseRow b, int max_dist) {
+  return distance_impl(a, b, max_dist);
+}
+
+std::array<int, n_partners>
+distance_avx512_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                    int max_dist) {
+  return distance_1x4_impl(a, b, max_dist);
+}
+
+int distance_avx512_bitplane(BitPlaneRow a, BitPlaneRow b, int max_dist) {
+  return distance_bitplane_impl(a, b, max_dist);
+}
+
+// the kernels are wrapped in lambdas, and always inlined, so that they are
+// compiled into the distances_tiled loop
+static constexpr auto distance_kernel = [](DenseRow a, DenseRow b,
+                                           int max_dist) {
+  return distance_impl(a, b, max_dist);
+};
+
+static constexpr auto distance_1x4_kernel =
+    [](DenseRow a, const std::array<DenseRow, n_partners> &b, int max_dist) {
+      return distance_1x4_impl(a, b, max_dist);
+    };
+
+static constexpr auto distance_bitplane_kernel = [](BitPlaneRow a,
+                                                    BitPlaneRow b,
+                                                    int max_dist) {
+  return distance_bitplane_impl(a, b, max_dist);
+};
+
+void distances_avx512(const DenseData &data, std::uint8_t *result, int max_dist,
+                      const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx512(const DenseData &data, std::uint16_t *result,
+                      int max_dist, const LowerBoundPruning *pruning,
+                      RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx512(const DenseData &data, std::uint32_t *result,
+                      int max_dist, const LowerBoundPruning *pruning,
+                      RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_avx512(const BitPlaneData &data, std::uint8_t *result,
+                      int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
+void distances_avx512(const BitPlaneData &data, std::uint16_t *result,
+                      int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
+void distances_avx512(const BitPlaneData &data, std::uint32_t *result,
+                      int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
 } // namespace hamming
@@ -1,6 +1,7 @@
 #include "cuda_mem.hh"
 #include "hamming/distance_cuda.hh"
 #include "hamming/hamming_utils.hh"
+#include <algorithm>
 #include <chrono>
 #include <cuda/std/limits>
 
@@ -90,8 +91,7 @@ Dist(DistIntType *partial_distances, const std::uint8_t *genes,
 
 template <typename DistIntType>
 std::vector<DistIntType>
-distances_cuda(const std::vector<std::vector<GeneBlock>> &data,
-               const std::string &filename = {},
+distances_cuda(const DenseData &data, const std::string &filename = {},
                DistIntType max_dist = std::numeric_limits<DistIntType>::max()) {
   std::vector<DistIntType> distances{};
   std::size_t timing_gpu_ms = 0;
@@ -103,7 +103,7 @@ distances_cuda(const std::vector<std::vector<GeneBlock>> &data,
   }
   std::size_t nSamples{data.size()};
   std::size_t nDistances{nSamples * (nSamples - 1) / 2};
-  std::size_t geneBlocksPerSample{data[0].size()};
+  std::size_t geneBlocksPerSample{data.stride()};
   // 2^31-1 is limit on number of CUDA blocks in x-dim, which corresponds to
   // 0.5/1GB of distances data for each chunk. For large datasets I/O becomes
   // the bottleneck and the larger the chunk the faster the I/O tends to be.
@@ -120,10 +120,9 @@ distances_cuda(const std::vector<std::vector<GeneBlock>> &data,
   // one gene is 30k chars -> 15k bytes in dense format
   // so 1 million samples -> 15GB
   auto *genes{CheckedCudaMalloc<GeneBlock>(nSamples * geneBlocksPerSample)};
-  // copy genes to device
-  for (std::size_t i = 0; i < data.size(); ++i) {
-    CheckedCopyToDevice(genes + i * geneBlocksPerSample, data[i]);
-  }
+  // copy genes to device: the host data is already contiguous with the same
+  // stride, so this can be done with a single copy
+  CheckedCopyToDevice(genes, data.data(), nSamples * geneBlocksPerSample);
 
   // allocate memory for partial distances matrix on device
   auto *partial_distances{CheckedCudaMalloc<DistIntType>(nPartialDistances)};
@@ -201,31 +200,30 @@ distances_cuda(const std::vector<std::vector<GeneBlock>> &data,
   return distances;
 }
 
-std::vector<uint8_t>
-distances_cuda_8bit(const std::vector<std::vector<GeneBlock>> &data,
-                    uint8_t max_dist) {
+std::vector<uint8_t> distances_cuda_8bit(const DenseData &data,
+                                         uint8_t max_dist) {
   return distances_cuda<uint8_t>(data, {}, max_dist);
 }
 
-std::vector<uint16_t>
-distances_cuda_16bit(const std::vector<std::vector<GeneBlock>> &data,
-                     uint16_t max_dist) {
+std::vector<uint16_t> distances_cuda_16bit(const DenseData &data,
+                                           uint16_t max_dist) {
   return distances_cuda<uint16_t>(data, {}, max_dist);
 }
 
-void distances_cuda_to_lower_triangular(
-    const std::vector<std::vector<GeneBlock>> &data,
-    const std::string &filename, int max_distance) {
+void distances_cuda_to_lower_triangular(const DenseData &data,
+                                        const std::string &filename,
+                                        int max_distance) {
   uint16_t max_dist = max_distance > std::numeric_limits<uint16_t>::max()
                           ? std::numeric_limits<uint16_t>::max()
                           : static_cast<uint16_t>(max_distance);
   distances_cuda<uint16_t>(data, filename, max_dist);
 }
 
-int distance_cuda(const std::vector<GeneBlock> &a,
-                  const std::vector<GeneBlock> &b, int max_dist) {
+int distance_cuda(DenseRow a, DenseRow b, int max_dist) {
   // wrapper for testing cuda kernel with existing distance API
-  std::vector<std::vector<GeneBlock>> data{a, b};
+  DenseData data(2, 2 * a.size());
+  std::copy(a.begin(), a.end(), data.row_data(0));
+  std::copy(b.begin(), b.end(), data.row_data(1));
   return distances_cuda<int>(data, {}, max_dist)[0];
 }
 
@@ -24,3 +24,24 @@ static void bench_distance_neon(benchmark::State &state) {
 }
 
 BENCHMARK(bench_distance_neon)->Range(4096, 4194304)->Complexity();
+
+static void bench_distance_neon_1x4(benchmark::State &state) {
+#ifdef HAMMING_WITH_OPENMP
+  omp_set_num_threads(1);
+#endif
+  std::mt19937 gen(12345);
+  int64_t n{state.range(0)};
+  auto s1{from_string(make_string(n, gen))};
+  std::array<std::vector<GeneBlock>, n_partners> s2;
+  for (auto &s : s2) {
+    s = from_string(make_string(n, gen));
+  }
+  int d{0};
+  for (auto _ : state) {
+    auto r{distance_neon_1x4(s1, {s2[0], s2[1], s2[2], s2[3]})};
+    d += r[0];
+  }
+  state.SetComplexityN(n);
+}
+
+BENCHMARK(bench_distance_neon_1x4)->Range(4096, 4194304)->Complexity();
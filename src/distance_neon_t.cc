@@ -70,3 +70,84 @@ TEST_CASE("distance_neon() returns same as distance_cpp() for random vectors",
     }
   }
 }
+
+TEST_CASE("distance_neon_1x4() returns same as distance_neon() for random "
+          "vectors",
+          "[impl][distance][neon]") {
+  std::mt19937 gen(12345);
+  for (int n :
+       {1,       2,      3,      4,      5,      6,      7,      8,
+        9,       10,     11,     12,     13,     14,     15,     16,
+        17,      18,     19,     20,     31,     32,     33,     63,
+        64,      65,     127,    128,    129,    254,    255,    256,
+        256,     511,    512,    513,    1023,   1024,   1025,   2047,
+        2048,    2049,   4095,   4096,   4097,   8191,   8192,   8193,
+        32767,   32768,  32769,  65535,  65536,  65537,  131071, 131072,
+        131073,  262143, 262144, 262145, 524287, 524288, 524289, 1048575,
+        1048576, 1048577}) {
+    for (int max_dist : {0, 1, 2, 11, 999, 9876544}) {
+      CAPTURE(n);
+      CAPTURE(max_dist);
+      auto g1{make_gene_vector(n, gen)};
+      std::array<std::vector<GeneBlock>, n_partners> g2;
+      for (auto &g : g2) {
+        g = make_gene_vector(n, gen);
+      }
+      // one partner identical to g1
+      g2[1] = g1;
+      auto d{distance_neon_1x4(g1, {g2[0], g2[1], g2[2], g2[3]}, max_dist)};
+      for (std::size_t k = 0; k < n_partners; ++k) {
+        CAPTURE(k);
+        REQUIRE(d[k] == distance_neon(g1, g2[k], max_dist));
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("distances_neon() returns same as distance_neon() for all "
+                   "pairs",
+                   "[impl][distance][neon]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 100, 1000}) {
+    for (std::size_t n_samples : {2, 3, 17, 70}) {
+      for (int max_dist : {0, 1, 11, 255}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(max_dist);
+        std::vector<std::string> data;
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          data.push_back(make_test_string(n, gen, true));
+        }
+        auto dense{to_dense_data(data)};
+        std::vector<TestType> result(n_samples * (n_samples - 1) / 2, 0);
+        distances_neon(dense, result.data(), max_dist);
+        std::size_t k{0};
+        for (std::size_t i = 1; i < n_samples; ++i) {
+          for (std::size_t j = 0; j < i; ++j) {
+            auto d{distance_neon(dense[i], dense[j], max_dist)};
+            REQUIRE(result[k] == d);
+            ++k;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("distance_neon() with include_x encoding returns same as "
+          "distance()",
+          "[impl][distance][neon]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 17, 64, 129, 1000, 4097}) {
+    for (int max_dist : {0, 1, 11, 9876544}) {
+      CAPTURE(n);
+      CAPTURE(max_dist);
+      auto s1{make_test_string(n, gen, true)};
+      auto s2{make_test_string(n, gen, true)};
+      s1[static_cast<std::size_t>(n / 2)] = 'N';
+      auto d{static_cast<int>(distance(s1, s2, true))};
+      REQUIRE(distance_neon(from_string(s1, true), from_string(s2, true),
+                            max_dist) == std::min(d, max_dist));
+    }
+  }
+}
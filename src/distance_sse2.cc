@@ -1,10 +1,11 @@
 #include "hamming/distance_sse2.hh"
+#include "hamming/hamming_tiles.hh"
 #include <immintrin.h>
 
 namespace hamming {
 
-int distance_sse2(const std::vector<GeneBlock> &a,
-                  const std::vector<GeneBlock> &b, int max_dist) {
+HAMMING_ALWAYS_INLINE static int distance_impl(DenseRow a, DenseRow b,
+                                               int max_dist) {
   // distance implementation using SSE2 simd intrinsics
   // a 128-bit register holds 16 GeneBlocks, i.e. 32 genes
   constexpr std::size_t n_geneblocks{16};
@@ -76,4 +77,117 @@ int distance_sse2(const std::vector<GeneBlock> &a,
   return std::min(max_dist, r);
 }
 
+HAMMING_ALWAYS_INLINE static std::array<int, n_partners>
+distance_1x4_impl(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist) {
+  // register-blocked version of distance_sse2: each chunk of a is loaded once
+  // and compared with the corresponding chunk of n_partners rows, each of
+  // which has its own vector of distance counts
+  constexpr std::size_t n_geneblocks{16};
+  std::array<int, n_partners> r{};
+  // mask to select lower gene from each GeneBlock
+  const __m128i mask0 = _mm_set1_epi8(mask_gene0);
+  // mask to select upper gene from each GeneBlock
+  const __m128i mask1 = _mm_set1_epi8(mask_gene1);
+  const __m128i zero = _mm_setzero_si128();
+  // vectors of distance counts, one for each partner
+  __m128i r_s[n_partners];
+  // work registers
+  __m128i r_a;
+  __m128i r_b;
+  __m128i r_c;
+  std::size_t n_iter{a.size() / n_geneblocks};
+  // see distance_sse2 for the choice of the number of inner iterations
+  std::size_t n_inner = max_dist >= 255 ? 127 : 16;
+  std::size_t n_outer{1 + n_iter / n_inner};
+  for (std::size_t j = 0; j < n_outer; ++j) {
+    std::size_t n{std::min((j + 1) * n_inner, n_iter)};
+    for (auto &r_sk : r_s) {
+      r_sk = zero;
+    }
+    for (std::size_t i = j * n_inner; i < n; ++i) {
+      r_a = _mm_load_si128((__m128i *)(a.data() + n_geneblocks * i));
+      for (std::size_t k = 0; k < n_partners; ++k) {
+        r_b = _mm_load_si128((__m128i *)(b[k].data() + n_geneblocks * i));
+        // a[i] & b[i]
+        r_b = _mm_and_si128(r_a, r_b);
+        // compare lower and upper genes with zero: 0xff if zero, 0 otherwise
+        r_c = _mm_cmpeq_epi8(_mm_and_si128(r_b, mask0), zero);
+        r_b = _mm_cmpeq_epi8(_mm_and_si128(r_b, mask1), zero);
+        // subtracting 0xff (i.e. -1) adds one to the distance count
+        r_s[k] = _mm_sub_epi8(r_s[k], r_c);
+        r_s[k] = _mm_sub_epi8(r_s[k], r_b);
+      }
+    }
+    // sum the 16 distances in each r_s & add to r
+    bool all_at_max_dist{true};
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      constexpr std::size_t n_partialsums{n_geneblocks / 8};
+      r_c = _mm_sad_epu8(r_s[k], zero);
+      alignas(16) std::uint64_t r_partial[n_partialsums];
+      _mm_store_si128((__m128i *)r_partial, r_c);
+      for (std::size_t i = 0; i < n_partialsums; ++i) {
+        r[k] += static_cast<int>(r_partial[i]);
+      }
+      all_at_max_dist = all_at_max_dist && (r[k] >= max_dist);
+    }
+    if (all_at_max_dist) {
+      r.fill(max_dist);
+      return r;
+    }
+  }
+  // do last partial block without simd intrinsics
+  for (std::size_t i = n_geneblocks * n_iter; i < a.size(); ++i) {
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      auto c{static_cast<GeneBlock>(a[i] & b[k][i])};
+      r[k] += static_cast<int>((c & mask_gene0) == 0);
+      r[k] += static_cast<int>((c & mask_gene1) == 0);
+    }
+  }
+  for (auto &rk : r) {
+    rk = std::min(max_dist, rk);
+  }
+  return r;
+}
+
+int distance_sse2(DenseRow a, DenseRow b, int max_dist) {
+  return distance_impl(a, b, max_dist);
+}
+
+std::array<int, n_partners>
+distance_sse2_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                  int max_dist) {
+  return distance_1x4_impl(a, b, max_dist);
+}
+
+// the kernels are wrapped in lambdas, and always inlined, so that they are
+// compiled into the distances_tiled loop
+static constexpr auto distance_kernel = [](DenseRow a, DenseRow b,
+                                           int max_dist) {
+  return distance_impl(a, b, max_dist);
+};
+
+static constexpr auto distance_1x4_kernel =
+    [](DenseRow a, const std::array<DenseRow, n_partners> &b, int max_dist) {
+      return distance_1x4_impl(a, b, max_dist);
+    };
+
+void distances_sse2(const DenseData &data, std::uint8_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_sse2(const DenseData &data, std::uint16_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+void distances_sse2(const DenseData &data, std::uint32_t *result, int max_dist,
+                    const LowerBoundPruning *pruning, RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
 } // namespace hamming
@@ -1,4 +1,5 @@
 #include "hamming/hamming.hh"
+#include "hamming/hamming_fasta.hh"
 #include "hamming/hamming_impl.hh"
 
 #include <algorithm>
@@ -7,17 +8,20 @@
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <numeric>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace hamming {
 
 DataSet<DefaultDistIntType> from_stringlist(std::vector<std::string> &data,
                                             bool include_x, bool use_gpu,
-                                            int max_distance) {
+                                            int max_distance,
+                                            DenseEncoding encoding) {
   return DataSet<DefaultDistIntType>(data, include_x, false, {}, use_gpu,
-                                     max_distance);
+                                     max_distance, encoding);
 }
 
 DataSet<DefaultDistIntType> from_csv(const std::string &filename) {
@@ -27,14 +31,25 @@ DataSet<DefaultDistIntType> from_csv(const std::string &filename) {
 void from_fasta_to_lower_triangular(const std::string &input_filename,
                                     const std::string &output_filename,
                                     bool remove_duplicates, std::size_t n,
-                                    bool use_gpu, int max_distance) {
+                                    bool use_gpu, int max_distance,
+                                    std::size_t buffer_bytes) {
+#ifndef HAMMING_WITH_CUDA
+  if (use_gpu) {
+    throw std::runtime_error("hammingdist was not compiled with GPU support, "
+                             "please set use_gpu=False");
+  }
+#endif
   if (use_gpu) {
     std::cout << "# hammingdist :: Using GPU..." << std::endl;
   }
   auto start_time = std::chrono::high_resolution_clock::now();
-  auto [data, sequence_indices] =
-      read_fasta(input_filename, remove_duplicates, n);
-  auto dense_data = to_dense_data(data);
+  FastaFile fasta(input_filename, n);
+  std::vector<std::size_t> records;
+  if (remove_duplicates) {
+    fasta.unique_sequence_indices(&records);
+  }
+  Sequences data(fasta, std::move(records));
+  validate_data(data);
   std::cout << "# hammingdist :: ...pre-processing completed in "
             << std::chrono::duration_cast<std::chrono::milliseconds>(
                    std::chrono::high_resolution_clock::now() - start_time)
@@ -42,13 +57,15 @@ void from_fasta_to_lower_triangular(const std::string &input_filename,
             << " ms..." << std::endl;
 #ifdef HAMMING_WITH_CUDA
   if (use_gpu) {
+    auto dense_data = to_dense_data(data);
     distances_cuda_to_lower_triangular(dense_data, output_filename,
                                        max_distance);
     return;
   }
 #endif
-  throw std::runtime_error(
-      "from_fasta_to_lower_triangular is currently only available on GPU");
+  // the distances are calculated in blocks of rows of at most buffer_bytes
+  distances_cpu_to_lower_triangular(data, output_filename, max_distance,
+                                    buffer_bytes);
 }
 
 ReferenceDistIntType distance(const std::string &seq0, const std::string &seq1,
@@ -75,69 +92,592 @@ ReferenceDistIntType distance(const std::string &seq0, const std::string &seq1,
 
 std::vector<std::size_t> fasta_sequence_indices(const std::string &fasta_file,
                                                 std::size_t n) {
-  std::vector<std::size_t> sequence_indices{};
-  std::unordered_map<std::string, std::size_t> map_seq_to_index;
-  std::ifstream stream(fasta_file);
-  if (n == 0) {
-    n = std::numeric_limits<std::size_t>::max();
-  }
-  std::size_t count = 0;
-  std::size_t count_unique = 0;
-  std::string line;
-  // skip first header
-  std::getline(stream, line);
-  while (count < n && !stream.eof()) {
-    std::string seq{};
-    while (std::getline(stream, line) && line[0] != '>') {
-      seq.append(line);
-    }
-    auto result = map_seq_to_index.emplace(std::move(seq), count_unique);
-    if (result.second) {
-      ++count_unique;
-    }
-    sequence_indices.push_back(result.first->second);
-    ++count;
-  }
-  return sequence_indices;
+  return FastaFile(fasta_file, n).unique_sequence_indices();
 }
 
 std::vector<ReferenceDistIntType>
 fasta_reference_distances(const std::string &reference_sequence,
                           const std::string &fasta_file, bool include_x) {
-  std::vector<ReferenceDistIntType> distances;
-  distances.reserve(65536);
-  auto lookup{lookupTable(include_x)};
-  std::vector<GeneBlock> ref;
-  ref.reserve(reference_sequence.size());
-  for (char c : reference_sequence) {
-    ref.push_back(lookup[c]);
-  }
-  std::ifstream stream(fasta_file);
-  if (!stream) {
-    throw std::runtime_error("Error: Failed to open file '" + fasta_file + "'");
-  }
-  std::string line;
-  // skip first header
-  std::getline(stream, line);
-  while (!stream.eof()) {
-    std::string seq{};
-    while (std::getline(stream, line) && line[0] != '>') {
-      seq.append(line);
-    }
-    ReferenceDistIntType distance{0};
-    for (std::size_t i = 0; i < seq.size(); ++i) {
-      auto a{lookup[seq[i]]};
-      bool invalid{(a & ref[i]) == 0x00};
-      bool differ{(seq[i] != reference_sequence[i])};
-      if (invalid || differ) {
-        bool nodash{(a != 0xff) && (ref[i] != 0xff)};
-        distance +=
-            static_cast<ReferenceDistIntType>(invalid || (differ && nodash));
-      }
-    }
-    distances.push_back(distance);
+  return fasta_reference_distances(
+      std::vector<std::string>{reference_sequence}, fasta_file, include_x);
+}
+
+std::vector<ReferenceDistIntType>
+fasta_reference_distances(const std::vector<std::string> &reference_sequences,
+                          const std::string &fasta_file, bool include_x) {
+  validate_data(reference_sequences);
+  std::size_t sample_length{reference_sequences[0].size()};
+  auto references{to_dense_data(reference_sequences, include_x)};
+  std::size_t n_references{references.size()};
+  auto distance_1x4_func{get_fastest_supported_distance_1x4_func()};
+  FastaFile fasta(fasta_file);
+  Sequences samples(fasta);
+  std::size_t nsamples{fasta.size()};
+  // one row of distances for each reference, where each chunk of samples
+  // writes its own columns
+  std::vector<ReferenceDistIntType> distances(n_references * nsamples);
+  // samples are encoded in chunks to limit the memory used
+  constexpr std::size_t chunk_size{4096};
+  std::vector<std::size_t> chunk;
+  auto &progress{Progress::current()};
+  progress.start(nsamples);
+  for (std::size_t begin = 0; begin < nsamples; begin += chunk_size) {
+    progress.throw_if_cancelled();
+    chunk.resize(std::min(chunk_size, nsamples - begin));
+    std::iota(chunk.begin(), chunk.end(), begin);
+    for (auto i : chunk) {
+      if (samples.length(i) != sample_length) {
+        throw std::runtime_error(
+            "Error: Sequences do not all have the same length");
+      }
+    }
+    auto dense{to_dense_data(samples, chunk, include_x)};
+    std::size_t n{dense.size()};
+    auto *d{distances.data() + begin};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(                                 \
+        dense, n, nsamples, references, n_references, distance_1x4_func, d)
+#endif
+    for (std::size_t i = 0; i < n; ++i) {
+      // each sample is compared to n_partners references at a time, repeating
+      // the last reference if there are fewer than n_partners remaining
+      for (std::size_t r = 0; r < n_references; r += n_partners) {
+        auto ref = [&references, n_references, r](std::size_t k) {
+          return references[std::min(r + k, n_references - 1)];
+        };
+        auto dist{distance_1x4_func(dense[i], {ref(0), ref(1), ref(2), ref(3)},
+                                    std::numeric_limits<int>::max())};
+        for (std::size_t k = 0; k < n_partners && r + k < n_references; ++k) {
+          d[(r + k) * nsamples + i] =
+              static_cast<ReferenceDistIntType>(dist[k]);
+        }
+      }
+    }
+    progress.add(n);
   }
+  progress.throw_if_cancelled();
   return distances;
 }
 
+// Candidate pairs from pigeonhole segments: each sample is split into
+// n_segments segments. Two samples with distance <= k have at least
+// n_segments - k segments without a mismatch. A segment without a mismatch
+// that contains no '-' in either sample (and hence no invalid chars) is
+// identical in both samples, so if each sample has at most max_gapped
+// segments that contain a '-', and
+//   n_segments - k > 2 * max_gapped
+// then the pair has at least one identical segment, and is found by hashing
+// the segments. The remaining irregular samples are compared to all others.
+struct SegmentIndex {
+  std::size_t n_segments{0};
+  // hash of each segment of each sample, if it has no '-' or invalid chars
+  std::vector<std::size_t> hashes{};
+  std::vector<std::uint8_t> hashed{};
+  std::vector<std::uint8_t> regular{};
+  // for each segment, the sorted (hash, index) of each regular sample with a
+  // hash, and the position of each sample in this list
+  std::vector<std::vector<std::pair<std::size_t, std::size_t>>> buckets{};
+  std::vector<std::size_t> bucket_pos{};
+  std::vector<std::size_t> irregular{};
+};
+
+// number of segments, which allows for up to 2 gapped segments per sample
+static std::size_t segment_count(std::size_t length, std::size_t k) {
+  constexpr std::size_t max_gapped_target{2};
+  return std::min(k + 1 + 2 * max_gapped_target, length);
+}
+
+// hash each segment of seq that has no '-' or invalid chars, and return
+// whether seq is regular
+static bool hash_segments(std::string_view seq, std::size_t n_segments,
+                          std::size_t k,
+                          const std::array<GeneBlock, 256> &lookup,
+                          std::size_t *hashes, std::uint8_t *hashed) {
+  std::size_t length{seq.size()};
+  std::size_t n_gapped{0};
+  for (std::size_t s = 0; s < n_segments; ++s) {
+    std::size_t begin{s * length / n_segments};
+    std::size_t end{(s + 1) * length / n_segments};
+    bool gap{false};
+    bool invalid{false};
+    for (std::size_t p = begin; p < end; ++p) {
+      auto c{lookup[static_cast<unsigned char>(seq[p])]};
+      gap |= (c == 0xff);
+      invalid |= (c == 0);
+    }
+    n_gapped += static_cast<std::size_t>(gap);
+    hashed[s] = static_cast<std::uint8_t>(!gap && !invalid);
+    hashes[s] = hashed[s] != 0 ? std::hash<std::string_view>{}(
+                                     seq.substr(begin, end - begin))
+                               : 0;
+  }
+  return n_segments > k && n_gapped <= (n_segments - k - 1) / 2;
+}
+
+static SegmentIndex make_segment_index(const Sequences &data, std::size_t k) {
+  std::size_t nsamples{data.size()};
+  SegmentIndex index;
+  std::size_t n_segments{segment_count(data.length(0), k)};
+  index.n_segments = n_segments;
+  auto lookup{lookupTable()};
+  index.hashes.resize(nsamples * n_segments, 0);
+  index.hashed.resize(nsamples * n_segments, 0);
+  index.regular.resize(nsamples, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(data, nsamples, k, n_segments, lookup, index)
+#endif
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    std::string buffer;
+    index.regular[i] = static_cast<std::uint8_t>(hash_segments(
+        data.get(i, buffer), n_segments, k, lookup,
+        index.hashes.data() + i * n_segments,
+        index.hashed.data() + i * n_segments));
+  }
+  index.buckets.resize(n_segments);
+  index.bucket_pos.resize(nsamples * n_segments, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(nsamples, n_segments, index)
+#endif
+  for (std::size_t s = 0; s < n_segments; ++s) {
+    auto &bucket{index.buckets[s]};
+    for (std::size_t i = 0; i < nsamples; ++i) {
+      if (index.regular[i] != 0 && index.hashed[i * n_segments + s] != 0) {
+        bucket.emplace_back(index.hashes[i * n_segments + s], i);
+      }
+    }
+    std::sort(bucket.begin(), bucket.end());
+    for (std::size_t q = 0; q < bucket.size(); ++q) {
+      index.bucket_pos[bucket[q].second * n_segments + s] = q;
+    }
+  }
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    if (index.regular[i] == 0) {
+      index.irregular.push_back(i);
+    }
+  }
+  return index;
+}
+
+// call f(j) for each candidate j < i of sample i, possibly more than once
+template <typename Func>
+static void for_each_candidate(const SegmentIndex &index, std::size_t i,
+                               Func &&f) {
+  std::size_t n_segments{index.n_segments};
+  if (index.regular[i] == 0) {
+    for (std::size_t j = 0; j < i; ++j) {
+      f(j);
+    }
+    return;
+  }
+  for (std::size_t s = 0; s < n_segments; ++s) {
+    if (index.hashed[i * n_segments + s] == 0) {
+      continue;
+    }
+    const auto &bucket{index.buckets[s]};
+    auto hash{index.hashes[i * n_segments + s]};
+    // samples with the same hash and a lower index precede sample i
+    for (std::size_t q = index.bucket_pos[i * n_segments + s];
+         q > 0 && bucket[q - 1].first == hash; --q) {
+      f(bucket[q - 1].second);
+    }
+  }
+  for (auto j : index.irregular) {
+    if (j >= i) {
+      break;
+    }
+    f(j);
+  }
+}
+
+// Candidate pairs from rare mutations: at each position where sample a
+// differs from the reference and is not '-', and sample b is equal to the
+// reference, a and b differ. So if distance(a, b) <= k, and a has more than k
+// such positions, then b also differs from the reference at one of any k + 1
+// of them, which are chosen to be the k + 1 positions where the fewest
+// samples differ from the reference: the prefix of a. Pairs of samples that
+// both have at most k such positions are all candidates.
+struct PrefixIndex {
+  std::vector<SparseData> sparse{};
+  // samples that differ from the reference at each position
+  std::vector<std::size_t> offsets{};
+  std::vector<std::uint32_t> samples{};
+  // samples that have each position in their prefix
+  std::vector<std::size_t> prefix_offsets{};
+  std::vector<std::uint32_t> prefix_samples{};
+  // prefix positions of each sample
+  std::vector<std::size_t> sample_prefix_offsets{};
+  std::vector<std::uint32_t> sample_prefix_positions{};
+  // samples with at most k positions that differ and are not '-'
+  std::vector<std::size_t> small{};
+};
+
+static PrefixIndex make_prefix_index(const Sequences &data,
+                                     const std::string &reference,
+                                     std::size_t k) {
+  PrefixIndex index;
+  std::size_t nsamples{data.size()};
+  std::size_t length{data.length(0)};
+  index.sparse = to_sparse_data(data, reference, false);
+  const auto &sparse{index.sparse};
+  if (nsamples > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::runtime_error("Error: Too many samples for sparse format");
+  }
+  // posting lists in ascending sample order
+  auto make_postings = [length](const auto &positions_of, std::size_t n,
+                                std::vector<std::size_t> &offsets,
+                                std::vector<std::uint32_t> &samples) {
+    offsets.assign(length + 1, 0);
+    for (std::size_t i = 0; i < n; ++i) {
+      for (auto p : positions_of(i)) {
+        ++offsets[p + 1];
+      }
+    }
+    std::partial_sum(offsets.cbegin(), offsets.cend(), offsets.begin());
+    samples.resize(offsets.back());
+    std::vector<std::size_t> next(offsets.cbegin(), offsets.cend() - 1);
+    for (std::size_t i = 0; i < n; ++i) {
+      for (auto p : positions_of(i)) {
+        samples[next[p]++] = static_cast<std::uint32_t>(i);
+      }
+    }
+  };
+  make_postings(
+      [&sparse](std::size_t i) -> const std::vector<std::uint32_t> & {
+        return sparse[i].positions;
+      },
+      nsamples, index.offsets, index.samples);
+  // prefix of each sample
+  std::vector<std::vector<std::uint32_t>> prefixes(nsamples);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(nsamples, k, sparse, index, prefixes)
+#endif
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    if (static_cast<std::size_t>(sparse[i].n_nondash) <= k) {
+      continue;
+    }
+    auto &prefix{prefixes[i]};
+    for (std::size_t e = 0; e < sparse[i].size(); ++e) {
+      if (sparse[i].codes[e] != 0xff) {
+        prefix.push_back(sparse[i].positions[e]);
+      }
+    }
+    auto n_differ = [&index](std::uint32_t p) {
+      return index.offsets[p + 1] - index.offsets[p];
+    };
+    std::nth_element(prefix.begin(), prefix.begin() + static_cast<long>(k),
+                     prefix.end(),
+                     [&n_differ](std::uint32_t a, std::uint32_t b) {
+                       return n_differ(a) < n_differ(b);
+                     });
+    prefix.resize(k + 1);
+  }
+  make_postings(
+      [&prefixes](std::size_t i) -> const std::vector<std::uint32_t> & {
+        return prefixes[i];
+      },
+      nsamples, index.prefix_offsets, index.prefix_samples);
+  index.sample_prefix_offsets.resize(nsamples + 1, 0);
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    index.sample_prefix_offsets[i + 1] =
+        index.sample_prefix_offsets[i] + prefixes[i].size();
+    index.sample_prefix_positions.insert(index.sample_prefix_positions.end(),
+                                         prefixes[i].cbegin(),
+                                         prefixes[i].cend());
+    if (prefixes[i].empty()) {
+      index.small.push_back(i);
+    }
+  }
+  return index;
+}
+
+template <typename Func>
+static void for_each_candidate(const PrefixIndex &index, std::size_t i,
+                               Func &&f) {
+  // samples j < i that differ from the reference at a prefix position of i
+  for (std::size_t e = index.sample_prefix_offsets[i];
+       e < index.sample_prefix_offsets[i + 1]; ++e) {
+    auto p{index.sample_prefix_positions[e]};
+    for (std::size_t q = index.offsets[p];
+         q < index.offsets[p + 1] && index.samples[q] < i; ++q) {
+      f(index.samples[q]);
+    }
+  }
+  // samples j < i with a prefix position where i differs from the reference
+  for (auto p : index.sparse[i].positions) {
+    for (std::size_t q = index.prefix_offsets[p];
+         q < index.prefix_offsets[p + 1] && index.prefix_samples[q] < i; ++q) {
+      f(index.prefix_samples[q]);
+    }
+  }
+  if (index.sample_prefix_offsets[i] == index.sample_prefix_offsets[i + 1]) {
+    for (auto j : index.small) {
+      if (j >= i) {
+        break;
+      }
+      f(j);
+    }
+  }
+}
+
+// number of candidate pairs of each index
+struct CandidateCounts {
+  std::size_t segments{0};
+  std::size_t prefix{0};
+};
+
+// count the candidate pairs of both indices, without building either: the
+// prefix of each sample only needs the number of samples that differ from
+// the reference at each position, and the segments only the hashes
+static CandidateCounts count_candidates(const Sequences &data,
+                                        const std::string &reference,
+                                        std::size_t k) {
+  std::size_t nsamples{data.size()};
+  std::size_t length{data.length(0)};
+  std::size_t n_segments{segment_count(length, k)};
+  auto lookup{lookupTable()};
+  std::vector<std::size_t> n_differ(length, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none) shared(data, reference, nsamples, length,   \
+                                              n_differ)
+#endif
+  {
+    std::vector<std::size_t> thread_n_differ(length, 0);
+    std::string buffer;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for
+#endif
+    for (std::size_t i = 0; i < nsamples; ++i) {
+      auto seq{data.get(i, buffer)};
+      for (std::size_t p = 0; p < length; ++p) {
+        thread_n_differ[p] += static_cast<std::size_t>(seq[p] != reference[p]);
+      }
+    }
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp critical
+#endif
+    for (std::size_t p = 0; p < length; ++p) {
+      n_differ[p] += thread_n_differ[p];
+    }
+  }
+  std::size_t n_prefix{0};
+  std::size_t n_small{0};
+  std::size_t n_irregular{0};
+  std::vector<std::size_t> hashes(nsamples * n_segments, 0);
+  std::vector<std::uint8_t> hashed(nsamples * n_segments, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(data, reference, k, nsamples, length, n_segments, lookup,          \
+               n_differ, n_prefix, n_small, n_irregular, hashes, hashed)
+#endif
+  {
+    std::string buffer;
+    std::vector<std::size_t> costs;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for reduction(+ : n_prefix, n_small, n_irregular)
+#endif
+    for (std::size_t i = 0; i < nsamples; ++i) {
+      auto seq{data.get(i, buffer)};
+      if (!hash_segments(seq, n_segments, k, lookup,
+                         hashes.data() + i * n_segments,
+                         hashed.data() + i * n_segments)) {
+        std::fill_n(hashed.begin() + static_cast<long>(i * n_segments),
+                    n_segments, 0);
+        ++n_irregular;
+      }
+      // the number of samples that differ at each position where this sample
+      // differs from the reference and is not '-'
+      costs.clear();
+      for (std::size_t p = 0; p < length; ++p) {
+        if (seq[p] != reference[p] &&
+            lookup[static_cast<unsigned char>(seq[p])] != 0xff) {
+          costs.push_back(n_differ[p]);
+        }
+      }
+      if (costs.size() <= k) {
+        ++n_small;
+        continue;
+      }
+      std::nth_element(costs.begin(), costs.begin() + static_cast<long>(k),
+                       costs.end());
+      // each pair of a prefix position of one sample and a position where the
+      // other differs from the reference is visited twice, once from each row
+      n_prefix += 2 * std::accumulate(costs.cbegin(),
+                                      costs.cbegin() + static_cast<long>(k) + 1,
+                                      std::size_t{0});
+    }
+  }
+  // pairs of regular samples with an equal hash of the same segment
+  std::size_t n_bucket_pairs{0};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(nsamples, n_segments, hashes, hashed) reduction(+ : n_bucket_pairs)
+#endif
+  for (std::size_t s = 0; s < n_segments; ++s) {
+    std::vector<std::size_t> bucket;
+    for (std::size_t i = 0; i < nsamples; ++i) {
+      if (hashed[i * n_segments + s] != 0) {
+        bucket.push_back(hashes[i * n_segments + s]);
+      }
+    }
+    std::sort(bucket.begin(), bucket.end());
+    for (std::size_t q = 0; q < bucket.size();) {
+      std::size_t r{q + 1};
+      while (r < bucket.size() && bucket[r] == bucket[q]) {
+        ++r;
+      }
+      n_bucket_pairs += (r - q) * (r - q - 1) / 2;
+      q = r;
+    }
+  }
+  return {n_bucket_pairs + n_irregular * nsamples,
+          n_prefix + n_small * n_small / 2};
+}
+
+// verify the candidates of each sample, and write the pairs with distance <=
+// threshold to stream, in blocks of rows that are written in order
+template <typename Index, typename DistanceFunc>
+static void write_threshold_pairs(const Index &index, std::size_t nsamples,
+                                  int threshold, DistanceFunc distance_func,
+                                  std::ostream &stream) {
+  constexpr std::size_t samples_per_block{200};
+  // rows 1, ..., nsamples - 1 have pairs
+  std::size_t n_rows{nsamples > 0 ? nsamples - 1 : 0};
+  std::size_t n_blocks{(n_rows + samples_per_block - 1) / samples_per_block};
+  bool write_failed{false};
+  auto *progress{&Progress::current()};
+  progress->start(n_rows);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(index, nsamples, threshold, distance_func, stream,                  \
+               samples_per_block, n_blocks, write_failed, progress)
+#endif
+  {
+    // the last row for which each sample was verified
+    std::vector<std::size_t> verified(nsamples, nsamples);
+    std::vector<std::pair<std::size_t, int>> row;
+    fmt::memory_buffer buffer;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(dynamic, 1) ordered
+#endif
+    for (std::size_t b = 0; b < n_blocks; ++b) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      std::size_t i_start{1 + b * samples_per_block};
+      std::size_t i_end{std::min(i_start + samples_per_block, nsamples)};
+      buffer.clear();
+      for (std::size_t i = i_start; i < i_end; ++i) {
+        row.clear();
+        for_each_candidate(index, i, [&](std::size_t j) {
+          if (verified[j] == i) {
+            return;
+          }
+          verified[j] = i;
+          int d{distance_func(i, j, threshold + 1)};
+          if (d <= threshold) {
+            row.emplace_back(j, d);
+          }
+        });
+        std::sort(row.begin(), row.end());
+        fmt::format_int i_str(i);
+        for (const auto &[j, d] : row) {
+          buffer.append(i_str.data(), i_str.data() + i_str.size());
+          buffer.push_back(' ');
+          fmt::format_int j_str(j);
+          buffer.append(j_str.data(), j_str.data() + j_str.size());
+          buffer.push_back(' ');
+          fmt::format_int d_str(d);
+          buffer.append(d_str.data(), d_str.data() + d_str.size());
+          buffer.push_back('\n');
+        }
+      }
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp ordered
+#endif
+      {
+        stream.write(buffer.data(),
+                     static_cast<std::streamsize>(buffer.size()));
+        if (!stream) {
+          write_failed = true;
+        }
+      }
+      progress->add(i_end - i_start);
+    }
+  }
+  progress->throw_if_cancelled();
+  if (write_failed) {
+    throw std::runtime_error("Error: Failed to write the pairs to the stream");
+  }
+}
+
+void threshold_pairs(const Sequences &data, int threshold,
+                     std::ostream &stream) {
+  if (threshold < 0) {
+    throw std::runtime_error("Error: threshold must not be negative");
+  }
+  std::size_t nsamples{data.size()};
+  auto k{static_cast<std::size_t>(threshold)};
+  // pigeonhole segments are selective for diverse samples, rare mutations for
+  // samples that are all close to a common reference: only the index that
+  // gives fewer candidate pairs is built
+  auto reference{get_reference_expression(data, false)};
+  auto counts{count_candidates(data, reference, k)};
+  if (counts.segments < counts.prefix) {
+    auto segment_index{make_segment_index(data, k)};
+    std::cout << "# hammingdist :: Finding candidate pairs using "
+              << segment_index.n_segments << " segments..." << std::endl;
+    auto dense{to_dense_data(data)};
+    auto distance_func{get_fastest_supported_distance_func()};
+    write_threshold_pairs(
+        segment_index, nsamples, threshold,
+        [&dense, distance_func](std::size_t i, std::size_t j, int max_dist) {
+          return distance_func(dense[i], dense[j], max_dist);
+        },
+        stream);
+    return;
+  }
+  auto prefix_index{make_prefix_index(data, reference, k)};
+  std::cout << "# hammingdist :: Finding candidate pairs using rare "
+               "mutations..."
+            << std::endl;
+  const auto &sparse{prefix_index.sparse};
+  auto distance_func{get_fastest_supported_distance_sparse_func()};
+  write_threshold_pairs(
+      prefix_index, nsamples, threshold,
+      [&sparse, distance_func](std::size_t i, std::size_t j, int max_dist) {
+        return distance_func(sparse[i], sparse[j], max_dist);
+      },
+      stream);
+}
+
+void threshold_pairs(const std::vector<std::string> &data, int threshold,
+                     std::ostream &stream) {
+  threshold_pairs(Sequences(data), threshold, stream);
+}
+
+std::vector<std::size_t>
+fasta_threshold_pairs(const std::string &fasta_file,
+                      const std::string &output_filename, int threshold,
+                      bool remove_duplicates, std::size_t n) {
+  // the sequences are encoded directly from the file, without first copying
+  // them all into strings
+  FastaFile fasta(fasta_file, n);
+  std::vector<std::size_t> sequence_indices;
+  std::vector<std::size_t> records;
+  if (remove_duplicates) {
+    sequence_indices = fasta.unique_sequence_indices(&records);
+  } else {
+    sequence_indices.resize(fasta.size());
+    std::iota(sequence_indices.begin(), sequence_indices.end(),
+              std::size_t{0});
+  }
+  Sequences data(fasta, std::move(records));
+  validate_data(data);
+  std::ofstream stream(output_filename);
+  threshold_pairs(data, threshold, stream);
+  return sequence_indices;
+}
+
 } // namespace hamming
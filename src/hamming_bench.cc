@@ -56,6 +56,19 @@ static void bench_from_fasta_to_lower_triangular_gpu(benchmark::State &state) {
   state.SetComplexityN(n);
 }
 
+static void bench_from_fasta_to_lower_triangular(benchmark::State &state) {
+  std::mt19937 gen(12345);
+  int64_t n{state.range(0)};
+  std::string fasta_file{benchmark_tmp_input_file};
+  std::string lt_file{benchmark_tmp_output_file};
+  auto reference_seq{make_string(sampleLength, gen, true)};
+  write_fasta(fasta_file, reference_seq, state.range(0), gen);
+  for (auto _ : state) {
+    from_fasta_to_lower_triangular(fasta_file, lt_file, false, 0, false);
+  }
+  state.SetComplexityN(n);
+}
+
 static void bench_fasta_reference_distances(benchmark::State &state) {
   std::mt19937 gen(12345);
   std::string fasta_file{benchmark_tmp_input_file};
@@ -67,6 +80,19 @@ static void bench_fasta_reference_distances(benchmark::State &state) {
   }
 }
 
+static void
+bench_fasta_reference_distances_multiple(benchmark::State &state) {
+  std::mt19937 gen(12345);
+  std::string fasta_file{benchmark_tmp_input_file};
+  auto reference_seq{make_string(sampleLength, gen, true)};
+  write_fasta(fasta_file, reference_seq, 1024, gen);
+  std::vector<std::string> references(state.range(0), reference_seq);
+  std::vector<ReferenceDistIntType> distances;
+  for (auto _ : state) {
+    distances = fasta_reference_distances(references, fasta_file, true);
+  }
+}
+
 static void bench_from_fasta_max_dist(benchmark::State &state) {
 #ifdef HAMMING_WITH_OPENMP
   omp_set_num_threads(1);
@@ -110,7 +136,14 @@ BENCHMARK(bench_from_fasta_to_lower_triangular_gpu)
     ->Range(16, 16384)
     ->Complexity();
 #endif
+BENCHMARK(bench_from_fasta_to_lower_triangular)
+    ->RangeMultiplier(2)
+    ->Range(16, 4096)
+    ->Complexity();
 BENCHMARK(bench_fasta_reference_distances)
     ->RangeMultiplier(2)
     ->Range(16, 1024)
     ->Complexity();
+BENCHMARK(bench_fasta_reference_distances_multiple)
+    ->RangeMultiplier(2)
+    ->Range(1, 64);
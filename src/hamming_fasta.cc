@@ -0,0 +1,494 @@
+#include "hamming/hamming_fasta.hh"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#ifdef HAMMING_WITH_OPENMP
+#include <omp.h>
+#endif
+#ifdef HAMMING_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace hamming {
+
+using Hash128 = std::array<std::uint64_t, 2>;
+
+static inline std::uint64_t rotl64(std::uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline std::uint64_t fmix64(std::uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// 128-bit MurmurHash3 (x64 variant) of a string, with the final partial
+// block zero-padded, which gives the same hash on little-endian machines
+static Hash128 hash128(std::string_view str) {
+  constexpr std::uint64_t c1{0x87c37b91114253d5ULL};
+  constexpr std::uint64_t c2{0x4cf5ad432745937fULL};
+  std::uint64_t h1{0};
+  std::uint64_t h2{0};
+  auto mix_k1 = [](std::uint64_t k1) { return rotl64(k1 * c1, 31) * c2; };
+  auto mix_k2 = [](std::uint64_t k2) { return rotl64(k2 * c2, 33) * c1; };
+  std::size_t n_blocks{str.size() / 16};
+  for (std::size_t i = 0; i < n_blocks; ++i) {
+    std::uint64_t k[2];
+    std::memcpy(k, str.data() + 16 * i, 16);
+    h1 ^= mix_k1(k[0]);
+    h1 = rotl64(h1, 27) + h2;
+    h1 = h1 * 5 + 0x52dce729;
+    h2 ^= mix_k2(k[1]);
+    h2 = rotl64(h2, 31) + h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+  std::uint64_t k[2]{0, 0};
+  std::memcpy(k, str.data() + 16 * n_blocks, str.size() % 16);
+  h1 ^= mix_k1(k[0]);
+  h2 ^= mix_k2(k[1]);
+  h1 ^= str.size();
+  h2 ^= str.size();
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  return {h1, h2};
+}
+
+struct Hash128Hasher {
+  std::size_t operator()(const Hash128 &h) const {
+    return static_cast<std::size_t>(h[0]);
+  }
+};
+
+static bool is_gzip(const char *data, std::size_t size) {
+  return size >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+         static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+#ifdef HAMMING_WITH_ZLIB
+
+static std::uint32_t read_le(const char *p, int n_bytes) {
+  std::uint32_t x{0};
+  for (int i = n_bytes - 1; i >= 0; --i) {
+    x = (x << 8) | static_cast<unsigned char>(p[i]);
+  }
+  return x;
+}
+
+static std::runtime_error decompress_error(const std::string &filename) {
+  return std::runtime_error("Error: Failed to decompress file '" + filename +
+                            "'");
+}
+
+// size of the BGZF block at the start of data, i.e. a gzip member whose header
+// contains a "BC" extra subfield with the size of the member, or zero if
+// there is no such block
+static std::size_t bgzf_block_size(const char *data, std::size_t size) {
+  constexpr std::size_t header_bytes{12};
+  constexpr unsigned char flag_extra{0x04};
+  if (size < header_bytes || !is_gzip(data, size) ||
+      (static_cast<unsigned char>(data[3]) & flag_extra) == 0) {
+    return 0;
+  }
+  std::size_t extra_end{header_bytes + read_le(data + 10, 2)};
+  if (extra_end > size) {
+    return 0;
+  }
+  for (std::size_t p = header_bytes; p + 4 <= extra_end;
+       p += 4 + read_le(data + p + 2, 2)) {
+    if (data[p] == 'B' && data[p + 1] == 'C' && read_le(data + p + 2, 2) == 2 &&
+        p + 6 <= extra_end) {
+      std::size_t block_size{read_le(data + p + 4, 2) + std::size_t{1}};
+      return block_size <= size && block_size >= extra_end + 8 ? block_size
+                                                               : 0;
+    }
+  }
+  return 0;
+}
+
+// The blocks of a BGZF file are independent gzip members whose compressed and
+// uncompressed sizes are known from their headers and footers, so each block
+// can be decompressed directly to its place in the mapped output file by any
+// thread
+static std::unique_ptr<MappedFile>
+decompress_bgzf(const char *data, const std::vector<std::size_t> &blocks,
+                const std::string &filename, const std::string &out_filename) {
+  // blocks contains the start of each block and the end of the last block
+  std::size_t n_blocks{blocks.size() - 1};
+  std::vector<std::size_t> offsets(n_blocks + 1, 0);
+  for (std::size_t i = 0; i < n_blocks; ++i) {
+    offsets[i + 1] = offsets[i] + read_le(data + blocks[i + 1] - 4, 4);
+  }
+  auto out{std::make_unique<MappedFile>(out_filename, offsets.back())};
+  char *out_data{out->data()};
+  bool failed{false};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(data, blocks, n_blocks, offsets, out_data) reduction(|| : failed)
+#endif
+  for (std::size_t i = 0; i < n_blocks; ++i) {
+    const char *block{data + blocks[i]};
+    std::size_t compressed_begin{12 + read_le(block + 10, 2)};
+    std::size_t compressed_end{blocks[i + 1] - blocks[i] - 8};
+    std::size_t n_out{offsets[i + 1] - offsets[i]};
+    if (n_out == 0) {
+      // e.g. the empty end-of-file block
+      continue;
+    }
+    z_stream stream{};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      failed = true;
+      continue;
+    }
+    stream.next_in = reinterpret_cast<Bytef *>(
+        const_cast<char *>(block + compressed_begin));
+    stream.avail_in = static_cast<uInt>(compressed_end - compressed_begin);
+    auto *next_out{reinterpret_cast<Bytef *>(out_data + offsets[i])};
+    stream.next_out = next_out;
+    stream.avail_out = static_cast<uInt>(n_out);
+    bool ok{inflate(&stream, Z_FINISH) == Z_STREAM_END &&
+            stream.total_out == n_out &&
+            crc32(0, next_out, static_cast<uInt>(n_out)) ==
+                read_le(block + compressed_end, 4)};
+    inflateEnd(&stream);
+    failed = failed || !ok;
+  }
+  if (failed) {
+    throw decompress_error(filename);
+  }
+  return out;
+}
+
+// A gzip file of one or more members is decompressed serially, and written to
+// the output file in parts, which is then mapped
+static std::unique_ptr<MappedFile>
+decompress_gzip(const char *data, std::size_t size, const std::string &filename,
+                const std::string &out_filename) {
+  std::ofstream out(out_filename, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error("Error: Failed to open file '" + out_filename +
+                             "'");
+  }
+  constexpr std::size_t buffer_bytes{std::size_t{1} << 22};
+  std::vector<char> buffer(buffer_bytes);
+  z_stream stream{};
+  // automatic gzip header detection
+  if (inflateInit2(&stream, MAX_WBITS + 32) != Z_OK) {
+    throw decompress_error(filename);
+  }
+  // zlib sizes are 32-bit, so the input is given in parts
+  constexpr std::size_t max_part{std::size_t{1} << 30};
+  std::size_t n_in{0};
+  int status{Z_OK};
+  while (true) {
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(data + n_in));
+    stream.avail_in = static_cast<uInt>(std::min(size - n_in, max_part));
+    stream.next_out = reinterpret_cast<Bytef *>(buffer.data());
+    stream.avail_out = static_cast<uInt>(buffer.size());
+    auto avail_in{stream.avail_in};
+    status = inflate(&stream, Z_NO_FLUSH);
+    n_in += avail_in - stream.avail_in;
+    out.write(buffer.data(),
+              static_cast<std::streamsize>(buffer.size() - stream.avail_out));
+    if (!out) {
+      break;
+    }
+    if (status == Z_STREAM_END) {
+      if (n_in == size) {
+        break;
+      }
+      // another member follows
+      inflateReset(&stream);
+    } else if ((status != Z_OK && status != Z_BUF_ERROR) ||
+               (n_in == size && stream.avail_out > 0)) {
+      // invalid or truncated data
+      break;
+    }
+  }
+  inflateEnd(&stream);
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Error: Failed to write file '" + out_filename +
+                             "'");
+  }
+  if (status != Z_STREAM_END) {
+    throw decompress_error(filename);
+  }
+  return std::make_unique<MappedFile>(out_filename);
+}
+
+// decompress data to out_filename, and map it
+static std::unique_ptr<MappedFile> decompress(const char *data,
+                                              std::size_t size,
+                                              const std::string &filename,
+                                              const std::string &out_filename) {
+  std::vector<std::size_t> blocks{0};
+  while (blocks.back() < size) {
+    std::size_t block_size{
+        bgzf_block_size(data + blocks.back(), size - blocks.back())};
+    if (block_size == 0) {
+      return decompress_gzip(data, size, filename, out_filename);
+    }
+    blocks.push_back(blocks.back() + block_size);
+  }
+  return decompress_bgzf(data, blocks, filename, out_filename);
+}
+
+#else
+
+static std::unique_ptr<MappedFile> decompress(const char *, std::size_t,
+                                              const std::string &filename,
+                                              const std::string &) {
+  throw std::runtime_error("Error: Cannot read compressed file '" + filename +
+                           "', hammingdist was not compiled with zlib support");
+}
+
+#endif
+
+FastaFile::FastaFile(const std::string &filename, std::size_t n,
+                     const std::string &temp_directory)
+    : file_(filename), data_{file_.data()}, size_{file_.size()} {
+  if (is_gzip(data_, size_)) {
+    decompressed_file_ = std::make_unique<TemporaryFile>(temp_directory);
+    decompressed_ =
+        decompress(data_, size_, filename, decompressed_file_->name());
+    data_ = decompressed_->data();
+    size_ = decompressed_->size();
+  }
+  const char *data{data_};
+  std::size_t size{size_};
+  if (size == 0) {
+    return;
+  }
+  // find the start of each header line in parallel, in chunks of the file
+  constexpr std::size_t min_chunk_bytes{1 << 20};
+  std::size_t n_chunks{1};
+#ifdef HAMMING_WITH_OPENMP
+  n_chunks = 4 * static_cast<std::size_t>(omp_get_max_threads());
+#endif
+  n_chunks = std::clamp(size / min_chunk_bytes, std::size_t{1}, n_chunks);
+  std::vector<std::vector<std::size_t>> chunk_headers(n_chunks);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) default(none)                    \
+    shared(data, size, n_chunks, chunk_headers)
+#endif
+  for (std::size_t c = 0; c < n_chunks; ++c) {
+    // memchr is vectorized by the standard library
+    const char *p{data + c * size / n_chunks};
+    const char *end{data + (c + 1) * size / n_chunks};
+    while (p < end) {
+      const auto *newline{
+          static_cast<const char *>(std::memchr(p, '\n', end - p))};
+      if (newline == nullptr) {
+        break;
+      }
+      p = newline + 1;
+      if (p < data + size && *p == '>') {
+        chunk_headers[c].push_back(static_cast<std::size_t>(p - data));
+      }
+    }
+  }
+  // the first line is always a header
+  std::vector<std::size_t> headers{0};
+  for (const auto &h : chunk_headers) {
+    headers.insert(headers.end(), h.begin(), h.end());
+  }
+  if (n == 0 || n > headers.size()) {
+    n = headers.size();
+  }
+  sequence_begin_.reserve(n);
+  sequence_end_.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    std::size_t header_end{i + 1 < headers.size() ? headers[i + 1] : size};
+    const auto *newline{static_cast<const char *>(
+        std::memchr(data + headers[i], '\n', header_end - headers[i]))};
+    if (newline == nullptr) {
+      // a final header without a newline has no sequence
+      break;
+    }
+    sequence_begin_.push_back(static_cast<std::size_t>(newline + 1 - data));
+    sequence_end_.push_back(header_end);
+  }
+}
+
+void FastaFile::append_sequence(std::size_t i, std::string &seq) const {
+  const char *p{data_ + sequence_begin_[i]};
+  const char *end{data_ + sequence_end_[i]};
+  while (p < end) {
+    const auto *newline{
+        static_cast<const char *>(std::memchr(p, '\n', end - p))};
+    const char *line_end{newline == nullptr ? end : newline};
+    seq.append(p, line_end);
+    p = line_end + 1;
+  }
+}
+
+std::string FastaFile::sequence(std::size_t i) const {
+  std::string seq;
+  // the sequence is at most the size of its lines, so is never reallocated
+  seq.reserve(sequence_end_[i] - sequence_begin_[i]);
+  append_sequence(i, seq);
+  return seq;
+}
+
+std::string_view FastaFile::sequence_view(std::size_t i,
+                                          std::string &buffer) const {
+  const char *begin{data_ + sequence_begin_[i]};
+  const char *end{data_ + sequence_end_[i]};
+  const auto *newline{
+      static_cast<const char *>(std::memchr(begin, '\n', end - begin))};
+  if (newline == nullptr) {
+    return {begin, static_cast<std::size_t>(end - begin)};
+  }
+  // a single line, possibly followed by empty lines
+  if (std::all_of(newline, end, [](char c) { return c == '\n'; })) {
+    return {begin, static_cast<std::size_t>(newline - begin)};
+  }
+  buffer.clear();
+  buffer.reserve(static_cast<std::size_t>(end - begin));
+  append_sequence(i, buffer);
+  return buffer;
+}
+
+std::size_t FastaFile::sequence_length(std::size_t i) const {
+  const char *p{data_ + sequence_begin_[i]};
+  const char *end{data_ + sequence_end_[i]};
+  std::size_t length{static_cast<std::size_t>(end - p)};
+  while (p < end) {
+    const auto *newline{
+        static_cast<const char *>(std::memchr(p, '\n', end - p))};
+    if (newline == nullptr) {
+      break;
+    }
+    --length;
+    p = newline + 1;
+  }
+  return length;
+}
+
+std::vector<std::string> FastaFile::sequences(std::size_t begin,
+                                              std::size_t end) const {
+  std::vector<std::string> seqs(end - begin);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(seqs, begin, end)
+#endif
+  for (std::size_t i = begin; i < end; ++i) {
+    seqs[i - begin] = sequence(i);
+  }
+  return seqs;
+}
+
+std::vector<std::string>
+FastaFile::sequences(const std::vector<std::size_t> &records) const {
+  std::vector<std::string> seqs(records.size());
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(seqs, records)
+#endif
+  for (std::size_t i = 0; i < records.size(); ++i) {
+    seqs[i] = sequence(records[i]);
+  }
+  return seqs;
+}
+
+std::vector<std::size_t> FastaFile::unique_sequence_indices(
+    std::vector<std::size_t> *first_records) const {
+  std::vector<std::size_t> sequence_indices;
+  sequence_indices.reserve(size());
+  // the unique sequence index and the first record of each hash
+  struct Unique {
+    std::size_t index;
+    std::size_t record;
+  };
+  std::unordered_map<Hash128, Unique, Hash128Hasher> map_hash_to_unique;
+  std::size_t count_unique{0};
+  // sequences are hashed by all threads in batches. Single-line sequences are
+  // hashed directly from the file, and only multi-line sequences are copied,
+  // so at most one batch of sequences is in memory at the same time.
+  constexpr std::size_t batch_size{8192};
+  std::vector<Hash128> hashes(batch_size);
+  std::vector<std::string> buffers(batch_size);
+  std::vector<std::string_view> seqs(batch_size);
+  std::vector<std::size_t> first(batch_size);
+  for (std::size_t begin = 0; begin < size(); begin += batch_size) {
+    std::size_t end{std::min(begin + batch_size, size())};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(seqs, buffers, hashes, begin, end)
+#endif
+    for (std::size_t i = begin; i < end; ++i) {
+      seqs[i - begin] = sequence_view(i, buffers[i - begin]);
+      hashes[i - begin] = hash128(seqs[i - begin]);
+    }
+    // the map only holds 128-bit hashes, so inserting them is cheap
+    for (std::size_t i = begin; i < end; ++i) {
+      auto result = map_hash_to_unique.emplace(hashes[i - begin],
+                                               Unique{count_unique, i});
+      if (result.second) {
+        ++count_unique;
+        if (first_records != nullptr) {
+          first_records->push_back(i);
+        }
+      }
+      sequence_indices.push_back(result.first->second.index);
+      first[i - begin] = result.first->second.record;
+    }
+    // check that each duplicate has the same sequence as the first record
+    // with the same hash, in case of a (very unlikely) hash collision
+    bool collision{false};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(seqs, first, begin, end) reduction(|| : collision)
+#endif
+    for (std::size_t i = begin; i < end; ++i) {
+      std::size_t f{first[i - begin]};
+      if (f == i) {
+        continue;
+      }
+      if (f >= begin) {
+        collision = collision || seqs[i - begin] != seqs[f - begin];
+      } else {
+        std::string buffer;
+        collision = collision || seqs[i - begin] != sequence_view(f, buffer);
+      }
+    }
+    if (collision) {
+      throw std::runtime_error(
+          "Error: Hash collision between different sequences");
+    }
+  }
+  return sequence_indices;
+}
+
+Sequences::Sequences(const FastaFile &fasta, std::vector<std::size_t> records)
+    : fasta_{&fasta}, records_{std::move(records)} {
+  if (records_.empty()) {
+    records_.resize(fasta.size());
+    std::iota(records_.begin(), records_.end(), std::size_t{0});
+  }
+}
+
+void Sequences::release() {
+  if (releasable_data_ != nullptr) {
+    releasable_data_->clear();
+    releasable_data_->shrink_to_fit();
+  }
+}
+
+} // namespace hamming
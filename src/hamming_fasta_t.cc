@@ -0,0 +1,259 @@
+#include "hamming/hamming_fasta.hh"
+#include "tests.hh"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#ifdef HAMMING_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace hamming;
+
+// the std::getline implementation of read_fasta that FastaFile replaces
+static std::vector<std::string> getline_read_fasta(const std::string &filename,
+                                                   std::size_t n) {
+  std::vector<std::string> data;
+  if (n == 0) {
+    n = std::numeric_limits<std::size_t>::max();
+  }
+  std::ifstream stream(filename);
+  std::string line;
+  std::getline(stream, line);
+  while (data.size() < n && !stream.eof()) {
+    std::string seq{};
+    while (std::getline(stream, line) && line[0] != '>') {
+      seq.append(line);
+    }
+    data.push_back(std::move(seq));
+  }
+  return data;
+}
+
+static void write_file(const std::string &filename,
+                       const std::string &contents) {
+  std::ofstream stream(filename, std::ios::binary);
+  stream << contents;
+}
+
+#ifdef HAMMING_WITH_ZLIB
+// a single gzip member, or a BGZF block if bgzf is true
+static std::string gzip(const std::string &contents, bool bgzf = false) {
+  z_stream stream{};
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+               bgzf ? -MAX_WBITS : MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+  std::string compressed(deflateBound(&stream, contents.size()) + 64, '\0');
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(contents.data()));
+  stream.avail_in = static_cast<uInt>(contents.size());
+  stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+  stream.avail_out = static_cast<uInt>(compressed.size());
+  REQUIRE(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  if (!bgzf) {
+    return compressed;
+  }
+  auto le = [](std::uint32_t x, int n_bytes) {
+    std::string s;
+    for (int i = 0; i < n_bytes; ++i) {
+      s.push_back(static_cast<char>((x >> (8 * i)) & 0xff));
+    }
+    return s;
+  };
+  auto crc{crc32(0, reinterpret_cast<const Bytef *>(contents.data()),
+                 static_cast<uInt>(contents.size()))};
+  // gzip header with an extra field, followed by the BGZF "BC" subfield
+  std::string header{"\x1f\x8b\x08\x04\0\0\0\0\0\xff", 10};
+  return header + le(6, 2) + "BC" + le(2, 2) +
+         le(static_cast<std::uint32_t>(compressed.size() + 25), 2) +
+         compressed + le(static_cast<std::uint32_t>(crc), 4) +
+         le(static_cast<std::uint32_t>(contents.size()), 4);
+}
+#endif
+
+TEST_CASE("FastaFile gives the same sequences as std::getline parsing",
+          "[fasta]") {
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  std::mt19937 gen(12345);
+  // a fasta file with multi-line sequences that is large enough to be split
+  // into several chunks
+  std::string large;
+  for (int i = 0; i < 12000; ++i) {
+    large.append(">seq" + std::to_string(i) + "\n");
+    auto seq{make_test_string(411, gen)};
+    for (std::size_t j = 0; j < seq.size(); j += 60) {
+      large.append(seq.substr(j, 60));
+      large.push_back('\n');
+    }
+  }
+  for (const std::string &contents :
+       {std::string{}, std::string{">a"}, std::string{">a\n"},
+        std::string{">a\nACGT"}, std::string{">a\nACGT\n"},
+        std::string{">a\nAC\nGT\n>b\n>c\n\nT-\n\n>d"},
+        std::string{"no header\nACGT\n>b\nGG\n>c\nTT"},
+        std::string{"\n>a\nAC\n"}, std::string{">a\r\nAC\r\nGT\r\n"},
+        std::string{">a\n>b\n>c\n"}, large}) {
+    write_file(tmp_file_name, contents);
+    for (std::size_t n : {0, 1, 2, 3, 1000, 100000}) {
+      CAPTURE(contents.substr(0, 100));
+      CAPTURE(n);
+      auto ref{getline_read_fasta(tmp_file_name, n)};
+      FastaFile fasta(tmp_file_name, n);
+      REQUIRE(fasta.size() == ref.size());
+      REQUIRE(fasta.sequences(0, fasta.size()) == ref);
+      std::string buffer;
+      for (std::size_t i = 0; i < fasta.size(); ++i) {
+        REQUIRE(fasta.sequence(i) == ref[i]);
+        REQUIRE(fasta.sequence_view(i, buffer) == ref[i]);
+        REQUIRE(fasta.sequence_length(i) == ref[i].size());
+      }
+      Sequences sequences(fasta);
+      REQUIRE(sequences.size() == ref.size());
+      for (std::size_t i = 0; i < sequences.size(); ++i) {
+        REQUIRE(sequences.get(i, buffer) == ref[i]);
+        REQUIRE(sequences.length(i) == ref[i].size());
+      }
+    }
+  }
+  std::remove(tmp_file_name);
+}
+
+TEST_CASE("FastaFile::unique_sequence_indices() matches std::unordered_map "
+          "deduplication",
+          "[fasta]") {
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  std::mt19937 gen(12345);
+  for (std::size_t n_unique : {1, 7, 3000}) {
+    std::vector<std::string> unique;
+    for (std::size_t i = 0; i < n_unique; ++i) {
+      unique.push_back(make_test_string(57, gen));
+    }
+    // enough records for several batches, so that duplicates of sequences
+    // from earlier batches are also checked
+    std::uniform_int_distribution<std::size_t> distrib(0, n_unique - 1);
+    std::ofstream stream(tmp_file_name);
+    for (std::size_t i = 0; i < 20000; ++i) {
+      stream << ">seq" << i << "\n" << unique[distrib(gen)] << "\n";
+    }
+    stream.close();
+    for (std::size_t n : {0, 1, 9000}) {
+      CAPTURE(n_unique);
+      CAPTURE(n);
+      auto seqs{getline_read_fasta(tmp_file_name, n)};
+      std::vector<std::string> ref_unique;
+      std::vector<std::size_t> ref_indices;
+      std::unordered_map<std::string, std::size_t> map_seq_to_index;
+      for (const auto &seq : seqs) {
+        auto result = map_seq_to_index.emplace(seq, ref_unique.size());
+        if (result.second) {
+          ref_unique.push_back(seq);
+        }
+        ref_indices.push_back(result.first->second);
+      }
+      FastaFile fasta(tmp_file_name, n);
+      REQUIRE(fasta.unique_sequence_indices() == ref_indices);
+      std::vector<std::size_t> first_records;
+      REQUIRE(fasta.unique_sequence_indices(&first_records) == ref_indices);
+      REQUIRE(fasta.sequences(first_records) == ref_unique);
+    }
+  }
+  std::remove(tmp_file_name);
+}
+
+TEST_CASE("MappedFile contains the file contents", "[fasta]") {
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  for (const std::string &contents :
+       {std::string{}, std::string{"x"}, std::string(100000, '>')}) {
+    write_file(tmp_file_name, contents);
+    MappedFile file(tmp_file_name);
+    REQUIRE(file.size() == contents.size());
+    REQUIRE(std::string(file.data(), file.size()) == contents);
+  }
+  std::remove(tmp_file_name);
+  REQUIRE_THROWS(MappedFile(tmp_file_name));
+  REQUIRE_THROWS(FastaFile(tmp_file_name));
+}
+
+TEST_CASE("TemporaryFile is removed when it is destroyed", "[fasta]") {
+  std::string name;
+  {
+    TemporaryFile tmp;
+    TemporaryFile other;
+    name = tmp.name();
+    REQUIRE(name != other.name());
+    // the file is created empty, and is only accessible by the owner
+    REQUIRE(std::filesystem::exists(name));
+    REQUIRE(std::filesystem::file_size(name) == 0);
+    REQUIRE((std::filesystem::status(name).permissions() &
+             (std::filesystem::perms::group_all |
+              std::filesystem::perms::others_all)) ==
+            std::filesystem::perms::none);
+    write_file(name, "x");
+    REQUIRE(std::ifstream(name).good());
+  }
+  REQUIRE(!std::ifstream(name).good());
+}
+
+TEST_CASE("TemporaryFile is created in the given directory", "[fasta]") {
+  auto directory{std::filesystem::temp_directory_path() /
+                 "hammingdist-temporary-file-test"};
+  std::filesystem::create_directories(directory);
+  std::string name;
+  {
+    TemporaryFile tmp(directory.string());
+    name = tmp.name();
+    REQUIRE(std::filesystem::path(name).parent_path() == directory);
+    REQUIRE(std::filesystem::exists(name));
+  }
+  REQUIRE(!std::filesystem::exists(name));
+  std::filesystem::remove(directory);
+  REQUIRE_THROWS(TemporaryFile(directory.string()));
+}
+
+#ifdef HAMMING_WITH_ZLIB
+TEST_CASE("FastaFile reads gzip and BGZF compressed files", "[fasta]") {
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  std::mt19937 gen(12345);
+  std::string large;
+  for (int i = 0; i < 3000; ++i) {
+    large.append(">seq" + std::to_string(i) + "\n" +
+                 make_test_string(411, gen) + "\n");
+  }
+  for (const std::string &contents :
+       {std::string{">a"}, std::string{">a\nAC\nGT\n>b\n>c\n\nT-\n\n>d"},
+        large}) {
+    CAPTURE(contents.substr(0, 100));
+    write_file(tmp_file_name, contents);
+    auto ref{getline_read_fasta(tmp_file_name, 0)};
+    std::size_t half{contents.size() / 2};
+    // a BGZF file ends with an empty block
+    std::string bgzf_small_blocks;
+    for (std::size_t i = 0; i < contents.size(); i += 1000) {
+      bgzf_small_blocks.append(gzip(contents.substr(i, 1000), true));
+    }
+    bgzf_small_blocks.append(gzip({}, true));
+    for (const std::string &compressed :
+         {gzip(contents),
+          gzip(contents.substr(0, half)) + gzip(contents.substr(half)),
+          gzip(contents, true) + gzip({}, true), bgzf_small_blocks}) {
+      write_file(tmp_file_name, compressed);
+      FastaFile fasta(tmp_file_name);
+      REQUIRE(fasta.sequences(0, fasta.size()) == ref);
+      // truncated or corrupted files
+      write_file(tmp_file_name, compressed.substr(0, compressed.size() - 5));
+      REQUIRE_THROWS(FastaFile(tmp_file_name));
+      auto corrupted{compressed};
+      corrupted[20] ^= 0x5a;
+      write_file(tmp_file_name, corrupted);
+      REQUIRE_THROWS(FastaFile(tmp_file_name));
+    }
+  }
+  std::remove(tmp_file_name);
+}
+#endif
@@ -1,10 +1,13 @@
 #include "hamming/hamming_impl.hh"
+#include "hamming/hamming_fasta.hh"
+#include "hamming/hamming_utils.hh"
 #include <algorithm>
+#include <bit>
 #if !(defined(__aarch64__) || defined(_M_ARM64))
 #include <cpuinfo_x86.h>
 #endif
+#include <numeric>
 #include <stdexcept>
-#include <unordered_map>
 #ifdef HAMMING_WITH_SSE2
 #include "hamming/distance_sse2.hh"
 #endif
@@ -43,6 +46,40 @@ std::array<GeneBlock, 256> lookupTable(bool include_x) {
   return lookup;
 }
 
+std::array<GeneBlock, 256> lookupTableWide() {
+  // The distance kernels count the 4-bit genes g for which (a & b) & g == 0.
+  // Here each char uses both nibbles of a GeneBlock, such that a pair of
+  // chars that differ has exactly one such nibble, and a pair that does not
+  // differ has none:
+  //  - low nibble: one-hot A, C, G, T, and X matches all of them
+  //  - high nibble: A, C, G, T share one bit, X has another, so X differs
+  //    from A, C, G, T, but not from itself
+  //  - '-' is 0xff, so never differs from a valid char
+  //  - invalid chars are 0xf0, so always differ in the low nibble only
+  std::array<GeneBlock, 256> lookup;
+  lookup.fill(0xf0);
+  lookup[std::size_t('-')] = 0xff;
+  lookup[std::size_t('A')] = 0x11;
+  lookup[std::size_t('C')] = 0x12;
+  lookup[std::size_t('G')] = 0x14;
+  lookup[std::size_t('T')] = 0x18;
+  lookup[std::size_t('X')] = 0x2f;
+  return lookup;
+}
+
+// see BitPlaneRow for the meaning of the three bits:
+// bit 0: lo, bit 1: hi, bit 2: valid
+std::array<std::uint8_t, 256> bitPlaneLookupTable() {
+  std::array<std::uint8_t, 256> lookup;
+  lookup.fill(0b010);
+  lookup[std::size_t('-')] = 0b000;
+  lookup[std::size_t('A')] = 0b100;
+  lookup[std::size_t('C')] = 0b101;
+  lookup[std::size_t('G')] = 0b110;
+  lookup[std::size_t('T')] = 0b111;
+  return lookup;
+}
+
 distance_func_ptr get_fastest_supported_distance_func() {
   std::string simd_str = "no";
   distance_func_ptr distance_func{distance_cpp};
@@ -77,59 +114,123 @@ distance_func_ptr get_fastest_supported_distance_func() {
   return distance_func;
 }
 
-void validate_data(const std::vector<std::string> &data) {
-  if (data.empty() || data[0].empty()) {
+distance_1x4_func_ptr get_fastest_supported_distance_1x4_func() {
+  std::string simd_str = "no";
+  distance_1x4_func_ptr distance_func{distance_cpp_1x4};
+#if defined(__aarch64__) || defined(_M_ARM64)
+#ifdef HAMMING_WITH_NEON
+  distance_func = distance_neon_1x4;
+  simd_str = "NEON";
+#endif
+#else
+  const auto features = cpu_features::GetX86Info().features;
+#ifdef HAMMING_WITH_SSE2
+  if (features.sse2) {
+    distance_func = distance_sse2_1x4;
+    simd_str = "SSE2";
+  }
+#endif
+#ifdef HAMMING_WITH_AVX2
+  if (features.avx2) {
+    distance_func = distance_avx2_1x4;
+    simd_str = "AVX2";
+  }
+#endif
+#ifdef HAMMING_WITH_AVX512
+  if (features.avx512bw) {
+    distance_func = distance_avx512_1x4;
+    simd_str = "AVX512";
+  }
+#endif
+#endif
+  std::cout << "# hammingdist :: Using CPU with " << simd_str
+            << " SIMD extensions..." << std::endl;
+  return distance_func;
+}
+
+distance_sparse_func_ptr get_fastest_supported_distance_sparse_func() {
+  std::string simd_str = "no";
+  distance_sparse_func_ptr distance_func{distance_sparse};
+#if !(defined(__aarch64__) || defined(_M_ARM64))
+#ifdef HAMMING_WITH_AVX2
+  if (cpu_features::GetX86Info().features.avx2) {
+    distance_func = distance_avx2_sparse;
+    simd_str = "AVX2";
+  }
+#endif
+#endif
+  std::cout << "# hammingdist :: Using CPU with " << simd_str
+            << " SIMD extensions for sparse samples..." << std::endl;
+  return distance_func;
+}
+
+void validate_data(const Sequences &data) {
+  if (data.empty() || data.length(0) == 0) {
     throw std::runtime_error("Error: Empty sequence");
   }
-  auto length{data[0].size()};
-  for (const auto &d : data) {
-    if (d.size() != length) {
-      throw std::runtime_error(
-          "Error: Sequences do not all have the same length");
-    }
+  auto length{data.length(0)};
+  bool same_length{true};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(data, length)                   \
+    reduction(&& : same_length)
+#endif
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    same_length = same_length && data.length(i) == length;
+  }
+  if (!same_length) {
+    throw std::runtime_error(
+        "Error: Sequences do not all have the same length");
   }
 }
 
-int distance_sparse(const SparseData &a, const SparseData &b, int max_dist) {
-  int r{0};
-  std::size_t ia{0};
-  std::size_t ib{0};
-  while (ia < a.size() && ib < b.size()) {
-    if (a[ia] < b[ib]) {
-      // add distance contribution from a
-      r += static_cast<int>(a[ia + 1] != 0xff);
-      ia += 2;
-    } else if (a[ia] > b[ib]) {
-      // add distance contribution from b
-      r += static_cast<int>(b[ib + 1] != 0xff);
-      ib += 2;
-    } else {
-      // a and b have the same index: i.e. overlap
-      // so add distance contribution from combination
-      bool nodash = (a[ia + 1] != 0xff) && (b[ib + 1] != 0xff);
-      bool differ = (a[ia + 1] != b[ib + 1]);
-      r += static_cast<int>(nodash && differ);
-      // advance both
-      ia += 2;
-      ib += 2;
+// number of each char at each position of the samples, where ctoi maps each
+// char to one of n_counts categories, counted by all threads in one pass over
+// the samples
+template <std::size_t n_counts>
+static std::vector<std::array<std::size_t, n_counts>>
+count_chars(const Sequences &data, const std::array<std::size_t, 256> &ctoi) {
+  std::size_t length{data.length(0)};
+  std::vector<std::array<std::size_t, n_counts>> counts(
+      length, std::array<std::size_t, n_counts>{});
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none) shared(data, ctoi, length, counts)
+#endif
+  {
+    std::vector<std::array<std::size_t, n_counts>> thread_counts(
+        length, std::array<std::size_t, n_counts>{});
+    std::string buffer;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(static)
+#endif
+    for (std::size_t i_seq = 0; i_seq < data.size(); ++i_seq) {
+      auto seq{data.get(i_seq, buffer)};
+      for (std::size_t i = 0; i < length; ++i) {
+        ++(thread_counts[i][ctoi[static_cast<unsigned char>(seq[i])]]);
+      }
     }
-    if (r >= max_dist) {
-      return max_dist;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp critical
+#endif
+    for (std::size_t i = 0; i < length; ++i) {
+      for (std::size_t k = 0; k < n_counts; ++k) {
+        counts[i][k] += thread_counts[i][k];
+      }
     }
   }
-  while (ia < a.size()) {
-    r += static_cast<int>(a[ia + 1] != 0xff);
-    ia += 2;
-  }
-  while (ib < b.size()) {
-    r += static_cast<int>(b[ib + 1] != 0xff);
-    ib += 2;
+  return counts;
+}
+
+int distance_sparse(const SparseData &a, const SparseData &b, int max_dist) {
+  int r{a.n_nondash + b.n_nondash};
+  // each overlapping position reduces the distance by at most 2
+  if (r - 2 * static_cast<int>(std::min(a.size(), b.size())) >= max_dist) {
+    return max_dist;
   }
+  r -= sparse_overlap_correction(a, 0, b, 0);
   return std::min(r, max_dist);
 }
 
-int distance_cpp(const std::vector<GeneBlock> &a,
-                 const std::vector<GeneBlock> &b, int max_dist) {
+int distance_cpp(DenseRow a, DenseRow b, int max_dist) {
   int r{0};
   for (std::size_t i = 0; i < a.size(); ++i) {
     auto c{static_cast<GeneBlock>(a[i] & b[i])};
@@ -139,11 +240,717 @@ int distance_cpp(const std::vector<GeneBlock> &a,
   return std::min(r, max_dist);
 }
 
-static std::string
-get_reference_expression(const std::vector<std::string> &data, bool include_x) {
+std::array<int, n_partners>
+distance_cpp_1x4(DenseRow a, const std::array<DenseRow, n_partners> &b,
+                 int max_dist) {
+  std::array<int, n_partners> r{};
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    // each element of a is loaded once and used for all partners
+    auto ai{a[i]};
+    for (std::size_t k = 0; k < n_partners; ++k) {
+      auto c{static_cast<GeneBlock>(ai & b[k][i])};
+      r[k] += static_cast<int>((c & mask_gene0) == 0) +
+              static_cast<int>((c & mask_gene1) == 0);
+    }
+  }
+  for (auto &rk : r) {
+    rk = std::min(rk, max_dist);
+  }
+  return r;
+}
+
+int distance_cpp_bitplane(BitPlaneRow a, BitPlaneRow b, int max_dist) {
+  int r{0};
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    auto va{a.valid()[i]};
+    auto vb{b.valid()[i]};
+    auto differ{(a.lo()[i] ^ b.lo()[i]) | (a.hi()[i] ^ b.hi()[i])};
+    auto m{(va & vb & differ) | (a.hi()[i] & ~va) | (b.hi()[i] & ~vb)};
+    r += std::popcount(m);
+  }
+  return std::min(r, max_dist);
+}
+
+// the kernels are wrapped in lambdas so that they are inlined into the
+// distances_tiled loop
+static constexpr auto distance_kernel = [](DenseRow a, DenseRow b,
+                                           int max_dist) {
+  return distance_cpp(a, b, max_dist);
+};
+
+static constexpr auto distance_1x4_kernel =
+    [](DenseRow a, const std::array<DenseRow, n_partners> &b, int max_dist) {
+      return distance_cpp_1x4(a, b, max_dist);
+    };
+
+static constexpr auto distance_bitplane_kernel = [](BitPlaneRow a,
+                                                    BitPlaneRow b,
+                                                    int max_dist) {
+  return distance_cpp_bitplane(a, b, max_dist);
+};
+
+template <typename DistIntType>
+static void distances_cpp(const DenseData &data, DistIntType *result,
+                          int max_dist, const LowerBoundPruning *pruning,
+                          RowRange rows) {
+  distances_tiled(data, result, max_dist, distance_kernel, distance_1x4_kernel,
+                  pruning, rows);
+}
+
+template <typename DistIntType>
+static void distances_cpp(const BitPlaneData &data, DistIntType *result,
+                          int max_dist, const LowerBoundPruning *pruning) {
+  distances_tiled(data, result, max_dist, distance_bitplane_kernel, nullptr,
+                  pruning);
+}
+
+// the SIMD implementation is chosen once for the whole distances matrix, and
+// each implementation has its own tiled loop with the kernel inlined into it
+template <typename DistIntType>
+using distances_dense_func_ptr = void (*)(const DenseData &, DistIntType *,
+                                          int, const LowerBoundPruning *,
+                                          RowRange);
+
+template <typename DistIntType>
+static distances_dense_func_ptr<DistIntType> get_fastest_distances_func() {
+  std::string simd_str = "no";
+  distances_dense_func_ptr<DistIntType> distances_func{
+      distances_cpp<DistIntType>};
+#if defined(__aarch64__) || defined(_M_ARM64)
+#ifdef HAMMING_WITH_NEON
+  distances_func = distances_neon;
+  simd_str = "NEON";
+#endif
+#else
+  const auto features = cpu_features::GetX86Info().features;
+#ifdef HAMMING_WITH_SSE2
+  if (features.sse2) {
+    distances_func = distances_sse2;
+    simd_str = "SSE2";
+  }
+#endif
+#ifdef HAMMING_WITH_AVX2
+  if (features.avx2) {
+    distances_func = distances_avx2;
+    simd_str = "AVX2";
+  }
+#endif
+#ifdef HAMMING_WITH_AVX512
+  if (features.avx512bw) {
+    distances_func = distances_avx512;
+    simd_str = "AVX512";
+  }
+#endif
+#endif
+  std::cout << "# hammingdist :: Using CPU with " << simd_str
+            << " SIMD extensions..." << std::endl;
+  return distances_func;
+}
+
+template <typename DistIntType>
+static void distances_cpu_dispatch(const DenseData &data, DistIntType *result,
+                                   int max_dist,
+                                   const LowerBoundPruning *pruning) {
+  get_fastest_distances_func<DistIntType>()(data, result, max_dist, pruning,
+                                            {});
+}
+
+template <typename DistIntType>
+static void distances_cpu_dispatch(const BitPlaneData &data,
+                                   DistIntType *result, int max_dist,
+                                   const LowerBoundPruning *pruning) {
+  std::string simd_str = "no";
+  void (*distances_func)(const BitPlaneData &, DistIntType *, int,
+                         const LowerBoundPruning *){distances_cpp<DistIntType>};
+#if !(defined(__aarch64__) || defined(_M_ARM64))
+  const auto features = cpu_features::GetX86Info().features;
+#ifdef HAMMING_WITH_AVX2
+  if (features.avx2) {
+    distances_func = distances_avx2;
+    simd_str = "AVX2";
+  }
+#endif
+#ifdef HAMMING_WITH_AVX512
+  if (features.avx512bw) {
+    distances_func = distances_avx512;
+    simd_str = "AVX512";
+  }
+#endif
+#endif
+  std::cout << "# hammingdist :: Using CPU with " << simd_str
+            << " SIMD extensions and bit-plane encoding..." << std::endl;
+  distances_func(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const DenseData &data, std::uint8_t *result, int max_dist,
+                   const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const DenseData &data, std::uint16_t *result, int max_dist,
+                   const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const DenseData &data, std::uint32_t *result, int max_dist,
+                   const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const BitPlaneData &data, std::uint8_t *result,
+                   int max_dist, const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const BitPlaneData &data, std::uint16_t *result,
+                   int max_dist, const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+void distances_cpu(const BitPlaneData &data, std::uint32_t *result,
+                   int max_dist, const LowerBoundPruning *pruning) {
+  distances_cpu_dispatch(data, result, max_dist, pruning);
+}
+
+LowerBoundPruning make_lower_bound_pruning(const Sequences &data,
+                                           int max_dist) {
+  // reference: the most common of A, C, G, T and '-' at each position
+  std::size_t length{data.length(0)};
+  std::array<std::size_t, 256> ctoi{0};
+  ctoi[static_cast<std::size_t>('A')] = 1;
+  ctoi[static_cast<std::size_t>('C')] = 2;
+  ctoi[static_cast<std::size_t>('G')] = 3;
+  ctoi[static_cast<std::size_t>('T')] = 4;
+  ctoi[static_cast<std::size_t>('-')] = 5;
+  auto counts{count_chars<6>(data, ctoi)};
+  auto lookup = lookupTable();
+  std::array<GeneBlock, 6> itog{lookup['A'], lookup['A'], lookup['C'],
+                                lookup['G'], lookup['T'], lookup['-']};
+  std::vector<GeneBlock> reference(length);
+  for (std::size_t i = 0; i < length; ++i) {
+    reference[i] = itog[std::distance(
+        counts[i].cbegin(),
+        std::max_element(counts[i].cbegin() + 1, counts[i].cend()))];
+  }
+  // At each position where the reference is not '-', and sample a differs
+  // from the reference and is not '-', and sample b is equal to the
+  // reference, a and b also differ. So with n_nondash_diff(a) such positions
+  // in a, and n_diff(b) positions where b differs from a non-'-' reference,
+  //   distance(a, b) >= n_nondash_diff(a) - n_diff(b)
+  std::size_t n{data.size()};
+  std::vector<int> n_nondash_diff(n, 0);
+  std::vector<std::size_t> n_diff(n, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(data, n, length, lookup, reference, n_nondash_diff, n_diff)
+#endif
+  for (std::size_t i = 0; i < n; ++i) {
+    std::string buffer;
+    auto seq{data.get(i, buffer)};
+    int nondash_diff{0};
+    std::size_t diff{0};
+    for (std::size_t p = 0; p < length; ++p) {
+      auto c{lookup[static_cast<unsigned char>(seq[p])]};
+      bool d{(reference[p] != 0xff) && (c != reference[p])};
+      diff += static_cast<std::size_t>(d);
+      nondash_diff += static_cast<int>(d && (c != 0xff));
+    }
+    n_diff[i] = diff;
+    n_nondash_diff[i] = nondash_diff;
+  }
+  // Sorting the samples by n_diff then makes the pairs with this lower bound
+  // >= max_dist a contiguous range j < first_col[i] of each sorted row i
+  LowerBoundPruning pruning;
+  pruning.order.resize(n);
+  std::iota(pruning.order.begin(), pruning.order.end(), std::size_t{0});
+  std::stable_sort(pruning.order.begin(), pruning.order.end(),
+                   [&n_diff](std::size_t a, std::size_t b) {
+                     return n_diff[a] < n_diff[b];
+                   });
+  std::vector<std::size_t> sorted_n_diff(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    sorted_n_diff[i] = n_diff[pruning.order[i]];
+  }
+  pruning.first_col.resize(n, 0);
+  for (std::size_t i = 0; i < n; ++i) {
+    int lower_bound_offset{n_nondash_diff[pruning.order[i]] - max_dist};
+    if (lower_bound_offset >= 0) {
+      auto first{static_cast<std::size_t>(
+          std::upper_bound(sorted_n_diff.cbegin(), sorted_n_diff.cend(),
+                           static_cast<std::size_t>(lower_bound_offset)) -
+          sorted_n_diff.cbegin())};
+      pruning.first_col[i] = std::min(first, i);
+      pruning.n_pruned += pruning.first_col[i];
+    }
+  }
+  return pruning;
+}
+
+// Posting lists in compressed sparse row format: the samples that differ from
+// the reference at position p, and their codes, are stored in elements
+// [offsets[p], offsets[p+1]) of samples and codes, in ascending sample order
+struct SparseIndex {
+  std::vector<std::size_t> offsets;
+  std::vector<std::uint32_t> samples;
+  std::vector<GeneBlock> codes;
+};
+
+// the posting lists of the samples with the given indices, which are numbered
+// by their position in indices
+static SparseIndex make_sparse_index(const std::vector<SparseData> &data,
+                                     const std::vector<std::size_t> &indices,
+                                     std::size_t sample_length) {
+  SparseIndex index;
+  index.offsets.resize(sample_length + 1, 0);
+  for (auto i : indices) {
+    for (auto p : data[i].positions) {
+      ++index.offsets[p + 1];
+    }
+  }
+  std::partial_sum(index.offsets.cbegin(), index.offsets.cend(),
+                   index.offsets.begin());
+  index.samples.resize(index.offsets.back());
+  index.codes.resize(index.offsets.back());
+  // next free element in each posting list
+  auto next{index.offsets};
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    const auto &d{data[indices[i]]};
+    for (std::size_t k = 0; k < d.size(); ++k) {
+      auto &e{next[d.positions[k]]};
+      index.samples[e] = static_cast<std::uint32_t>(i);
+      index.codes[e] = d.codes[k];
+      ++e;
+    }
+  }
+  return index;
+}
+
+// the rows in rows of the lower triangular distances matrix of the samples
+// with the given ascending indices, using their posting lists index
+template <typename DistIntType>
+static void distances_inverted_index_rows(
+    const std::vector<SparseData> &data,
+    const std::vector<std::size_t> &indices, const SparseIndex &index,
+    DistIntType *result, int max_dist, RowRange rows) {
+  std::size_t nsamples{indices.size()};
+  std::vector<int> n_nondash(nsamples);
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    n_nondash[i] = data[indices[i]].n_nondash;
+  }
+  // the samples whose rows are in rows
+  auto i_begin{static_cast<std::size_t>(
+      std::lower_bound(indices.cbegin(), indices.cend(), rows.begin) -
+      indices.cbegin())};
+  auto i_end{static_cast<std::size_t>(
+      std::lower_bound(indices.cbegin(), indices.cend(), rows.end) -
+      indices.cbegin())};
+  i_begin = std::max(i_begin, std::size_t{1});
+  auto *progress{&Progress::current()};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel default(none)                                             \
+    shared(data, indices, index, result, max_dist, rows, nsamples, n_nondash,  \
+               i_begin, i_end, progress)
+#endif
+  {
+    // sum of the corrections for row i and each sample j < i
+    std::vector<int> overlap(nsamples, 0);
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+    for (std::size_t i = i_begin; i < i_end; ++i) {
+      if (progress->cancelled()) {
+        continue;
+      }
+      const auto &a{data[indices[i]]};
+      for (std::size_t k = 0; k < a.size(); ++k) {
+        auto p{a.positions[k]};
+        auto ca{a.codes[k]};
+        // only samples j < i are needed, which come first in the list
+        for (std::size_t e = index.offsets[p];
+             e < index.offsets[p + 1] && index.samples[e] < i; ++e) {
+          overlap[index.samples[e]] +=
+              sparse_code_correction(ca, index.codes[e]);
+        }
+      }
+      // the indices are ascending, so indices[j] < indices[i]
+      auto *r{result + rows.index(indices[i], 0)};
+      for (std::size_t j = 0; j < i; ++j) {
+        r[indices[j]] = static_cast<DistIntType>(
+            std::min(n_nondash[i] + n_nondash[j] - overlap[j], max_dist));
+        overlap[j] = 0;
+      }
+      progress->add(i);
+    }
+  }
+}
+
+template <typename DistIntType>
+static void
+distances_inverted_index_impl(const std::vector<SparseData> &data,
+                              std::size_t sample_length, DistIntType *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &subset) {
+  std::vector<std::size_t> all_indices;
+  if (subset.empty()) {
+    all_indices.resize(data.size());
+    std::iota(all_indices.begin(), all_indices.end(), std::size_t{0});
+  }
+  const auto &indices{subset.empty() ? all_indices : subset};
+  distances_inverted_index_rows(data, indices,
+                                make_sparse_index(data, indices, sample_length),
+                                result, max_dist, {});
+}
+
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint8_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices) {
+  distances_inverted_index_impl(data, sample_length, result, max_dist,
+                                indices);
+}
+
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint16_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices) {
+  distances_inverted_index_impl(data, sample_length, result, max_dist,
+                                indices);
+}
+
+void distances_inverted_index(const std::vector<SparseData> &data,
+                              std::size_t sample_length, std::uint32_t *result,
+                              int max_dist,
+                              const std::vector<std::size_t> &indices) {
+  distances_inverted_index_impl(data, sample_length, result, max_dist,
+                                indices);
+}
+
+int distance_sparse_dense(const SparseData &a, DenseRow b, DenseRow reference,
+                          int reference_distance, int max_dist) {
+  // a is the reference sequence except at a.positions, so start from the
+  // distance between the reference and b, and correct it at these positions
+  int r{reference_distance};
+  for (std::size_t k = 0; k < a.size(); ++k) {
+    auto p{a.positions[k]};
+    GeneBlock mask{(p % 2 == 0) ? mask_gene0 : mask_gene1};
+    auto gb{static_cast<GeneBlock>(b[p / 2] & mask)};
+    r += static_cast<int>((a.codes[k] & gb) == 0) -
+         static_cast<int>((reference[p / 2] & gb) == 0);
+  }
+  return std::min(r, max_dist);
+}
+
+// the samples of the mixed format: the posting lists of the sparse samples,
+// and the dense row and reference distance of each dense sample
+struct MixedSamples {
+  std::vector<std::size_t> sparse_indices{};
+  SparseIndex sparse_index{};
+  // row in dense of each sample, or dense.size() if it is sparse
+  std::vector<std::size_t> dense_rows{};
+  std::vector<int> reference_distances{};
+};
+
+static MixedSamples
+make_mixed_samples(const std::vector<SparseData> &sparse,
+                   const DenseData &dense,
+                   const std::vector<std::size_t> &dense_indices,
+                   DenseRow reference) {
+  MixedSamples samples;
+  std::size_t nsamples{sparse.size()};
+  samples.dense_rows.assign(nsamples, dense.size());
+  for (std::size_t k = 0; k < dense_indices.size(); ++k) {
+    samples.dense_rows[dense_indices[k]] = k;
+  }
+  for (std::size_t i = 0; i < nsamples; ++i) {
+    if (samples.dense_rows[i] == dense.size()) {
+      samples.sparse_indices.push_back(i);
+    }
+  }
+  samples.sparse_index = make_sparse_index(sparse, samples.sparse_indices,
+                                           dense.sample_length());
+  samples.reference_distances.resize(dense.size());
+  auto &reference_distances{samples.reference_distances};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(dense, reference, reference_distances)
+#endif
+  for (std::size_t k = 0; k < dense.size(); ++k) {
+    reference_distances[k] = distance_cpp(reference, dense[k]);
+  }
+  return samples;
+}
+
+// the rows in rows of the lower triangular distances matrix of the mixed
+// format samples, using distances_func for the dense x dense pairs
+template <typename DistIntType>
+static void distances_mixed_rows(
+    const std::vector<SparseData> &sparse, const DenseData &dense,
+    const std::vector<std::size_t> &dense_indices, DenseRow reference,
+    const MixedSamples &samples, DistIntType *result, int max_dist,
+    RowRange rows, distances_dense_func_ptr<DistIntType> distances_func) {
+  std::size_t nsamples{sparse.size()};
+  rows.end = std::min(rows.end, nsamples);
+  // dense x dense pairs, where an index map without any pruned pairs stores
+  // each distance at its position in result
+  LowerBoundPruning dense_map;
+  dense_map.order = dense_indices;
+  dense_map.first_col.assign(dense_indices.size(), 0);
+  dense_map.index_offset = rows.begin * (rows.begin - 1) / 2;
+  auto row_of = [&dense_indices](std::size_t i) {
+    return static_cast<std::size_t>(
+        std::lower_bound(dense_indices.cbegin(), dense_indices.cend(), i) -
+        dense_indices.cbegin());
+  };
+  distances_func(dense, result, max_dist, &dense_map,
+                 {row_of(rows.begin), row_of(rows.end)});
+  // sparse x sparse pairs
+  distances_inverted_index_rows(sparse, samples.sparse_indices,
+                                samples.sparse_index, result, max_dist, rows);
+  // sparse x dense pairs: each pair is in the row of its later sample
+  const auto &dense_rows{samples.dense_rows};
+  const auto &sparse_indices{samples.sparse_indices};
+  const auto &reference_distances{samples.reference_distances};
+  auto *progress{&Progress::current()};
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for schedule(dynamic, 16) default(none)                   \
+    shared(sparse, dense, dense_indices, reference, result, max_dist, rows,    \
+               dense_rows, sparse_indices, reference_distances, progress)
+#endif
+  for (std::size_t i = rows.begin; i < rows.end; ++i) {
+    if (progress->cancelled()) {
+      continue;
+    }
+    auto *r{result + rows.index(i, 0)};
+    std::size_t n_pairs{0};
+    if (auto k{dense_rows[i]}; k < dense.size()) {
+      for (auto j : sparse_indices) {
+        if (j >= i) {
+          break;
+        }
+        r[j] = static_cast<DistIntType>(
+            distance_sparse_dense(sparse[j], dense[k], reference,
+                                  reference_distances[k], max_dist));
+        ++n_pairs;
+      }
+    } else {
+      for (std::size_t d = 0; d < dense_indices.size() && dense_indices[d] < i;
+           ++d) {
+        r[dense_indices[d]] = static_cast<DistIntType>(
+            distance_sparse_dense(sparse[i], dense[d], reference,
+                                  reference_distances[d], max_dist));
+        ++n_pairs;
+      }
+    }
+    progress->add(n_pairs);
+  }
+}
+
+template <typename DistIntType>
+static void distances_mixed_impl(const std::vector<SparseData> &sparse,
+                                 const DenseData &dense,
+                                 const std::vector<std::size_t> &dense_indices,
+                                 DenseRow reference, DistIntType *result,
+                                 int max_dist) {
+  distances_mixed_rows(
+      sparse, dense, dense_indices, reference,
+      make_mixed_samples(sparse, dense, dense_indices, reference), result,
+      max_dist, {}, get_fastest_distances_func<DistIntType>());
+}
+
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint8_t *result, int max_dist) {
+  distances_mixed_impl(sparse, dense, dense_indices, reference, result,
+                       max_dist);
+}
+
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint16_t *result, int max_dist) {
+  distances_mixed_impl(sparse, dense, dense_indices, reference, result,
+                       max_dist);
+}
+
+void distances_mixed(const std::vector<SparseData> &sparse,
+                     const DenseData &dense,
+                     const std::vector<std::size_t> &dense_indices,
+                     DenseRow reference, std::uint32_t *result, int max_dist) {
+  distances_mixed_impl(sparse, dense, dense_indices, reference, result,
+                       max_dist);
+}
+
+std::vector<std::size_t>
+dense_sample_indices(const std::vector<SparseData> &sparse,
+                     std::size_t sample_length, bool include_x, bool use_gpu) {
+  std::vector<std::size_t> dense_indices;
+  constexpr double sparse_threshold{0.005};
+  auto max_sparse_size{static_cast<std::size_t>(
+      sparse_threshold * static_cast<double>(sample_length))};
+  for (std::size_t i = 0; i < sparse.size(); ++i) {
+    if (use_gpu || sparse[i].size() >= max_sparse_size) {
+      dense_indices.push_back(i);
+    }
+  }
+  // the mixed sparse x dense kernel does not support X, so if X is included
+  // then either all or none of the samples use the dense format
+  if (include_x && !dense_indices.empty()) {
+    dense_indices.resize(sparse.size());
+    std::iota(dense_indices.begin(), dense_indices.end(), std::size_t{0});
+  }
+  return dense_indices;
+}
+
+void distances_cpu_to_lower_triangular(Sequences &data,
+                                       const std::string &filename,
+                                       int max_distance,
+                                       std::size_t buffer_bytes) {
+  auto timing0 = std::chrono::high_resolution_clock::now();
+  auto max_dist{safe_int_cast<std::uint16_t>(max_distance)};
+  std::size_t nsamples{data.size()};
+  std::size_t sample_length{data.length(0)};
+  auto reference{get_reference_expression(data, false)};
+  auto sparse{to_sparse_data(data, reference, false)};
+  auto dense_indices{dense_sample_indices(sparse, sample_length, false, false)};
+  // the samples are encoded once, in the same format as in distances()
+  MixedSamples samples;
+  DenseData dense;
+  DenseData dense_reference;
+  distances_dense_func_ptr<std::uint16_t> distances_func{nullptr};
+  if (dense_indices.empty()) {
+    std::cout << "# hammingdist :: Using CPU with sparse distance function "
+                 "and inverted index..."
+              << std::endl;
+    samples.sparse_indices.resize(nsamples);
+    std::iota(samples.sparse_indices.begin(), samples.sparse_indices.end(),
+              std::size_t{0});
+    samples.sparse_index =
+        make_sparse_index(sparse, samples.sparse_indices, sample_length);
+  } else if (dense_indices.size() < nsamples) {
+    std::cout << "# hammingdist :: Using CPU with sparse distance function for "
+              << nsamples - dense_indices.size() << " and dense for "
+              << dense_indices.size() << " samples..." << std::endl;
+    dense = to_dense_data(data, dense_indices);
+    dense_reference = to_dense_data(std::vector<std::string>{reference});
+    samples =
+        make_mixed_samples(sparse, dense, dense_indices, dense_reference[0]);
+    distances_func = get_fastest_distances_func<std::uint16_t>();
+  } else {
+    sparse.clear();
+    dense = to_dense_data(data);
+    distances_func = get_fastest_distances_func<std::uint16_t>();
+  }
+  data.release();
+  auto calculate_rows = [&](std::uint16_t *result, RowRange rows) {
+    if (dense_indices.empty()) {
+      distances_inverted_index_rows(sparse, samples.sparse_indices,
+                                    samples.sparse_index, result, max_dist,
+                                    rows);
+    } else if (dense_indices.size() < nsamples) {
+      distances_mixed_rows(sparse, dense, dense_indices, dense_reference[0],
+                           samples, result, max_dist, rows, distances_func);
+    } else {
+      distances_func(dense, result, max_dist, nullptr, rows);
+    }
+  };
+  // each block holds at least one row of distances
+  std::size_t buffer_size{
+      std::max(buffer_bytes / sizeof(std::uint16_t), nsamples)};
+  std::vector<std::uint16_t> buffer;
+  auto &progress{Progress::current()};
+  // each distance is added to the progress once it is calculated, and again
+  // once it is written
+  progress.start(nsamples * (nsamples - 1));
+  if (nsamples < 2) {
+    // the matrix has no elements
+    partial_write_lower_triangular(filename, buffer, 0, 0);
+  }
+  std::size_t n_blocks{0};
+  // row 0 of the lower triangular matrix has no elements
+  for (std::size_t i_begin = 1; i_begin < nsamples; ++n_blocks) {
+    RowRange rows{i_begin, i_begin + 1};
+    while (rows.end < nsamples && rows.index(rows.end + 1, 0) <= buffer_size) {
+      ++rows.end;
+    }
+    // the rows of each block are calculated by all threads, and then
+    // formatted and written to the file by all threads
+    buffer.resize(rows.index(rows.end, 0));
+    calculate_rows(buffer.data(), rows);
+    progress.throw_if_cancelled();
+    partial_write_lower_triangular(filename, buffer,
+                                   rows.begin * (rows.begin - 1) / 2,
+                                   buffer.size());
+    i_begin = rows.end;
+  }
+  std::cout << "# hammingdist :: ...distance calculation completed in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::high_resolution_clock::now() - timing0)
+                   .count()
+            << " ms (" << n_blocks << " blocks)." << std::endl;
+}
+
+// encode str into the three planes of n_words BitPlaneWords starting at r
+static void encode_bitplane(std::string_view str,
+                            const std::array<std::uint8_t, 256> &lookup,
+                            BitPlaneWord *r, std::size_t n_words) {
+  auto *lo{r};
+  auto *hi{r + n_words};
+  auto *valid{r + 2 * n_words};
+  for (std::size_t i_word = 0; i_word * n_genes_per_word < str.size();
+       ++i_word) {
+    std::size_t i0{i_word * n_genes_per_word};
+    std::size_t n{std::min(n_genes_per_word, str.size() - i0)};
+    BitPlaneWord w_lo{0};
+    BitPlaneWord w_hi{0};
+    BitPlaneWord w_valid{0};
+    for (std::size_t i = 0; i < n; ++i) {
+      auto c{static_cast<BitPlaneWord>(
+          lookup[static_cast<unsigned char>(str[i0 + i])])};
+      w_lo |= (c & 1) << i;
+      w_hi |= ((c >> 1) & 1) << i;
+      w_valid |= ((c >> 2) & 1) << i;
+    }
+    lo[i_word] = w_lo;
+    hi[i_word] = w_hi;
+    valid[i_word] = w_valid;
+  }
+}
+
+// encode str into (str.size() + 1) / 2 GeneBlocks starting at r
+static void encode_dense(std::string_view str,
+                         const std::array<GeneBlock, 256> &lookup,
+                         GeneBlock *r) {
+  std::size_t n_full_blocks{str.size() / 2};
+  auto iter_str = str.cbegin();
+  for (std::size_t i_block = 0; i_block < n_full_blocks; ++i_block) {
+    *r = lookup[static_cast<unsigned char>(*iter_str)] & mask_gene0;
+    ++iter_str;
+    *r |= (lookup[static_cast<unsigned char>(*iter_str)] & mask_gene1);
+    ++iter_str;
+    ++r;
+  }
+  // pad last GeneBlock if odd number of chars
+  if (iter_str != str.cend()) {
+    *r = lookup[static_cast<unsigned char>(*iter_str)] & mask_gene0;
+    *r |= (lookup['-'] & mask_gene1);
+  }
+}
+
+// encode str into str.size() GeneBlocks starting at r, one gene per GeneBlock
+static void encode_dense_wide(std::string_view str,
+                              const std::array<GeneBlock, 256> &lookup,
+                              GeneBlock *r) {
+  for (auto c : str) {
+    *r = lookup[static_cast<unsigned char>(c)];
+    ++r;
+  }
+}
+
+std::string get_reference_expression(const Sequences &data,
+                                     bool include_x) {
   std::string g0;
-  std::size_t length{data[0].size()};
-  g0.reserve(length);
+  g0.reserve(data.length(0));
   std::array<std::size_t, 256> ctoi{0};
   ctoi[static_cast<std::size_t>('A')] = 1;
   ctoi[static_cast<std::size_t>('C')] = 2;
@@ -152,13 +959,7 @@ get_reference_expression(const std::vector<std::string> &data, bool include_x) {
   if (include_x) {
     ctoi[static_cast<std::size_t>('X')] = 5;
   }
-  std::vector<std::array<std::size_t, 6>> counts(length,
-                                                 std::array<std::size_t, 6>{});
-  for (const auto &g : data) {
-    for (std::size_t i = 0; i < g.size(); ++i) {
-      ++(counts[i][ctoi[g[i]]]);
-    }
-  }
+  auto counts{count_chars<6>(data, ctoi)};
   std::array<char, 6> itoc{'A', 'A', 'C', 'G', 'T', 'X'};
   for (const auto &count : counts) {
     g0.push_back(itoc[std::distance(
@@ -167,102 +968,130 @@ get_reference_expression(const std::vector<std::string> &data, bool include_x) {
   return g0;
 }
 
-std::vector<SparseData> to_sparse_data(const std::vector<std::string> &data,
+std::vector<SparseData> to_sparse_data(const Sequences &data,
                                        bool include_x) {
-  std::vector<SparseData> sparseData;
-  sparseData.reserve(data.size());
+  return to_sparse_data(data, get_reference_expression(data, include_x),
+                        include_x);
+}
+
+std::vector<SparseData> to_sparse_data(const Sequences &data,
+                                       const std::string &seq0,
+                                       bool include_x) {
+  if (data.length(0) > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::runtime_error("Error: Sequence too long for sparse format");
+  }
+  std::vector<SparseData> sparseData(data.size());
   auto lookup = lookupTable(include_x);
-  auto seq0 = get_reference_expression(data, include_x);
-  std::size_t count{0};
-  for (const auto &seq : data) {
-    sparseData.emplace_back();
-    auto &d = sparseData.back();
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(data, sparseData, lookup, seq0)
+#endif
+  for (std::size_t i_seq = 0; i_seq < data.size(); ++i_seq) {
+    std::string buffer;
+    auto seq{data.get(i_seq, buffer)};
+    auto &d = sparseData[i_seq];
     for (std::size_t i = 0; i < seq.size(); ++i) {
       if (seq0[i] != seq[i]) {
-        d.push_back(i);
-        d.push_back(lookup[seq[i]]);
+        auto c{lookup[static_cast<unsigned char>(seq[i])]};
+        d.positions.push_back(static_cast<std::uint32_t>(i));
+        d.codes.push_back(c);
+        d.n_nondash += static_cast<int>(c != 0xff);
       }
     }
   }
   return sparseData;
 }
 
-std::vector<std::vector<GeneBlock>>
-to_dense_data(const std::vector<std::string> &data) {
-  std::vector<std::vector<GeneBlock>> dense;
-  dense.reserve(data.size());
-  for (const auto &str : data) {
-    dense.push_back(from_string(str));
+DenseData to_dense_data(const Sequences &data,
+                        bool include_x) {
+  std::vector<std::size_t> indices(data.size());
+  std::iota(indices.begin(), indices.end(), std::size_t{0});
+  return to_dense_data(data, indices, include_x);
+}
+
+DenseData to_dense_data(const Sequences &data,
+                        const std::vector<std::size_t> &indices,
+                        bool include_x) {
+  DenseData dense(indices.size(), data.length(0), include_x);
+  auto lookup = include_x ? lookupTableWide() : lookupTable();
+  auto encode = include_x ? encode_dense_wide : encode_dense;
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none)                                         \
+    shared(data, indices, dense, lookup, encode)
+#endif
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    std::string buffer;
+    encode(data.get(indices[i], buffer), lookup, dense.row_data(i));
   }
   return dense;
 }
 
+BitPlaneData to_bitplane_data(const Sequences &data) {
+  BitPlaneData bitplanes(data.size(), data.length(0));
+  auto lookup = bitPlaneLookupTable();
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(data, bitplanes, lookup)
+#endif
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    std::string buffer;
+    encode_bitplane(data.get(i, buffer), lookup, bitplanes.row_data(i),
+                    bitplanes.words_per_plane());
+  }
+  return bitplanes;
+}
+
+BitPlaneData to_bitplane_data(const Sequences &data,
+                              const std::vector<std::size_t> &indices) {
+  BitPlaneData bitplanes(indices.size(), data.length(0));
+  auto lookup = bitPlaneLookupTable();
+#ifdef HAMMING_WITH_OPENMP
+#pragma omp parallel for default(none) shared(data, indices, bitplanes, lookup)
+#endif
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    std::string buffer;
+    encode_bitplane(data.get(indices[i], buffer), lookup, bitplanes.row_data(i),
+                    bitplanes.words_per_plane());
+  }
+  return bitplanes;
+}
+
 std::pair<std::vector<std::string>, std::vector<std::size_t>>
 read_fasta(const std::string &filename, bool remove_duplicates, std::size_t n) {
   std::pair<std::vector<std::string>, std::vector<std::size_t>>
       data_and_sequence_indices;
   auto &[data, sequence_indices] = data_and_sequence_indices;
-  data.reserve(n);
-  if (n == 0) {
-    n = std::numeric_limits<std::size_t>::max();
-    data.reserve(65536);
-  }
-  std::unordered_map<std::string, std::size_t> map_seq_to_index;
-  // Initializing the stream
-  std::ifstream stream(filename);
-  std::size_t count = 0;
-  std::size_t count_unique = 0;
-  std::string line;
-  // skip first header
-  std::getline(stream, line);
-  while (count < n && !stream.eof()) {
-    std::string seq{};
-    while (std::getline(stream, line) && line[0] != '>') {
-      seq.append(line);
-    }
-    if (remove_duplicates) {
-      auto result = map_seq_to_index.emplace(std::move(seq), count_unique);
-      if (result.second) {
-        ++count_unique;
-      }
-      sequence_indices.push_back(result.first->second);
-    } else {
-      data.push_back(std::move(seq));
-    }
-    ++count;
-  }
+  FastaFile fasta(filename, n);
   if (remove_duplicates) {
-    // copy each unique sequence to the vector of strings
-    data.resize(count_unique);
-    for (auto &key_value_pair : map_seq_to_index) {
-      data[key_value_pair.second] = key_value_pair.first;
-    }
+    std::vector<std::size_t> first_records;
+    sequence_indices = fasta.unique_sequence_indices(&first_records);
+    data = fasta.sequences(first_records);
+  } else {
+    data = fasta.sequences(0, fasta.size());
   }
   return data_and_sequence_indices;
 }
 
-std::vector<GeneBlock> from_string(const std::string &str) {
-  alignas(16) std::vector<GeneBlock> r;
-  auto lookup = lookupTable();
-  std::size_t n_full_blocks{str.size() / 2};
-  r.reserve(1 + n_full_blocks + 3);
-  auto iter_str = str.cbegin();
-  for (std::size_t i_block = 0; i_block < n_full_blocks; ++i_block) {
-    r.push_back(lookup[*iter_str] & mask_gene0);
-    ++iter_str;
-    r.back() |= (lookup[*iter_str] & mask_gene1);
-    ++iter_str;
-  }
-  // pad last GeneBlock if odd number of chars
-  if (iter_str != str.cend()) {
-    r.push_back(lookup[*iter_str] & mask_gene0);
-    r.back() |= (lookup['-'] & mask_gene1);
+std::vector<GeneBlock> from_string(const std::string &str, bool include_x) {
+  if (include_x) {
+    auto lookup = lookupTableWide();
+    // pad to ensure 64-bit alignment
+    std::vector<GeneBlock> r(8 * ((str.size() + 7) / 8), lookup['-']);
+    encode_dense_wide(str, lookup, r.data());
+    return r;
   }
+  auto lookup = lookupTable();
   // pad to ensure 64-bit alignment
-  while (8 * (r.size() / 8) != r.size()) {
-    r.push_back(lookup['-']);
-  }
+  std::size_t n_blocks{8 * ((str.size() + 15) / 16)};
+  std::vector<GeneBlock> r(n_blocks, lookup['-']);
+  encode_dense(str, lookup, r.data());
+  return r;
+}
 
+std::vector<BitPlaneWord> from_string_bitplane(const std::string &str) {
+  auto lookup = bitPlaneLookupTable();
+  // pad each plane to a multiple of 512 bits
+  std::size_t n_words{8 * ((str.size() + 511) / 512)};
+  std::vector<BitPlaneWord> r(3 * n_words, 0);
+  encode_bitplane(str, lookup, r.data(), n_words);
   return r;
 }
 
@@ -1,5 +1,7 @@
 #include "hamming/hamming_impl.hh"
 #include "tests.hh"
+#include <cstdio>
+#include <fstream>
 
 using namespace hamming;
 
@@ -46,6 +48,28 @@ TEST_CASE("distance_cpp() returns n for n A's and n G's", "[impl][distance]") {
   }
 }
 
+TEST_CASE("distance_cpp_1x4() returns same as distance_cpp() for random "
+          "vectors",
+          "[impl][distance]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 3, 15, 16, 17, 31, 32, 33, 255, 256, 257, 1024, 4097}) {
+    for (int max_dist : {0, 1, 2, 11, 999, 9876544}) {
+      CAPTURE(n);
+      CAPTURE(max_dist);
+      auto g1{make_gene_vector(n, gen)};
+      std::array<std::vector<GeneBlock>, n_partners> g2;
+      for (auto &g : g2) {
+        g = make_gene_vector(n, gen);
+      }
+      auto d{distance_cpp_1x4(g1, {g2[0], g2[1], g2[2], g2[3]}, max_dist)};
+      for (std::size_t k = 0; k < n_partners; ++k) {
+        CAPTURE(k);
+        REQUIRE(d[k] == distance_cpp(g1, g2[k], max_dist));
+      }
+    }
+  }
+}
+
 TEST_CASE("distance_sparse() returns zero for identical vectors of valid chars",
           "[impl][distance][sparse]") {
   std::mt19937 gen(12345);
@@ -65,7 +89,8 @@ TEST_CASE("distance_sparse() returns zero for identical vectors of valid chars",
       for (bool include_x : {false, true}) {
         auto g1{make_test_string(n, gen, include_x)};
         CAPTURE(include_x);
-        auto sparse = to_sparse_data({g1, g1}, include_x);
+        std::vector<std::string> seqs{g1, g1};
+        auto sparse = to_sparse_data(seqs, include_x);
         REQUIRE(distance_sparse(sparse[0], sparse[1], max_dist) == 0);
       }
     }
@@ -93,7 +118,8 @@ TEST_CASE("distance_sparse() returns n for n A's and n G's",
           auto g2 = std::string(n, c2);
           for (bool include_x : {false, true}) {
             CAPTURE(include_x);
-            auto sparse = to_sparse_data({g1, g2}, include_x);
+            std::vector<std::string> seqs{g1, g2};
+            auto sparse = to_sparse_data(seqs, include_x);
             REQUIRE(distance_sparse(sparse[0], sparse[1], max_dist) ==
                     std::min(max_dist, n));
           }
@@ -126,7 +152,8 @@ TEST_CASE("distance_sparse() returns same as distance_cpp() for random vectors "
       auto g2{from_string(s2)};
       for (bool include_x : {false, true}) {
         CAPTURE(include_x);
-        auto sparse = to_sparse_data({s1, s2}, include_x);
+        std::vector<std::string> seqs{s1, s2};
+        auto sparse = to_sparse_data(seqs, include_x);
         REQUIRE(distance_sparse(sparse[0], sparse[1], max_dist) ==
                 distance_cpp(g1, g2, max_dist));
       }
@@ -172,9 +199,642 @@ TEST_CASE("distance_sparse() returns same as distance_cpp() for equal-distance "
             c = 'X';
           }
         }
-        auto sparse = to_sparse_data({s1_x, s2_x}, true);
+        std::vector<std::string> seqs{s1_x, s2_x};
+        auto sparse = to_sparse_data(seqs, true);
         REQUIRE(distance_sparse(sparse[0], sparse[1], max_dist) == dist);
       }
     }
   }
 }
+
+TEST_CASE("distance_sparse() returns same as distance_cpp() for random vectors "
+          "with invalid chars",
+          "[impl][distance][sparse]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 3, 17, 64, 65, 1000, 4097, 29903}) {
+    for (int max_dist : {0, 1, 2, 11, 999, 9876544}) {
+      CAPTURE(n);
+      CAPTURE(max_dist);
+      // with include_x=false, X is an invalid char, which differs from
+      // everything including '-' and itself
+      auto s1{make_test_string(n, gen, true)};
+      auto s2{make_test_string(n, gen, true)};
+      auto sparse = to_sparse_data(std::vector<std::string>{s1, s2, s1}, false);
+      REQUIRE(distance_sparse(sparse[0], sparse[1], max_dist) ==
+              distance_cpp(from_string(s1), from_string(s2), max_dist));
+      REQUIRE(distance_sparse(sparse[0], sparse[2], max_dist) ==
+              distance_cpp(from_string(s1), from_string(s1), max_dist));
+    }
+  }
+}
+
+TEST_CASE("to_sparse_data() stores differences from the reference sequence",
+          "[impl][sparse]") {
+  std::vector<std::string> data{"ACGT-A", "ACGTTA", "ACXT-A", "TCGT-N"};
+  auto lookup{lookupTable()};
+  // reference sequence is "ACGTTA": '-' is never used in the reference
+  auto sparse{to_sparse_data(data, false)};
+  REQUIRE(sparse.size() == data.size());
+  REQUIRE(sparse[0].positions == std::vector<std::uint32_t>{4});
+  REQUIRE(sparse[0].codes == std::vector<GeneBlock>{lookup['-']});
+  REQUIRE(sparse[0].n_nondash == 0);
+  REQUIRE(sparse[1].positions.empty());
+  REQUIRE(sparse[1].codes.empty());
+  REQUIRE(sparse[1].n_nondash == 0);
+  REQUIRE(sparse[2].positions == std::vector<std::uint32_t>{2, 4});
+  REQUIRE(sparse[2].codes == std::vector<GeneBlock>{0, lookup['-']});
+  REQUIRE(sparse[2].n_nondash == 1);
+  REQUIRE(sparse[3].positions == std::vector<std::uint32_t>{0, 4, 5});
+  REQUIRE(sparse[3].codes ==
+          std::vector<GeneBlock>{lookup['T'], lookup['-'], 0});
+  REQUIRE(sparse[3].n_nondash == 2);
+}
+
+TEMPLATE_TEST_CASE("distances_inverted_index() returns same as "
+                   "distance_sparse() for all pairs",
+                   "[impl][distance][sparse]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 17, 1000, 29903}) {
+    for (std::size_t n_samples : {2, 3, 17, 100}) {
+      for (int n_diff : {0, 1, 10, 100}) {
+        for (bool include_x : {false, true}) {
+          for (int max_dist : {0, 1, 11, 255}) {
+            CAPTURE(n);
+            CAPTURE(n_samples);
+            CAPTURE(n_diff);
+            CAPTURE(include_x);
+            CAPTURE(max_dist);
+            // near-identical sequences with gaps, X's and invalid chars
+            auto s0{make_test_string(n, gen, true)};
+            std::vector<std::string> data(n_samples, s0);
+            std::uniform_int_distribution<> pos(0, n - 1);
+            for (auto &s : data) {
+              for (auto c : make_test_string(n_diff, gen, true)) {
+                s[pos(gen)] = c;
+              }
+              s[pos(gen)] = 'N';
+            }
+            auto sparse{to_sparse_data(data, include_x)};
+            std::vector<TestType> result(n_samples * (n_samples - 1) / 2, 0);
+            distances_inverted_index(sparse, n, result.data(), max_dist);
+            std::size_t k{0};
+            for (std::size_t i = 1; i < n_samples; ++i) {
+              for (std::size_t j = 0; j < i; ++j) {
+                REQUIRE(result[k] ==
+                        distance_sparse(sparse[i], sparse[j], max_dist));
+                ++k;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("distances_inverted_index() with indices only writes the pairs of "
+          "these samples",
+          "[impl][distance][sparse]") {
+  std::mt19937 gen(12345);
+  std::size_t n{1000};
+  std::size_t n_samples{20};
+  auto s0{make_test_string(static_cast<int>(n), gen, true)};
+  std::vector<std::string> data(n_samples, s0);
+  std::uniform_int_distribution<std::size_t> pos(0, n - 1);
+  for (auto &s : data) {
+    for (auto c : make_test_string(10, gen, true)) {
+      s[pos(gen)] = c;
+    }
+  }
+  auto sparse{to_sparse_data(data, false)};
+  std::vector<std::size_t> indices{0, 3, 4, 9, 17, 19};
+  std::vector<bool> in_subset(n_samples, false);
+  for (auto i : indices) {
+    in_subset[i] = true;
+  }
+  std::vector<std::uint16_t> result(n_samples * (n_samples - 1) / 2, 9999);
+  distances_inverted_index(sparse, n, result.data(), 255, indices);
+  std::size_t k{0};
+  for (std::size_t i = 1; i < n_samples; ++i) {
+    for (std::size_t j = 0; j < i; ++j) {
+      CAPTURE(i);
+      CAPTURE(j);
+      if (in_subset[i] && in_subset[j]) {
+        REQUIRE(result[k] == distance_sparse(sparse[i], sparse[j], 255));
+      } else {
+        REQUIRE(result[k] == 9999);
+      }
+      ++k;
+    }
+  }
+}
+
+TEST_CASE("distance_sparse_dense() returns same as distance_cpp() for random "
+          "vectors",
+          "[impl][distance][sparse]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 17, 128, 1000}) {
+    for (int n_diff : {0, 1, 10, 100}) {
+      for (int max_dist : {0, 1, 11, 9999}) {
+        CAPTURE(n);
+        CAPTURE(n_diff);
+        CAPTURE(max_dist);
+        // samples near a random reference, with gaps and invalid chars
+        std::vector<std::string> data(2, make_test_string(n, gen, true));
+        std::uniform_int_distribution<> pos(0, n - 1);
+        for (auto &s : data) {
+          for (auto c : make_test_string(n_diff, gen, true)) {
+            s[pos(gen)] = c;
+          }
+        }
+        auto reference{get_reference_expression(data, false)};
+        auto sparse{to_sparse_data(data, reference, false)};
+        auto dense{to_dense_data(data)};
+        std::vector<std::string> seqs{reference};
+        auto dense_reference{to_dense_data(seqs)};
+        int reference_distance{distance_cpp(dense_reference[0], dense[1])};
+        REQUIRE(distance_sparse_dense(sparse[0], dense[1], dense_reference[0],
+                                      reference_distance, max_dist) ==
+                distance_cpp(dense[0], dense[1], max_dist));
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("distances() with sparse and dense samples matches pairwise "
+                   "distance_cpp()",
+                   "[impl][distance][sparse]", uint8_t, uint16_t, uint32_t) {
+  std::mt19937 gen(12345);
+  for (int n : {200, 1000, 3000}) {
+    for (std::size_t n_samples : {2, 3, 17, 100}) {
+      for (std::size_t n_dense : {1, 2, 7}) {
+        for (int max_dist : {0, 1, 11, 9999}) {
+          CAPTURE(n);
+          CAPTURE(n_samples);
+          CAPTURE(n_dense);
+          CAPTURE(max_dist);
+          // near-identical sequences without gaps, so that they are sparse,
+          // plus some divergent outliers
+          std::string s0(static_cast<std::size_t>(n), 'A');
+          std::uniform_int_distribution<> gene(0, 3);
+          for (auto &c : s0) {
+            c = "ACGT"[gene(gen)];
+          }
+          std::vector<std::string> data(n_samples, s0);
+          std::uniform_int_distribution<> pos(0, n - 1);
+          std::uniform_int_distribution<std::size_t> sample(0, n_samples - 1);
+          for (auto &s : data) {
+            s[pos(gen)] = 'A';
+          }
+          for (std::size_t i = 0; i < n_dense; ++i) {
+            data[sample(gen)] = make_test_string(n, gen);
+          }
+          auto d{distances<TestType>(data, false, false, false, max_dist)};
+          REQUIRE(d.size() == n_samples * (n_samples - 1) / 2);
+          std::size_t k{0};
+          for (std::size_t i = 0; i < n_samples; ++i) {
+            for (std::size_t j = 0; j < i; ++j) {
+              REQUIRE(d[k++] == safe_int_cast<TestType>(distance_cpp(
+                                    from_string(data[i]),
+                                    from_string(data[j]), max_dist)));
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("make_lower_bound_pruning() only skips pairs with distance at least "
+          "max_dist",
+          "[impl][distance][pruning]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 17, 500}) {
+    for (std::size_t n_samples : {2, 3, 50}) {
+      for (int max_dist : {0, 1, 7, 50}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(max_dist);
+        // samples with increasingly many gaps, X's and invalid chars
+        auto s0{make_test_string(n, gen)};
+        std::vector<std::string> data(n_samples, s0);
+        std::uniform_int_distribution<> pos(0, n - 1);
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          for (auto c : make_test_string(static_cast<int>(i) * n / 20 + 1, gen,
+                                         true)) {
+            data[i][pos(gen)] = c;
+          }
+        }
+        auto pruning{make_lower_bound_pruning(data, max_dist)};
+        REQUIRE(pruning.order.size() == n_samples);
+        REQUIRE(pruning.first_col.size() == n_samples);
+        std::size_t n_pruned{0};
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          REQUIRE(pruning.first_col[i] <= i);
+          n_pruned += pruning.first_col[i];
+          for (std::size_t j = 0; j < pruning.first_col[i]; ++j) {
+            REQUIRE(distance_cpp(from_string(data[pruning.order[i]]),
+                                 from_string(data[pruning.order[j]])) >=
+                    max_dist);
+          }
+        }
+        REQUIRE(n_pruned == pruning.n_pruned);
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("distances() with lower bound pruning matches pairwise "
+                   "distance_cpp()",
+                   "[impl][distance][pruning]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  for (int n : {100, 1000}) {
+    for (std::size_t n_samples : {2, 3, 17, 300}) {
+      for (int max_dist : {0, 1, 5, 30}) {
+        for (auto encoding : {DenseEncoding::OneHot, DenseEncoding::BitPlane}) {
+          CAPTURE(n);
+          CAPTURE(n_samples);
+          CAPTURE(max_dist);
+          // samples with widely varying numbers of differences from s0
+          auto s0{make_test_string(n, gen)};
+          std::vector<std::string> data(n_samples, s0);
+          std::uniform_int_distribution<> pos(0, n - 1);
+          std::uniform_int_distribution<> n_diff(1, n / 4);
+          for (auto &s : data) {
+            for (auto c : make_test_string(n_diff(gen), gen, true)) {
+              s[pos(gen)] = c;
+            }
+          }
+          auto d{distances<TestType>(data, false, false, false, max_dist,
+                                     encoding)};
+          REQUIRE(d.size() == n_samples * (n_samples - 1) / 2);
+          std::size_t k{0};
+          for (std::size_t i = 0; i < n_samples; ++i) {
+            for (std::size_t j = 0; j < i; ++j) {
+              REQUIRE(d[k++] == safe_int_cast<TestType>(distance_cpp(
+                                    from_string(data[i]),
+                                    from_string(data[j]), max_dist)));
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("lower triangular tiles cover each distance element exactly once",
+          "[impl][tiles]") {
+  for (std::size_t nsamples : {1, 2, 3, 7, 8, 9, 31, 64, 65, 257, 1000}) {
+    for (std::size_t tile_size : {1, 2, 3, 8, 13, 64, 256}) {
+      CAPTURE(nsamples);
+      CAPTURE(tile_size);
+      std::vector<int> counts(nsamples * (nsamples - 1) / 2, 0);
+      auto n_tiles{lower_triangular_tile_count(nsamples, tile_size)};
+      for (std::size_t t = 0; t < n_tiles; ++t) {
+        auto tile{lower_triangular_tile(t, nsamples, tile_size)};
+        REQUIRE(tile.i_begin < tile.i_end);
+        REQUIRE(tile.i_end <= nsamples);
+        REQUIRE(tile.j_begin < tile.j_end);
+        REQUIRE(tile.j_begin <= tile.i_begin);
+        REQUIRE(tile.i_end - tile.i_begin <= tile_size);
+        REQUIRE(tile.j_end - tile.j_begin <= tile_size);
+        for (std::size_t i = tile.i_begin; i < tile.i_end; ++i) {
+          for (std::size_t j = tile.j_begin; j < std::min(tile.j_end, i);
+               ++j) {
+            ++counts[i * (i - 1) / 2 + j];
+          }
+        }
+      }
+      for (auto count : counts) {
+        REQUIRE(count == 1);
+      }
+    }
+  }
+}
+
+TEST_CASE("lower_triangular_tile() is consistent for large tile indices",
+          "[impl][tiles]") {
+  constexpr std::size_t nsamples{10000000};
+  for (std::size_t bi : {1000, 99999, 123456, 999999}) {
+    for (std::size_t bj : {std::size_t{0}, bi / 2, bi}) {
+      auto tile{lower_triangular_tile(bi * (bi + 1) / 2 + bj, nsamples, 10)};
+      REQUIRE(tile.i_begin == bi * 10);
+      REQUIRE(tile.j_begin == bj * 10);
+    }
+  }
+}
+
+TEST_CASE("lower_triangular_tile_size() is within limits", "[impl][tiles]") {
+  for (std::size_t bytes : {0, 1, 8, 100, 1024, 15000, 1000000}) {
+    CAPTURE(bytes);
+    auto tile_size{lower_triangular_tile_size(bytes)};
+    REQUIRE(tile_size >= 8);
+    REQUIRE(tile_size <= 256);
+  }
+}
+
+TEMPLATE_TEST_CASE("distances() matches pairwise distance_cpp() for all tiles",
+                   "[impl][tiles]", uint8_t, uint16_t, uint32_t) {
+  std::mt19937 gen(12345);
+  for (int n : {1, 17, 500, 1023}) {
+    for (std::size_t n_samples : {2, 3, 9, 300, 600}) {
+      for (int max_dist : {1, 7, 9999}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(max_dist);
+        std::vector<std::string> data;
+        data.reserve(n_samples);
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          data.push_back(make_test_string(n, gen));
+        }
+        auto d{distances<TestType>(data, false, false, false, max_dist)};
+        REQUIRE(d.size() == n_samples * (n_samples - 1) / 2);
+        std::size_t k{0};
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          for (std::size_t j = 0; j < i; ++j) {
+            REQUIRE(d[k++] == safe_int_cast<TestType>(distance_cpp(
+                                  from_string(data[i]), from_string(data[j]),
+                                  max_dist)));
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("distances_cpu_to_lower_triangular() matches write_lower_triangular()"
+          " of distances() for any buffer size",
+          "[impl][tiles]") {
+  std::mt19937 gen(12345);
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  char tmp_ref_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_ref_file_name) != nullptr);
+  auto read_file = [](const std::string &filename) {
+    std::ifstream stream(filename);
+    return std::string(std::istreambuf_iterator<char>(stream),
+                       std::istreambuf_iterator<char>());
+  };
+  for (std::size_t n_samples : {1, 2, 3, 9, 300, 601}) {
+    // all dense, all sparse, or sparse with a few dense outliers
+    for (std::size_t n_dense : {n_samples, std::size_t{0}, std::size_t{2}}) {
+      // a reference without gaps, so that the other samples are sparse
+      std::string s0(1000, 'A');
+      std::uniform_int_distribution<> gene(0, 3);
+      for (auto &c : s0) {
+        c = "ACGT"[gene(gen)];
+      }
+      std::vector<std::string> data(n_samples, s0);
+      std::uniform_int_distribution<> pos(0, 999);
+      for (auto &s : data) {
+        s[pos(gen)] = 'A';
+      }
+      for (std::size_t i = 0; i < std::min(n_dense, n_samples); ++i) {
+        data[i * n_samples / std::max(n_dense, std::size_t{1})] =
+            make_test_string(1000, gen);
+      }
+      for (int max_dist : {1, 9999999}) {
+        write_lower_triangular(
+            tmp_ref_file_name,
+            distances<uint16_t>(data, false, false, false, max_dist));
+        auto ref{read_file(tmp_ref_file_name)};
+        for (std::size_t buffer_bytes : {0, 64, 1000, 100000, 1 << 30}) {
+          CAPTURE(n_samples);
+          CAPTURE(n_dense);
+          CAPTURE(max_dist);
+          CAPTURE(buffer_bytes);
+          Sequences sequences(data, false);
+          distances_cpu_to_lower_triangular(sequences, tmp_file_name, max_dist,
+                                            buffer_bytes);
+          REQUIRE(read_file(tmp_file_name) == ref);
+        }
+      }
+    }
+  }
+  std::remove(tmp_file_name);
+  std::remove(tmp_ref_file_name);
+}
+
+TEST_CASE("to_dense_data() rows are aligned and match from_string()",
+          "[impl][dense]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 3, 127, 128, 129, 255, 256, 257, 1000, 29903}) {
+    for (std::size_t n_samples : {1, 2, 5, 17}) {
+      CAPTURE(n);
+      CAPTURE(n_samples);
+      std::vector<std::string> data;
+      for (std::size_t i = 0; i < n_samples; ++i) {
+        data.push_back(make_test_string(n, gen));
+      }
+      auto dense{to_dense_data(data)};
+      REQUIRE(dense.size() == n_samples);
+      REQUIRE(dense.sample_length() == static_cast<std::size_t>(n));
+      REQUIRE(dense.stride() % dense_alignment == 0);
+      REQUIRE(2 * dense.stride() >= static_cast<std::size_t>(n));
+      for (std::size_t i = 0; i < n_samples; ++i) {
+        auto row{dense[i]};
+        REQUIRE(reinterpret_cast<std::uintptr_t>(row.data()) %
+                    dense_alignment ==
+                0);
+        REQUIRE(row.size() == dense.stride());
+        auto g{from_string(data[i])};
+        for (std::size_t k = 0; k < g.size(); ++k) {
+          REQUIRE(row[k] == g[k]);
+        }
+        // padding is '-' which never contributes to the distance
+        for (std::size_t k = g.size(); k < row.size(); ++k) {
+          REQUIRE(row[k] == 0xff);
+        }
+        for (std::size_t j = 0; j < n_samples; ++j) {
+          REQUIRE(distance_cpp(dense[i], dense[j]) ==
+                  distance_cpp(g, from_string(data[j])));
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("distance_cpp_bitplane() returns same as distance_cpp() for random "
+          "vectors",
+          "[impl][distance][bitplane]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 3, 63, 64, 65, 511, 512, 513, 1000, 4097, 29903}) {
+    for (int max_dist : {0, 1, 2, 11, 999, 9876544}) {
+      // include_x = true: 'X' is then an invalid character for both encodings
+      for (bool include_x : {false, true}) {
+        CAPTURE(n);
+        CAPTURE(max_dist);
+        CAPTURE(include_x);
+        auto s1{make_test_string(n, gen, include_x)};
+        auto s2{make_test_string(n, gen, include_x)};
+        auto b1{from_string_bitplane(s1)};
+        auto b2{from_string_bitplane(s2)};
+        REQUIRE(distance_cpp_bitplane(b1, b1, max_dist) ==
+                distance_cpp(from_string(s1), from_string(s1), max_dist));
+        REQUIRE(distance_cpp_bitplane(b1, b2, max_dist) ==
+                distance_cpp(from_string(s1), from_string(s2), max_dist));
+      }
+    }
+  }
+}
+
+TEST_CASE("to_bitplane_data() rows are aligned and match "
+          "from_string_bitplane()",
+          "[impl][bitplane]") {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 63, 64, 65, 511, 512, 513, 1000}) {
+    for (std::size_t n_samples : {1, 2, 5, 17}) {
+      CAPTURE(n);
+      CAPTURE(n_samples);
+      std::vector<std::string> data;
+      for (std::size_t i = 0; i < n_samples; ++i) {
+        data.push_back(make_test_string(n, gen, true));
+      }
+      auto bitplanes{to_bitplane_data(data)};
+      REQUIRE(bitplanes.size() == n_samples);
+      REQUIRE(bitplanes.sample_length() == static_cast<std::size_t>(n));
+      REQUIRE((bitplanes.words_per_plane() * sizeof(BitPlaneWord)) %
+                  dense_alignment ==
+              0);
+      REQUIRE(bitplanes.words_per_plane() * n_genes_per_word >=
+              static_cast<std::size_t>(n));
+      for (std::size_t i = 0; i < n_samples; ++i) {
+        auto row{bitplanes[i]};
+        REQUIRE(reinterpret_cast<std::uintptr_t>(row.lo()) % dense_alignment ==
+                0);
+        REQUIRE(row.size() == bitplanes.words_per_plane());
+        auto b{from_string_bitplane(data[i])};
+        REQUIRE(b.size() == bitplanes.stride());
+        REQUIRE(std::equal(b.cbegin(), b.cend(), row.lo()));
+        for (std::size_t j = 0; j < n_samples; ++j) {
+          REQUIRE(distance_cpp_bitplane(bitplanes[i], bitplanes[j]) ==
+                  distance_cpp(from_string(data[i]), from_string(data[j])));
+        }
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("distances() with bit-plane encoding matches one-hot "
+                   "encoding",
+                   "[impl][distance][bitplane]", uint8_t, uint16_t, uint32_t) {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 65, 513, 1000}) {
+    for (std::size_t n_samples : {2, 3, 17, 100}) {
+      for (int max_dist : {0, 1, 11, 999}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(max_dist);
+        std::vector<std::string> data;
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          data.push_back(make_test_string(n, gen, true));
+        }
+        auto d_onehot{distances<TestType>(data, false, false, false, max_dist,
+                                          DenseEncoding::OneHot)};
+        auto d_bitplane{distances<TestType>(data, false, false, false,
+                                            max_dist, DenseEncoding::BitPlane)};
+        REQUIRE(d_onehot == d_bitplane);
+      }
+    }
+  }
+}
+
+TEST_CASE("distance_cpp() with include_x encoding returns same as distance()",
+          "[impl][distance]") {
+  std::string chars{"ACGT-XN"};
+  for (char c1 : chars) {
+    for (char c2 : chars) {
+      CAPTURE(c1);
+      CAPTURE(c2);
+      std::string s1{c1};
+      std::string s2{c2};
+      REQUIRE(distance_cpp(from_string(s1, true), from_string(s2, true)) ==
+              static_cast<int>(distance(s1, s2, true)));
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("distances() with include_x matches pairwise distance()",
+                   "[impl][distance]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  for (int n : {1, 2, 65, 513, 1000}) {
+    for (std::size_t n_samples : {2, 3, 17, 100}) {
+      for (int max_dist : {0, 1, 11, 999}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(max_dist);
+        std::vector<std::string> data;
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          data.push_back(make_test_string(n, gen, true));
+        }
+        data[0][0] = 'N';
+        auto d{distances<TestType>(data, true, false, false, max_dist)};
+        std::size_t k{0};
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          for (std::size_t j = 0; j < i; ++j) {
+            REQUIRE(d[k++] == safe_int_cast<TestType>(std::min(
+                                  static_cast<int>(
+                                      distance(data[i], data[j], true)),
+                                  max_dist)));
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("encoding the Sequences of a fasta file matches encoding strings",
+          "[impl]") {
+  std::mt19937 gen(12345);
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  for (int n : {1, 64, 1000}) {
+    for (bool include_x : {false, true}) {
+      CAPTURE(n);
+      CAPTURE(include_x);
+      // a mix of single-line and multi-line records
+      std::vector<std::string> data;
+      std::ofstream stream(tmp_file_name);
+      for (std::size_t i = 0; i < 100; ++i) {
+        data.push_back(make_test_string(n, gen, include_x));
+        stream << ">seq" << i << "\n";
+        std::size_t line_length{i % 2 == 0 ? data[i].size() : 7};
+        for (std::size_t j = 0; j < data[i].size(); j += line_length) {
+          stream << data[i].substr(j, line_length) << "\n";
+        }
+      }
+      stream.close();
+      FastaFile fasta(tmp_file_name);
+      Sequences sequences(fasta);
+      validate_data(sequences);
+      auto reference{get_reference_expression(data, include_x)};
+      REQUIRE(get_reference_expression(sequences, include_x) == reference);
+      auto sparse{to_sparse_data(data, reference, include_x)};
+      auto sparse_fasta{to_sparse_data(sequences, reference, include_x)};
+      REQUIRE(sparse_fasta.size() == sparse.size());
+      for (std::size_t i = 0; i < sparse.size(); ++i) {
+        REQUIRE(sparse_fasta[i].positions == sparse[i].positions);
+        REQUIRE(sparse_fasta[i].codes == sparse[i].codes);
+      }
+      auto dense{to_dense_data(data, include_x)};
+      auto dense_fasta{to_dense_data(sequences, include_x)};
+      std::size_t n_blocks{dense.size() * dense.stride()};
+      REQUIRE(std::equal(dense.data(), dense.data() + n_blocks,
+                         dense_fasta.data()));
+      auto pruning{make_lower_bound_pruning(data, 5)};
+      auto pruning_fasta{make_lower_bound_pruning(sequences, 5)};
+      REQUIRE(pruning_fasta.order == pruning.order);
+      REQUIRE(pruning_fasta.first_col == pruning.first_col);
+      if (!include_x) {
+        auto bitplanes{to_bitplane_data(data)};
+        auto bitplanes_fasta{to_bitplane_data(sequences)};
+        std::size_t n_words{bitplanes.size() * bitplanes.stride()};
+        REQUIRE(std::equal(bitplanes.data(), bitplanes.data() + n_words,
+                           bitplanes_fasta.data()));
+      }
+      auto d{distances<uint16_t>(data, include_x, false, false, 7)};
+      REQUIRE(distances<uint16_t>(sequences, include_x, false, 7) == d);
+    }
+  }
+  std::remove(tmp_file_name);
+}
@@ -0,0 +1,249 @@
+#include "hamming/hamming_mapped_file.hh"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hamming {
+
+static std::runtime_error open_error(const std::string &filename) {
+  return std::runtime_error("Error: Failed to open file '" + filename + "'");
+}
+
+#ifdef _WIN32
+
+// map the file, which is already open, with the given mode
+static char *map_file(void *file_handle, void *&mapping_handle,
+                      std::size_t size, MapMode mode) {
+  DWORD protect{PAGE_READONLY};
+  DWORD access{FILE_MAP_READ};
+  if (mode == MapMode::CopyOnWrite) {
+    protect = PAGE_WRITECOPY;
+    access = FILE_MAP_COPY;
+  } else if (mode == MapMode::ReadWrite) {
+    protect = PAGE_READWRITE;
+    access = FILE_MAP_WRITE;
+  }
+  auto size64{static_cast<std::uint64_t>(size)};
+  mapping_handle = CreateFileMappingA(file_handle, nullptr, protect,
+                                      static_cast<DWORD>(size64 >> 32),
+                                      static_cast<DWORD>(size64), nullptr);
+  if (mapping_handle == nullptr) {
+    return nullptr;
+  }
+  return static_cast<char *>(MapViewOfFile(mapping_handle, access, 0, 0, 0));
+}
+
+static void *open_file(const std::string &filename, MapMode mode,
+                       bool create) {
+  DWORD access{mode == MapMode::ReadWrite ? GENERIC_READ | GENERIC_WRITE
+                                          : GENERIC_READ};
+  DWORD flags{mode == MapMode::SequentialRead ? FILE_FLAG_SEQUENTIAL_SCAN
+                                              : FILE_FLAG_RANDOM_ACCESS};
+  HANDLE handle{CreateFileA(filename.c_str(), access, FILE_SHARE_READ,
+                            nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING,
+                            flags, nullptr)};
+  return handle == INVALID_HANDLE_VALUE ? nullptr : handle;
+}
+
+MappedFile::MappedFile(const std::string &filename, MapMode mode) {
+  file_handle_ = open_file(filename, mode, false);
+  if (file_handle_ == nullptr) {
+    throw open_error(filename);
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_handle_, &size)) {
+    CloseHandle(file_handle_);
+    throw open_error(filename);
+  }
+  size_ = static_cast<std::size_t>(size.QuadPart);
+  if (size_ == 0) {
+    // an empty file cannot be mapped
+    return;
+  }
+  data_ = map_file(file_handle_, mapping_handle_, size_, mode);
+  if (data_ == nullptr) {
+    if (mapping_handle_ != nullptr) {
+      CloseHandle(mapping_handle_);
+    }
+    CloseHandle(file_handle_);
+    throw open_error(filename);
+  }
+}
+
+MappedFile::MappedFile(const std::string &filename, std::size_t size)
+    : size_{size} {
+  file_handle_ = open_file(filename, MapMode::ReadWrite, true);
+  if (file_handle_ == nullptr) {
+    throw open_error(filename);
+  }
+  if (size_ == 0) {
+    return;
+  }
+  // mapping a new file extends it to the size of the mapping
+  data_ = map_file(file_handle_, mapping_handle_, size_, MapMode::ReadWrite);
+  if (data_ == nullptr) {
+    if (mapping_handle_ != nullptr) {
+      CloseHandle(mapping_handle_);
+    }
+    CloseHandle(file_handle_);
+    throw open_error(filename);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_handle_ != nullptr) {
+    CloseHandle(mapping_handle_);
+  }
+  if (file_handle_ != nullptr) {
+    CloseHandle(file_handle_);
+  }
+}
+
+void MappedFile::flush() {
+  if (data_ != nullptr) {
+    FlushViewOfFile(data_, 0);
+    FlushFileBuffers(file_handle_);
+  }
+}
+
+#else
+
+// map the file, which is open as fd, with the given mode
+static char *map_file(int fd, std::size_t size, MapMode mode) {
+  int protect{mode == MapMode::SequentialRead ? PROT_READ
+                                              : PROT_READ | PROT_WRITE};
+  int flags{mode == MapMode::ReadWrite ? MAP_SHARED : MAP_PRIVATE};
+  void *addr{mmap(nullptr, size, protect, flags, fd, 0)};
+  // the mapping remains valid after the file is closed
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  if (mode == MapMode::SequentialRead) {
+    // each thread reads its own part of the file from start to end
+    madvise(addr, size, MADV_SEQUENTIAL);
+  }
+  return static_cast<char *>(addr);
+}
+
+MappedFile::MappedFile(const std::string &filename, MapMode mode) {
+  int fd{open(filename.c_str(),
+              mode == MapMode::ReadWrite ? O_RDWR : O_RDONLY)};
+  if (fd < 0) {
+    throw open_error(filename);
+  }
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    throw open_error(filename);
+  }
+  size_ = static_cast<std::size_t>(file_stat.st_size);
+  if (size_ == 0) {
+    // an empty file cannot be mapped
+    close(fd);
+    return;
+  }
+  data_ = map_file(fd, size_, mode);
+  if (data_ == nullptr) {
+    throw open_error(filename);
+  }
+}
+
+MappedFile::MappedFile(const std::string &filename, std::size_t size)
+    : size_{size} {
+  int fd{open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)};
+  if (fd < 0) {
+    throw open_error(filename);
+  }
+  // the file is extended with zeros, without writing them to disk
+  if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+    close(fd);
+    throw open_error(filename);
+  }
+  if (size_ == 0) {
+    close(fd);
+    return;
+  }
+  data_ = map_file(fd, size_, MapMode::ReadWrite);
+  if (data_ == nullptr) {
+    throw open_error(filename);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+}
+
+void MappedFile::flush() {
+  if (data_ != nullptr) {
+    msync(data_, size_, MS_SYNC);
+  }
+}
+
+#endif
+
+TemporaryFile::TemporaryFile(const std::string &directory) {
+  auto path{directory.empty() ? std::filesystem::temp_directory_path()
+                              : std::filesystem::path(directory)};
+#ifdef _WIN32
+  std::random_device random;
+  // a new name is tried if a file with this name already exists
+  constexpr int max_attempts{100};
+  for (int attempt = 0; attempt < max_attempts; ++attempt) {
+    auto id{(std::uint64_t{random()} << 32) ^ std::uint64_t{random()} ^
+            static_cast<std::uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count())};
+    auto name{(path / ("hammingdist-" + std::to_string(id) + ".tmp")).string()};
+    HANDLE handle{CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                              nullptr, CREATE_NEW, FILE_ATTRIBUTE_TEMPORARY,
+                              nullptr)};
+    if (handle != INVALID_HANDLE_VALUE) {
+      CloseHandle(handle);
+      name_ = std::move(name);
+      return;
+    }
+    if (GetLastError() != ERROR_FILE_EXISTS) {
+      break;
+    }
+  }
+  throw std::runtime_error("Error: Failed to create a temporary file in '" +
+                           path.string() + "'");
+#else
+  // mkstemp creates the file with O_EXCL and mode 0600
+  auto name{(path / "hammingdist-XXXXXX").string()};
+  int fd{mkstemp(name.data())};
+  if (fd < 0) {
+    throw std::runtime_error("Error: Failed to create a temporary file in '" +
+                             path.string() + "'");
+  }
+  close(fd);
+  name_ = std::move(name);
+#endif
+}
+
+TemporaryFile::~TemporaryFile() { std::remove(name_.c_str()); }
+
+} // namespace hamming
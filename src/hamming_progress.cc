@@ -0,0 +1,51 @@
+#include "hamming/hamming_progress.hh"
+
+namespace hamming {
+
+static thread_local Progress *current_progress{nullptr};
+
+Progress::Progress(ProgressCallback callback,
+                   std::chrono::milliseconds interval)
+    : callback_{std::move(callback)}, interval_{interval},
+      owner_{std::this_thread::get_id()},
+      last_call_{std::chrono::steady_clock::now()} {}
+
+Progress &Progress::current() {
+  static Progress no_progress;
+  return current_progress == nullptr ? no_progress : *current_progress;
+}
+
+void Progress::start(std::size_t total) {
+  if (!callback_ || std::this_thread::get_id() != owner_) {
+    return;
+  }
+  done_ = 0;
+  total_ = total;
+}
+
+void Progress::add(std::size_t n) {
+  if (!callback_) {
+    return;
+  }
+  done_ += n;
+  if (std::this_thread::get_id() != owner_) {
+    return;
+  }
+  auto now{std::chrono::steady_clock::now()};
+  if (now - last_call_ < interval_) {
+    return;
+  }
+  last_call_ = now;
+  if (!callback_(done_, total_)) {
+    cancelled_ = true;
+  }
+}
+
+ProgressScope::ProgressScope(Progress &progress)
+    : previous_{current_progress} {
+  current_progress = &progress;
+}
+
+ProgressScope::~ProgressScope() { current_progress = previous_; }
+
+} // namespace hamming
@@ -1,8 +1,13 @@
 #include "hamming/hamming.hh"
 #include "tests.hh"
+#include <chrono>
 #include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <limits>
+#include <sstream>
 #include <string>
+#include <utility>
 
 using namespace hamming;
 
@@ -343,6 +348,284 @@ TEMPLATE_TEST_CASE("from_lower_triangular reproduces correct data", "[hamming]",
   std::remove(tmp_file_name);
 }
 
+TEMPLATE_TEST_CASE("from_csv and from_lower_triangular reproduce the "
+                   "distances of large files",
+                   "[hamming]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<int> value_dist(
+      0, std::numeric_limits<TestType>::max());
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  for (std::size_t nsamples : {1, 2, 3, 1000, 2500}) {
+    CAPTURE(nsamples);
+    std::vector<TestType> distances((nsamples - 1) * nsamples / 2);
+    for (auto &d : distances) {
+      d = static_cast<TestType>(value_dist(gen));
+    }
+    DataSet<TestType> ref(std::move(distances));
+    REQUIRE(ref.nsamples == nsamples);
+    ref.dump_lower_triangular(tmp_file_name);
+    auto lt{from_lower_triangular<TestType>(tmp_file_name)};
+    REQUIRE(lt.nsamples == nsamples);
+    REQUIRE(lt.result == ref.result);
+    ref.dump(tmp_file_name);
+    DataSet<TestType> csv(tmp_file_name);
+    REQUIRE(csv.nsamples == nsamples);
+    REQUIRE(csv.result == ref.result);
+  }
+  std::remove(tmp_file_name);
+}
+
+TEMPLATE_TEST_CASE("dump writes the full distances matrix", "[hamming]",
+                   uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<int> value_dist(
+      0, std::numeric_limits<TestType>::max());
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  for (std::size_t nsamples : {1, 2, 3, 64, 65, 500, 3001}) {
+    CAPTURE(nsamples);
+    std::vector<TestType> distances((nsamples - 1) * nsamples / 2);
+    for (auto &d : distances) {
+      d = static_cast<TestType>(value_dist(gen));
+    }
+    DataSet<TestType> data(std::move(distances));
+    std::string ref;
+    for (std::size_t i = 0; i < nsamples; ++i) {
+      for (std::size_t j = 0; j < nsamples; ++j) {
+        ref.append(std::to_string(data[{i, j}]));
+        ref.append(j + 1 < nsamples ? ", " : "\n");
+      }
+    }
+    data.dump(tmp_file_name);
+    std::ifstream stream(tmp_file_name);
+    REQUIRE(std::string(std::istreambuf_iterator<char>(stream),
+                        std::istreambuf_iterator<char>()) == ref);
+  }
+  std::remove(tmp_file_name);
+}
+
+TEST_CASE("from_lower_triangular of invalid files", "[hamming]") {
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  auto write_file = [&tmp_file_name](const std::string &contents) {
+    std::ofstream stream(tmp_file_name, std::ios::binary);
+    stream << contents;
+  };
+  // windows line endings, no final newline and saturating values are allowed
+  write_file("1\r\n2,300\r\n3,4,5");
+  auto data{from_lower_triangular<uint8_t>(tmp_file_name)};
+  REQUIRE(data.nsamples == 4);
+  std::vector<uint8_t> expected{1, 2, 255, 3, 4, 5};
+  REQUIRE(std::equal(data.result.begin(), data.result.end(), expected.begin(),
+                     expected.end()));
+  for (const auto &contents :
+       {"1\n2\n", "1\n2,3,4\n", "1\n2,x\n", "1\n\n", "1\n-2,3\n"}) {
+    CAPTURE(contents);
+    write_file(contents);
+    REQUIRE_THROWS(from_lower_triangular<uint8_t>(tmp_file_name));
+  }
+  std::remove(tmp_file_name);
+  REQUIRE_THROWS(from_lower_triangular<uint8_t>(tmp_file_name));
+}
+
+TEMPLATE_TEST_CASE("partial_write_lower_triangular output is independent of "
+                   "the partial writes",
+                   "[hamming]", uint8_t, uint16_t, int) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<int> value_dist(
+      0, static_cast<int>(std::numeric_limits<TestType>::max() >> 2));
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  auto read_file = [](const std::string &filename) {
+    std::ifstream stream(filename);
+    return std::string(std::istreambuf_iterator<char>(stream),
+                       std::istreambuf_iterator<char>());
+  };
+  for (std::size_t nsamples : {2, 3, 4, 17, 1500, 2000}) {
+    std::vector<TestType> distances((nsamples - 1) * nsamples / 2);
+    for (std::size_t k = 0; k < distances.size(); ++k) {
+      // include the largest value and values with every number of digits
+      distances[k] = static_cast<TestType>(
+          k % 7 == 0 ? std::numeric_limits<TestType>::max()
+                     : value_dist(gen) >> (k % 19));
+    }
+    std::string ref;
+    std::size_t k{0};
+    for (std::size_t i = 1; i < nsamples; ++i) {
+      for (std::size_t j = 0; j < i; ++j) {
+        ref.append(std::to_string(distances[k++]));
+        ref.push_back(j + 1 < i ? ',' : '\n');
+      }
+    }
+    for (std::size_t n_partial : {std::size_t{1}, std::size_t{5},
+                                  std::size_t{1000}, distances.size()}) {
+      CAPTURE(nsamples);
+      CAPTURE(n_partial);
+      for (std::size_t offset = 0; offset < distances.size();
+           offset += n_partial) {
+        std::vector<TestType> partial(
+            distances.begin() + offset,
+            distances.begin() + std::min(offset + n_partial, distances.size()));
+        partial_write_lower_triangular(tmp_file_name, partial, offset,
+                                       partial.size());
+      }
+      REQUIRE(read_file(tmp_file_name) == ref);
+    }
+  }
+  std::remove(tmp_file_name);
+}
+
+TEMPLATE_TEST_CASE("from_binary reproduces data written by dump_binary",
+                   "[hamming]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  for (auto n : {1, 2, 3, 5, 100, 207}) {
+    for (bool remove_duplicates : {false, true}) {
+      CAPTURE(n);
+      CAPTURE(remove_duplicates);
+      std::vector<std::string> data(n);
+      for (auto &d : data) {
+        d = make_test_string(24, gen);
+      }
+      std::vector<std::size_t> sequence_indices;
+      if (remove_duplicates) {
+        for (std::size_t i = 0; i < 3 * data.size(); ++i) {
+          sequence_indices.push_back(i % data.size());
+        }
+      }
+      DataSet<TestType> ref(data, false, false, std::move(sequence_indices),
+                            false, 7);
+      ref.dump_binary(tmp_file_name);
+      auto restore{from_binary<TestType>(tmp_file_name)};
+      REQUIRE(restore.result.is_mapped());
+      REQUIRE(restore.nsamples == ref.nsamples);
+      REQUIRE(restore.result == ref.result);
+      REQUIRE(restore.sequence_indices == ref.sequence_indices);
+      REQUIRE(restore.max_distance == 7);
+      for (std::size_t i = 0; i < ref.nsamples; ++i) {
+        for (std::size_t j = 0; j < ref.nsamples; ++j) {
+          REQUIRE(ref[{i, j}] == restore[{i, j}]);
+        }
+      }
+      // the raw distances follow the 64-byte header
+      std::ifstream stream(tmp_file_name, std::ios::binary);
+      stream.seekg(64);
+      std::vector<TestType> raw(ref.result.size());
+      stream.read(reinterpret_cast<char *>(raw.data()),
+                  static_cast<std::streamsize>(raw.size() * sizeof(TestType)));
+      REQUIRE(std::equal(raw.begin(), raw.end(), ref.result.begin()));
+      stream.close();
+      // changes to a loaded DataSet are not saved to the file
+      if (!restore.result.empty()) {
+        restore.result[0] = 99;
+        REQUIRE(from_binary<TestType>(tmp_file_name).result == ref.result);
+      }
+      // copies share the mapped distances
+      auto copy{restore};
+      REQUIRE(copy.result.data() == restore.result.data());
+      copy.result.resize(copy.result.size());
+      REQUIRE(!copy.result.is_mapped());
+      REQUIRE(copy.result == restore.result);
+    }
+  }
+  // wrong distance type, truncated and invalid files
+  std::vector<std::string> data{"ACGT", "ACGG", "TTTT"};
+  DataSet<TestType> ref(data);
+  ref.dump_binary(tmp_file_name);
+  if constexpr (sizeof(TestType) == 1) {
+    REQUIRE_THROWS(from_binary<uint16_t>(tmp_file_name));
+  } else {
+    REQUIRE_THROWS(from_binary<uint8_t>(tmp_file_name));
+  }
+  std::filesystem::resize_file(tmp_file_name, 65);
+  REQUIRE_THROWS(from_binary<TestType>(tmp_file_name));
+  ref.dump_lower_triangular(tmp_file_name);
+  REQUIRE_THROWS(from_binary<TestType>(tmp_file_name));
+  // counts in the header whose offsets would overflow
+  std::string truncated{"Error: Invalid binary file '" +
+                        std::string(tmp_file_name) + "': truncated"};
+  for (auto [nsamples, n_indices] :
+       {std::pair<std::uint64_t, std::uint64_t>{std::uint64_t{1} << 32, 0},
+        {(std::uint64_t{1} << 32) + 1, 0},
+        {std::numeric_limits<std::uint64_t>::max(), 0},
+        {3, std::uint64_t{1} << 61},
+        {3, std::numeric_limits<std::uint64_t>::max()}}) {
+    CAPTURE(nsamples);
+    CAPTURE(n_indices);
+    BinaryHeader header(sizeof(TestType), 3, 0, 3);
+    header.nsamples = nsamples;
+    header.n_sequence_indices = n_indices;
+    std::ofstream stream(tmp_file_name, std::ios::binary);
+    stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    std::string contents(64, '\0');
+    stream.write(contents.data(),
+                 static_cast<std::streamsize>(contents.size()));
+    stream.close();
+    REQUIRE_THROWS_WITH(from_binary<TestType>(tmp_file_name), truncated);
+  }
+  std::remove(tmp_file_name);
+}
+
+TEMPLATE_TEST_CASE("from_fasta with distances_filename stores the distances "
+                   "in a file",
+                   "[hamming]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  char tmp_fasta_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_fasta_file_name) != nullptr);
+  char tmp_binary_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_binary_file_name) != nullptr);
+  for (std::size_t n_samples : {2, 3, 50, 1000}) {
+    for (bool remove_duplicates : {false, true}) {
+      CAPTURE(n_samples);
+      CAPTURE(remove_duplicates);
+      write_test_fasta(tmp_fasta_file_name, 100, n_samples, gen);
+      auto ref{from_fasta<TestType>(tmp_fasta_file_name, false,
+                                    remove_duplicates, 0, false, 9)};
+      {
+        auto data{from_fasta<TestType>(tmp_fasta_file_name, false,
+                                       remove_duplicates, 0, false, 9,
+                                       tmp_binary_file_name)};
+        REQUIRE(data.result.is_mapped());
+        REQUIRE(data.nsamples == ref.nsamples);
+        REQUIRE(data.result == ref.result);
+        REQUIRE(data.sequence_indices == ref.sequence_indices);
+      }
+      // the file can be loaded after the DataSet is destroyed
+      auto restore{from_binary<TestType>(tmp_binary_file_name)};
+      REQUIRE(restore.nsamples == ref.nsamples);
+      REQUIRE(restore.result == ref.result);
+      REQUIRE(restore.sequence_indices == ref.sequence_indices);
+      REQUIRE(restore.max_distance == 9);
+    }
+  }
+  std::remove(tmp_fasta_file_name);
+  std::remove(tmp_binary_file_name);
+}
+
+TEST_CASE("from_stringlist gives the same distances with both encodings",
+          "[hamming][encoding]") {
+  std::mt19937 gen(12345);
+  for (bool include_x : {false, true}) {
+    for (int n : {1, 63, 64, 65, 497}) {
+      for (int max_dist : {0, 3, 9999999}) {
+        std::vector<std::string> stringlist;
+        for (std::size_t i = 0; i < 37; ++i) {
+          stringlist.push_back(make_test_string(n, gen, include_x));
+        }
+        CAPTURE(include_x);
+        CAPTURE(n);
+        CAPTURE(max_dist);
+        auto one_hot{from_stringlist(stringlist, include_x, false, max_dist)};
+        auto bit_plane{from_stringlist(stringlist, include_x, false, max_dist,
+                                       DenseEncoding::BitPlane)};
+        REQUIRE(bit_plane.result == one_hot.result);
+      }
+    }
+  }
+}
+
 TEST_CASE("from_stringlist GPU and CPU implementations give consistent results",
           "[hamming][gpu]") {
   if (!cuda_gpu_available()) {
@@ -449,3 +732,307 @@ TEST_CASE("from_fasta_to_lower_triangular GPU consistent with CPU from_fasta",
   std::remove(tmp_fasta_file_name);
   std::remove(tmp_lt_file_name);
 }
+
+TEST_CASE("from_fasta_to_lower_triangular CPU consistent with from_fasta",
+          "[hamming]") {
+  std::mt19937 gen(12345);
+  char tmp_fasta_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_fasta_file_name) != nullptr);
+  CAPTURE(tmp_fasta_file_name);
+  char tmp_lt_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_lt_file_name) != nullptr);
+  CAPTURE(tmp_lt_file_name);
+  for (bool remove_duplicates : {false, true}) {
+    for (int max_dist : {0, 1, 3, 9999999}) {
+      for (int n_samples : {2, 3, 11, 257}) {
+        CAPTURE(remove_duplicates);
+        CAPTURE(max_dist);
+        CAPTURE(n_samples);
+        write_test_fasta(tmp_fasta_file_name, 88, n_samples, gen, false);
+        auto d{from_fasta<uint16_t>(tmp_fasta_file_name, false,
+                                    remove_duplicates, 0, false, max_dist)};
+        from_fasta_to_lower_triangular(tmp_fasta_file_name, tmp_lt_file_name,
+                                       remove_duplicates, 0, false, max_dist);
+        auto d_lt{from_lower_triangular<uint16_t>(tmp_lt_file_name)};
+        REQUIRE(d_lt.nsamples == d.nsamples);
+        REQUIRE(d_lt.result == d.result);
+      }
+    }
+  }
+  std::remove(tmp_fasta_file_name);
+  std::remove(tmp_lt_file_name);
+}
+
+TEST_CASE("fasta_reference_distances with multiple references matches "
+          "distance()",
+          "[hamming]") {
+  std::mt19937 gen(12345);
+  char tmp_fasta_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_fasta_file_name) != nullptr);
+  CAPTURE(tmp_fasta_file_name);
+  for (bool include_x : {false, true}) {
+    for (std::size_t n_samples : {1, 17, 5000}) {
+      write_test_fasta(tmp_fasta_file_name, 43, n_samples, gen, include_x);
+      auto [data, sequence_indices] = read_fasta(tmp_fasta_file_name);
+      for (std::size_t n_references : {1, 3, 4, 5, 9}) {
+        CAPTURE(include_x);
+        CAPTURE(n_samples);
+        CAPTURE(n_references);
+        std::vector<std::string> references;
+        for (std::size_t r = 0; r < n_references; ++r) {
+          references.push_back(make_test_string(43, gen, include_x));
+        }
+        auto d{fasta_reference_distances(references, tmp_fasta_file_name,
+                                         include_x)};
+        REQUIRE(d.size() == n_references * n_samples);
+        for (std::size_t r = 0; r < n_references; ++r) {
+          for (std::size_t i = 0; i < n_samples; ++i) {
+            REQUIRE(d[r * n_samples + i] ==
+                    distance(references[r], data[i], include_x));
+          }
+        }
+        auto d0{fasta_reference_distances(references[0], tmp_fasta_file_name,
+                                          include_x)};
+        REQUIRE(d0 == std::vector<ReferenceDistIntType>(
+                          d.begin(), d.begin() + n_samples));
+      }
+    }
+  }
+  REQUIRE_THROWS(fasta_reference_distances(
+      std::vector<std::string>{"ACGT"}, tmp_fasta_file_name, false));
+  std::remove(tmp_fasta_file_name);
+}
+
+TEMPLATE_TEST_CASE("dump_sparse, dump_sparse_binary and dump_sparse_npz "
+                   "write the distances in order",
+                   "[hamming]", uint8_t, uint16_t) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<int> value_dist(0, 20);
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  auto read_file = [](const std::string &filename) {
+    std::ifstream stream(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(stream),
+                       std::istreambuf_iterator<char>());
+  };
+  for (std::size_t nsamples : {1, 2, 3, 100, 2000}) {
+    std::vector<TestType> distances((nsamples - 1) * nsamples / 2);
+    for (auto &d : distances) {
+      d = static_cast<TestType>(value_dist(gen));
+    }
+    DataSet<TestType> data(std::move(distances));
+    for (int threshold : {-1, 0, 3, 20}) {
+      CAPTURE(nsamples);
+      CAPTURE(threshold);
+      std::string ref_text;
+      std::string ref_records;
+      std::string ref_rows;
+      std::string ref_cols;
+      std::string ref_data;
+      std::size_t n_elements{0};
+      for (std::size_t i = 1; i < nsamples; ++i) {
+        for (std::size_t j = 0; j < i; ++j) {
+          TestType d{static_cast<TestType>(data[{i, j}])};
+          if (d <= threshold) {
+            ref_text += fmt::format("{} {} {}\n", i, j, d);
+            auto i32{static_cast<std::int32_t>(i)};
+            auto j32{static_cast<std::int32_t>(j)};
+            ref_rows.append(reinterpret_cast<const char *>(&i32), 4);
+            ref_cols.append(reinterpret_cast<const char *>(&j32), 4);
+            ref_data.append(reinterpret_cast<const char *>(&d), sizeof(d));
+            ref_records.append(reinterpret_cast<const char *>(&i32), 4);
+            ref_records.append(reinterpret_cast<const char *>(&j32), 4);
+            ref_records.append(reinterpret_cast<const char *>(&d), sizeof(d));
+            ++n_elements;
+          }
+        }
+      }
+      data.dump_sparse(tmp_file_name, threshold);
+      REQUIRE(read_file(tmp_file_name) == ref_text);
+      data.dump_sparse_binary(tmp_file_name, threshold);
+      REQUIRE(read_file(tmp_file_name) == ref_records);
+      data.dump_sparse_npz(tmp_file_name, threshold);
+      auto npz{read_file(tmp_file_name)};
+      REQUIRE(npz.substr(0, 4) == "PK\x03\x04");
+      // each array is stored uncompressed after its .npy header
+      std::string shape{"'shape': (" + std::to_string(n_elements) +
+                        ",), }"};
+      for (const auto &[name, ref] :
+           {std::pair{"row.npy", ref_rows}, std::pair{"col.npy", ref_cols},
+            std::pair{"data.npy", ref_data}}) {
+        auto header{npz.find(shape, npz.find(name))};
+        REQUIRE(header != std::string::npos);
+        auto begin{npz.find('\n', header) + 1};
+        REQUIRE(npz.substr(begin, ref.size()) == ref);
+      }
+      REQUIRE(npz.find("coo") != std::string::npos);
+    }
+  }
+  std::remove(tmp_file_name);
+}
+
+static std::string read_file(const std::string &filename) {
+  std::ifstream stream(filename);
+  std::stringstream contents;
+  contents << stream.rdbuf();
+  return contents.str();
+}
+
+TEST_CASE("threshold_pairs matches dump_sparse of the full distances matrix",
+          "[hamming][threshold]") {
+  std::mt19937 gen(12345);
+  char tmp_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_file_name) != nullptr);
+  CAPTURE(tmp_file_name);
+  for (int n : {1, 5, 100, 1000}) {
+    for (std::size_t n_samples : {2, 3, 17, 300}) {
+      for (int threshold : {0, 1, 2, 9, 40}) {
+        CAPTURE(n);
+        CAPTURE(n_samples);
+        CAPTURE(threshold);
+        // a few clusters of similar samples, with gaps and invalid chars
+        std::vector<std::string> data;
+        std::uniform_int_distribution<> pos(0, n - 1);
+        std::uniform_int_distribution<> n_diff(0, 4);
+        std::uniform_int_distribution<> cluster(0, 2);
+        std::vector<std::string> centres{make_test_string(n, gen),
+                                         make_test_string(n, gen),
+                                         make_test_string(n, gen)};
+        for (auto &c : centres) {
+          std::replace(c.begin(), c.end(), '-', 'A');
+        }
+        for (std::size_t i = 0; i < n_samples; ++i) {
+          auto s{centres[cluster(gen)]};
+          for (auto c : make_test_string(n_diff(gen), gen, true)) {
+            s[pos(gen)] = c;
+          }
+          if (i % 3 == 0) {
+            // leading gap
+            std::fill_n(s.begin(), pos(gen) / 4, '-');
+          }
+          if (i % 7 == 0) {
+            // scattered gaps
+            for (int k = 0; k < 10; ++k) {
+              s[pos(gen)] = '-';
+            }
+          }
+          data.push_back(s);
+        }
+        std::stringstream pairs;
+        threshold_pairs(data, threshold, pairs);
+        auto d{from_stringlist(data)};
+        d.dump_sparse(tmp_file_name, threshold);
+        // the pairs are written in the same order as dump_sparse()
+        REQUIRE(pairs.str() == read_file(tmp_file_name));
+      }
+    }
+  }
+  REQUIRE_THROWS(threshold_pairs({"ACGT", "ACGT"}, -1, std::cout));
+  std::remove(tmp_file_name);
+}
+
+TEST_CASE("fasta_threshold_pairs matches dump_sparse of from_fasta",
+          "[hamming][threshold]") {
+  std::mt19937 gen(12345);
+  char tmp_fasta_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_fasta_file_name) != nullptr);
+  CAPTURE(tmp_fasta_file_name);
+  char tmp_pairs_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_pairs_file_name) != nullptr);
+  CAPTURE(tmp_pairs_file_name);
+  char tmp_sparse_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_sparse_file_name) != nullptr);
+  CAPTURE(tmp_sparse_file_name);
+  for (bool remove_duplicates : {false, true}) {
+    for (int threshold : {0, 3, 12}) {
+      CAPTURE(remove_duplicates);
+      CAPTURE(threshold);
+      write_test_fasta(tmp_fasta_file_name, 24, 100, gen, false);
+      auto sequence_indices{fasta_threshold_pairs(
+          tmp_fasta_file_name, tmp_pairs_file_name, threshold,
+          remove_duplicates)};
+      auto d{from_fasta<uint8_t>(tmp_fasta_file_name, false,
+                                 remove_duplicates)};
+      d.dump_sparse(tmp_sparse_file_name, threshold);
+      REQUIRE(read_file(tmp_pairs_file_name) ==
+              read_file(tmp_sparse_file_name));
+      if (remove_duplicates) {
+        REQUIRE(sequence_indices == d.sequence_indices);
+      } else {
+        REQUIRE(sequence_indices.size() == 100);
+        for (std::size_t i = 0; i < sequence_indices.size(); ++i) {
+          REQUIRE(sequence_indices[i] == i);
+        }
+      }
+    }
+  }
+  std::remove(tmp_fasta_file_name);
+  std::remove(tmp_pairs_file_name);
+  std::remove(tmp_sparse_file_name);
+}
+
+TEST_CASE("Progress callback is called during calculations and can cancel "
+          "them",
+          "[hamming][progress]") {
+  std::mt19937 gen(12345);
+  char tmp_fasta_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_fasta_file_name) != nullptr);
+  CAPTURE(tmp_fasta_file_name);
+  char tmp_lt_file_name[L_tmpnam];
+  REQUIRE(std::tmpnam(tmp_lt_file_name) != nullptr);
+  CAPTURE(tmp_lt_file_name);
+  std::size_t n_samples{500};
+  write_test_fasta(tmp_fasta_file_name, 64, n_samples, gen);
+  auto expected{from_fasta<uint8_t>(tmp_fasta_file_name)};
+  std::vector<std::pair<std::size_t, std::size_t>> calls;
+  auto record = [&calls](std::size_t done, std::size_t total) {
+    calls.emplace_back(done, total);
+    return true;
+  };
+  auto cancel = [&calls](std::size_t done, std::size_t total) {
+    calls.emplace_back(done, total);
+    return false;
+  };
+  {
+    // the callback is called after every chunk of samples
+    Progress progress(record, std::chrono::milliseconds{0});
+    ProgressScope scope(progress);
+    auto d{fasta_reference_distances(std::string(64, 'A'),
+                                     tmp_fasta_file_name, false)};
+    REQUIRE(d.size() == n_samples);
+    REQUIRE(!calls.empty());
+    REQUIRE(calls.back() == std::make_pair(n_samples, n_samples));
+    calls.clear();
+    auto data{from_fasta<uint8_t>(tmp_fasta_file_name)};
+    REQUIRE(data.result == expected.result);
+    for (auto [done, total] : calls) {
+      REQUIRE(done <= total);
+      REQUIRE(total == n_samples * (n_samples - 1) / 2);
+    }
+  }
+  {
+    Progress progress(cancel, std::chrono::milliseconds{0});
+    ProgressScope scope(progress);
+    REQUIRE_THROWS_AS(fasta_reference_distances(std::string(64, 'A'),
+                                                tmp_fasta_file_name, false),
+                      Cancelled);
+    REQUIRE_THROWS_AS(expected.dump_lower_triangular(tmp_lt_file_name),
+                      Cancelled);
+  }
+  {
+    // the interval limits how often the callback is called
+    calls.clear();
+    Progress progress(cancel, std::chrono::hours{1});
+    ProgressScope scope(progress);
+    expected.dump_lower_triangular(tmp_lt_file_name);
+    REQUIRE(calls.empty());
+  }
+  // without a ProgressScope there is no callback
+  calls.clear();
+  expected.dump_lower_triangular(tmp_lt_file_name);
+  REQUIRE(calls.empty());
+  REQUIRE(from_lower_triangular<uint8_t>(tmp_lt_file_name).result ==
+          expected.result);
+  std::remove(tmp_fasta_file_name);
+  std::remove(tmp_lt_file_name);
+}
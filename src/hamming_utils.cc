@@ -1 +1,316 @@
 #include "hamming/hamming_utils.hh"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#ifdef HAMMING_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hamming {
+
+#ifdef _WIN32
+
+PositionalFile::PositionalFile(const std::string &filename, bool append) {
+  HANDLE handle{CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                            nullptr, append ? OPEN_ALWAYS : CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL, nullptr)};
+  if (handle == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Error: Failed to open file '" + filename + "'");
+  }
+  handle_ = handle;
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(handle, &size) == 0) {
+    CloseHandle(handle);
+    throw std::runtime_error("Error: Failed to open file '" + filename + "'");
+  }
+  initial_size_ = static_cast<std::size_t>(size.QuadPart);
+}
+
+PositionalFile::~PositionalFile() { CloseHandle(handle_); }
+
+bool PositionalFile::write(const char *data, std::size_t size,
+                           std::size_t offset) {
+  constexpr std::size_t max_chunk{std::size_t{1} << 30};
+  while (size > 0) {
+    DWORD chunk{static_cast<DWORD>(std::min(size, max_chunk))};
+    OVERLAPPED overlapped{};
+    auto offset64{static_cast<std::uint64_t>(offset)};
+    overlapped.Offset = static_cast<DWORD>(offset64);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset64 >> 32);
+    DWORD written{0};
+    if (WriteFile(handle_, data, chunk, &written, &overlapped) == 0 ||
+        written == 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+#else
+
+PositionalFile::PositionalFile(const std::string &filename, bool append) {
+  int flags{O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC)};
+  fd_ = open(filename.c_str(), flags, 0666);
+  if (fd_ == -1) {
+    throw std::runtime_error("Error: Failed to open file '" + filename + "'");
+  }
+  struct stat st {};
+  if (fstat(fd_, &st) == -1) {
+    close(fd_);
+    throw std::runtime_error("Error: Failed to open file '" + filename + "'");
+  }
+  initial_size_ = static_cast<std::size_t>(st.st_size);
+}
+
+PositionalFile::~PositionalFile() { close(fd_); }
+
+bool PositionalFile::write(const char *data, std::size_t size,
+                           std::size_t offset) {
+  while (size > 0) {
+    auto written{pwrite(fd_, data, size, static_cast<off_t>(offset))};
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+    offset += static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+#endif
+
+#ifdef HAMMING_WITH_ZLIB
+
+static std::uint32_t crc32(std::uint32_t crc, const char *data,
+                           std::size_t size) {
+  constexpr std::size_t max_chunk{std::size_t{1} << 30};
+  while (size > 0) {
+    auto chunk{std::min(size, max_chunk)};
+    crc = static_cast<std::uint32_t>(
+        ::crc32(crc, reinterpret_cast<const Bytef *>(data),
+                static_cast<uInt>(chunk)));
+    data += chunk;
+    size -= chunk;
+  }
+  return crc;
+}
+
+static const std::string &npz_filename(const std::string &filename) {
+  return filename;
+}
+
+#else
+
+static std::uint32_t crc32(std::uint32_t, const char *, std::size_t) {
+  return 0;
+}
+
+static const std::string &npz_filename(const std::string &filename) {
+  throw std::runtime_error("Error: Cannot write npz file '" + filename +
+                           "', hammingdist was not compiled with zlib support");
+}
+
+#endif
+
+// append the little-endian n_bytes byte representation of value to str
+static void append_le(std::string &str, std::uint64_t value,
+                      std::size_t n_bytes) {
+  for (std::size_t i = 0; i < n_bytes; ++i) {
+    str.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+// zip files use zip64 extensions for all sizes and offsets, so these are not
+// limited to 32 bits
+static constexpr std::uint64_t zip64_marker{0xffffffff};
+static constexpr std::size_t local_header_size{30 + 20};
+// version 4.5 of the zip format is needed to extract zip64 files
+static constexpr std::uint64_t zip_version{45};
+// the modification date of the files is 1980-01-01
+static constexpr std::uint64_t zip_date{(1 << 5) | 1};
+
+// the header of a version 1.0 .npy file, padded with spaces and a newline to
+// a multiple of 64 bytes
+static std::string npy_header(const std::string &descr,
+                              const std::vector<std::size_t> &shape) {
+  std::string shape_str;
+  for (std::size_t i = 0; i < shape.size(); ++i) {
+    shape_str += (i == 0 ? "" : ", ") + std::to_string(shape[i]);
+  }
+  if (shape.size() == 1) {
+    shape_str += ",";
+  }
+  std::string dict{"{'descr': '" + descr +
+                   "', 'fortran_order': False, 'shape': (" + shape_str +
+                   "), }"};
+  std::size_t size{10 + dict.size() + 1};
+  dict.append((64 - size % 64) % 64, ' ');
+  dict.push_back('\n');
+  // magic string and version, which includes a zero byte
+  std::string header{"\x93NUMPY\x01\x00", 8};
+  append_le(header, dict.size(), 2);
+  return header + dict;
+}
+
+NpzFile::NpzFile(const std::string &filename)
+    : filename_{filename}, file_{npz_filename(filename), false} {}
+
+std::size_t NpzFile::add_array(const std::string &name,
+                               const std::string &descr, std::size_t item_size,
+                               const std::vector<std::size_t> &shape) {
+  Array array;
+  array.name = name + ".npy";
+  array.npy_header = npy_header(descr, shape);
+  array.offset = size_;
+  array.data_size = item_size;
+  for (auto n : shape) {
+    array.data_size *= n;
+  }
+  size_ = data_offset(array) + array.data_size;
+  arrays_.push_back(std::move(array));
+  return arrays_.size() - 1;
+}
+
+std::size_t NpzFile::data_offset(const Array &array) const {
+  return array.offset + local_header_size + array.name.size() +
+         array.npy_header.size();
+}
+
+bool NpzFile::write(std::size_t array, const char *data, std::size_t size,
+                    std::size_t offset) {
+  if (size == 0) {
+    return true;
+  }
+  std::uint32_t crc{crc32(0, data, size)};
+  {
+    std::scoped_lock lock(mutex_);
+    arrays_[array].writes.push_back({offset, size, crc});
+  }
+  return file_.write(data, size, data_offset(arrays_[array]) + offset);
+}
+
+void NpzFile::close() {
+  auto write_error = [this]() {
+    return std::runtime_error("Error: Failed to write to file '" + filename_ +
+                              "'");
+  };
+  std::string central_directory;
+  for (auto &array : arrays_) {
+    // the CRC-32 of the .npy file is that of the header and then each write
+    std::uint32_t crc{
+        crc32(0, array.npy_header.data(), array.npy_header.size())};
+    std::sort(array.writes.begin(), array.writes.end());
+    std::size_t written{0};
+    for (const auto &[offset, size, write_crc] : array.writes) {
+      if (offset != written) {
+        throw write_error();
+      }
+#ifdef HAMMING_WITH_ZLIB
+      crc = static_cast<std::uint32_t>(crc32_combine(
+          crc, static_cast<uLong>(write_crc), static_cast<z_off_t>(size)));
+#endif
+      written += size;
+    }
+    if (written != array.data_size) {
+      throw write_error();
+    }
+    std::size_t file_size{array.npy_header.size() + array.data_size};
+    std::string local_header;
+    append_le(local_header, 0x04034b50, 4);
+    append_le(local_header, zip_version, 2);
+    // flags, compression method and modification time
+    append_le(local_header, 0, 6);
+    append_le(local_header, zip_date, 2);
+    append_le(local_header, crc, 4);
+    append_le(local_header, zip64_marker, 4);
+    append_le(local_header, zip64_marker, 4);
+    append_le(local_header, array.name.size(), 2);
+    append_le(local_header, 20, 2);
+    local_header += array.name;
+    // zip64 extra field with the uncompressed and compressed sizes
+    append_le(local_header, 0x0001, 2);
+    append_le(local_header, 16, 2);
+    append_le(local_header, file_size, 8);
+    append_le(local_header, file_size, 8);
+    local_header += array.npy_header;
+    if (!file_.write(local_header.data(), local_header.size(),
+                     array.offset)) {
+      throw write_error();
+    }
+    append_le(central_directory, 0x02014b50, 4);
+    append_le(central_directory, zip_version, 2);
+    append_le(central_directory, zip_version, 2);
+    // flags, compression method and modification time
+    append_le(central_directory, 0, 6);
+    append_le(central_directory, zip_date, 2);
+    append_le(central_directory, crc, 4);
+    append_le(central_directory, zip64_marker, 4);
+    append_le(central_directory, zip64_marker, 4);
+    append_le(central_directory, array.name.size(), 2);
+    append_le(central_directory, 28, 2);
+    // comment length, disk number, internal and external attributes
+    append_le(central_directory, 0, 10);
+    append_le(central_directory, zip64_marker, 4);
+    central_directory += array.name;
+    // zip64 extra field with the sizes and the offset of the local header
+    append_le(central_directory, 0x0001, 2);
+    append_le(central_directory, 24, 2);
+    append_le(central_directory, file_size, 8);
+    append_le(central_directory, file_size, 8);
+    append_le(central_directory, array.offset, 8);
+  }
+  std::size_t central_directory_size{central_directory.size()};
+  std::size_t zip64_end_offset{size_ + central_directory_size};
+  // zip64 end of central directory record
+  std::string end;
+  append_le(end, 0x06064b50, 4);
+  append_le(end, 44, 8);
+  append_le(end, zip_version, 2);
+  append_le(end, zip_version, 2);
+  append_le(end, 0, 8);
+  append_le(end, arrays_.size(), 8);
+  append_le(end, arrays_.size(), 8);
+  append_le(end, central_directory_size, 8);
+  append_le(end, size_, 8);
+  // zip64 end of central directory locator
+  append_le(end, 0x07064b50, 4);
+  append_le(end, 0, 4);
+  append_le(end, zip64_end_offset, 8);
+  append_le(end, 1, 4);
+  // end of central directory record
+  append_le(end, 0x06054b50, 4);
+  append_le(end, 0, 4);
+  append_le(end, arrays_.size(), 2);
+  append_le(end, arrays_.size(), 2);
+  append_le(end, zip64_marker, 4);
+  append_le(end, zip64_marker, 4);
+  append_le(end, 0, 2);
+  central_directory += end;
+  if (!file_.write(central_directory.data(), central_directory.size(),
+                   size_)) {
+    throw write_error();
+  }
+}
+
+} // namespace hamming
@@ -32,7 +32,7 @@ static void bench_distance_sparse(benchmark::State &state) {
   auto s2{s1};
   // make ~0.5% of s2 elements differ from s1
   randomize_n(s2, n / 200, gen);
-  auto sparse = to_sparse_data({s1, s2}, false);
+  auto sparse = to_sparse_data(std::vector<std::string>{s1, s2}, false);
   int d{0};
   for (auto _ : state) {
     d += distance_sparse(sparse[0], sparse[1]);